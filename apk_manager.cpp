@@ -1,12 +1,14 @@
 #include "apk_manager.h"
+#include "async_log.h"
 #include "file_utils.h"
 #include <fstream>
-#include <iostream>
 
 const char* ApkManager::PKG_NAME = "com.mojang.minecraftpe";
+const char* ApkManager::NEW_VERSION_NOTIFICATION = "apk_new_version";
 
-ApkManager::ApkManager(PlayManager& playManager, JobManager& jobManager) :
-        playManager(playManager), jobManager(jobManager) {
+ApkManager::ApkManager(PlayManager& playManager, JobManager& jobManager, NotificationOutbox& notifications) :
+        playManager(playManager), jobManager(jobManager), notifications(notifications),
+        newVersionBus("ApkManager.newVersion"), checkCompletedBus("ApkManager.checkCompleted") {
     std::ifstream ifs ("priv/versioninfo.conf");
     versionCheckConfig.load(ifs);
     releaseARMVersionInfo.loadFromConfig(versionCheckConfig, "release.arm.");
@@ -72,6 +74,7 @@ void ApkManager::updateLatestVersions() {
         ApkVersionInfo& versionInfo;
         std::string versionString;
         CheckResult result;
+        ApkVersionInfo previousVersionInfo;
     };
     VariantInfo variants[8] = {
             {"release/arm", playManager.getReleaseDeviceARM(), releaseARMVersionInfo},
@@ -86,6 +89,7 @@ void ApkManager::updateLatestVersions() {
 
     bool hasAnyUpdate = false;
     for (auto& v : variants) {
+        v.previousVersionInfo = v.versionInfo;
         v.result = updateLatestVersion(v.device, v.versionInfo);
         v.versionString = v.versionInfo.versionString; // copy it because we need to access it w/o a mutex later
         hasAnyUpdate = (hasAnyUpdate || v.result.hasNewVersion);
@@ -93,24 +97,32 @@ void ApkManager::updateLatestVersions() {
 
     lastVersionUpdate = std::chrono::system_clock::now();
 
-    if (hasAnyUpdate)
-        saveVersionInfo();
-
-    lk.unlock();
     if (hasAnyUpdate) {
-        std::unique_lock<std::mutex> lk_cb(cb_mutex);
-        for (auto const& v : variants) {
+        // The notifications have to be stored before the new versions are, so that none of them can get lost; a
+        // variant whose notification couldn't be stored goes back to the old version, so that the next check finds
+        // the new one again
+        for (auto& v : variants) {
             if (!v.result.hasNewVersion)
                 continue;
-            for (auto const& cb : newVersionCallback) {
-                try {
-                    cb(v.result.versionCode, v.versionString, v.result.changelog, v.variantName);
-                } catch (std::exception& e) {
-                    std::cerr << "Error processing callback " << e.what() << "\n";
-                }
+            try {
+                notifications.append(NEW_VERSION_NOTIFICATION, ApkNewVersionEvent {v.result.versionCode,
+                        v.versionString, v.result.changelog, v.variantName}.toJson());
+            } catch (std::exception& e) {
+                AsyncLog::error("ApkManager", "Failed to store the new version notification of %s: %s",
+                                v.variantName.c_str(), e.what());
+                v.versionInfo = v.previousVersionInfo;
+                v.result.hasNewVersion = false;
             }
         }
+        saveVersionInfo();
+    }
+
+    lk.unlock();
+    for (auto const& v : variants) {
+        if (v.result.hasNewVersion)
+            newVersionBus.publish({v.result.versionCode, v.versionString, v.result.changelog, v.variantName});
     }
+    checkCompletedBus.publish(ApkCheckCompletedEvent());
 
     for (auto const& v : variants) {
         if (v.result.shouldDownload)
@@ -133,7 +145,7 @@ ApkManager::CheckResult ApkManager::updateLatestVersion(PlayDevice& device, ApkV
                 !details.payload().bulkdetailsresponse().entry(0).doc().details().has_appdetails())
             throw std::runtime_error("Invalid response: does not have details");
     } catch (std::exception& e) {
-        std::cout << "Error getting details: " << e.what() << "\n";
+        AsyncLog::warn("ApkManager", "Error getting details: %s", e.what());
         ret.hasNewVersion = false;
         ret.shouldDownload = false;
         return ret;
@@ -165,7 +177,11 @@ void ApkManager::downloadAndProcessApk(PlayDevice& device, int version, ApkVersi
     }
 }
 
-void ApkManager::downloadAndProcessApk(PlayDevice& device, int version, bool onlyNatives) {
+void ApkManager::downloadAndProcessApk(PlayDevice& device, int version, bool onlyNatives, JobPriority priority) {
+    if (jobManager.hasDuplicateJob(JobManager::getApkJobDedupKey(version), priority)) {
+        AsyncLog::info("ApkManager", "Version %i already has a job, not downloading it again", version);
+        return;
+    }
     auto links = device.getDownloadLinks("com.mojang.minecraftpe", version);
     if (onlyNatives) {
         std::vector<PlayDevice::DownloadLink> linksCopy;
@@ -177,8 +193,11 @@ void ApkManager::downloadAndProcessApk(PlayDevice& device, int version, bool onl
         return;
 
     auto job = jobManager.createJob();
+    AsyncLog::info("ApkManager", "Downloading version %i (%zu apks) for job %s", version, links.size(),
+                   job.uuid.c_str());
     ApkJobDescription apkJob;
     apkJob.versionCode = version;
+    apkJob.priority = priority;
     for (auto const &l : links) {
         device.downloadApk(l, job.dataDir + "/" + l.name + ".apk");
         apkJob.apks.emplace_back(l.name, l.name + ".apk");
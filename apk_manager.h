@@ -7,6 +7,8 @@
 #include <condition_variable>
 #include "play_manager.h"
 #include "job_manager.h"
+#include "event_bus.h"
+#include "notification_outbox.h"
 
 struct ApkVersionInfo {
     int versionCode = -1;
@@ -18,24 +20,57 @@ struct ApkVersionInfo {
     void saveToConfig(playapi::config& config, std::string const& prefix);
 };
 
+struct ApkVersionSnapshot {
+    ApkVersionInfo releaseARM, releaseARM64, releaseX86, releaseX8664;
+    ApkVersionInfo betaARM, betaARM64, betaX86, betaX8664;
+    std::chrono::system_clock::time_point lastUpdate;
+};
+
+struct ApkNewVersionEvent {
+    int versionCode;
+    std::string versionString;
+    std::string changelog;
+    std::string variant;
+
+    nlohmann::json toJson() const {
+        return {{"version_code", versionCode}, {"version_string", versionString}, {"changelog", changelog},
+                {"variant", variant}};
+    }
+
+    static ApkNewVersionEvent fromJson(nlohmann::json const& j) {
+        return {j["version_code"].get<int>(), j["version_string"].get<std::string>(),
+                j["changelog"].get<std::string>(), j["variant"].get<std::string>()};
+    }
+};
+
+struct ApkCheckCompletedEvent {
+};
+
 class ApkManager {
 
 public:
     using NewVersionCallback = std::function<void (int version, std::string const& versionString,
                                                    std::string const& changelog, std::string const& variant)>;
+    using CheckCompletedCallback = std::function<void ()>;
+    // Delivered at least once from the notification outbox, throws to have the notification redelivered
+    using NewVersionSubscriber = std::function<void (long long notificationId, ApkNewVersionEvent const& event)>;
 
 private:
 
     static const char* PKG_NAME;
+    static const char* NEW_VERSION_NOTIFICATION;
 
     std::thread thread;
-    std::mutex thread_mutex, data_mutex, cb_mutex;
+    std::mutex thread_mutex, data_mutex;
     std::condition_variable stop_cv;
     bool stopped = false;
 
     PlayManager& playManager;
     JobManager&jobManager;
-    std::vector<NewVersionCallback> newVersionCallback;
+    NotificationOutbox& notifications;
+    // The subscribers run on the threads of the buses, so that they never hold up the checks and the downloads
+    EventBus<ApkNewVersionEvent> newVersionBus;
+    EventBus<ApkCheckCompletedEvent> checkCompletedBus;
     playapi::config versionCheckConfig;
     ApkVersionInfo releaseARMVersionInfo, releaseARM64VersionInfo, releaseX86VersionInfo, releaseX8664VersionInfo;
     ApkVersionInfo betaARMVersionInfo, betaARM64VersionInfo, betaX86VersionInfo, betaX8664VersionInfo;
@@ -60,7 +95,7 @@ private:
 
 public:
 
-    ApkManager(PlayManager& playManager, JobManager& jobManager);
+    ApkManager(PlayManager& playManager, JobManager& jobManager, NotificationOutbox& notifications);
 
     ~ApkManager() {
         thread_mutex.lock();
@@ -73,9 +108,42 @@ public:
 
     void startChecking();
 
+    // For the notifiers: every new version is delivered, even if it was detected before a crash or an outage.
+    // Must be called before the outbox is started
+    void addNewVersionSubscriber(std::string const& name, NewVersionSubscriber subscriber) {
+        notifications.subscribe(name, NEW_VERSION_NOTIFICATION, [subscriber](Notification const& n) {
+            subscriber(n.id, ApkNewVersionEvent::fromJson(n.data));
+        });
+    }
+
+    // Best effort, for caches and the like
     void addNewVersionCallback(NewVersionCallback callback) {
-        std::lock_guard<std::mutex> lk(cb_mutex);
-        newVersionCallback.emplace_back(callback);
+        newVersionBus.subscribe([callback](ApkNewVersionEvent const& e) {
+            callback(e.versionCode, e.versionString, e.changelog, e.variant);
+        });
+    }
+
+    // Called after every version check, whether it found something or not
+    void addCheckCompletedCallback(CheckCompletedCallback callback) {
+        checkCompletedBus.subscribe([callback](ApkCheckCompletedEvent const&) {
+            callback();
+        });
+    }
+
+    // All the version info, taken under a single lock
+    ApkVersionSnapshot getVersionSnapshot() {
+        std::lock_guard<std::mutex> lk(data_mutex);
+        ApkVersionSnapshot ret;
+        ret.releaseARM = releaseARMVersionInfo;
+        ret.releaseARM64 = releaseARM64VersionInfo;
+        ret.releaseX86 = releaseX86VersionInfo;
+        ret.releaseX8664 = releaseX8664VersionInfo;
+        ret.betaARM = betaARMVersionInfo;
+        ret.betaARM64 = betaARM64VersionInfo;
+        ret.betaX86 = betaX86VersionInfo;
+        ret.betaX8664 = betaX8664VersionInfo;
+        ret.lastUpdate = lastVersionUpdate;
+        return ret;
     }
 
     ApkVersionInfo getReleaseARMVersionInfo() {
@@ -115,7 +183,9 @@ public:
         return lastVersionUpdate;
     }
 
-    void downloadAndProcessApk(PlayDevice& device, int version, bool onlyNatives = false);
+    // Doesn't download anything if the version is queued or being processed already
+    void downloadAndProcessApk(PlayDevice& device, int version, bool onlyNatives = false,
+                               JobPriority priority = JobPriority::NORMAL);
 
     void requestForceCheck();
 
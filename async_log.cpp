@@ -0,0 +1,181 @@
+#include "async_log.h"
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+#include <cstdio>
+#include <string>
+
+const size_t AsyncLog::TAG_SIZE;
+const size_t AsyncLog::TEXT_SIZE;
+const size_t AsyncLog::BUFFER_ENTRIES;
+
+namespace {
+
+struct LogEntry {
+    std::atomic<size_t> sequence;
+    LogLevel level;
+    std::chrono::system_clock::time_point time;
+    char tag[AsyncLog::TAG_SIZE];
+    char text[AsyncLog::TEXT_SIZE];
+};
+
+// A bounded multi-producer queue (the sequence numbers tell the producers and the writer which slots are theirs)
+LogEntry entries[AsyncLog::BUFFER_ENTRIES];
+std::atomic<size_t> enqueuePos (0);
+size_t dequeuePos = 0; // only used by the writer
+std::atomic<size_t> droppedCount (0);
+
+std::atomic<int> minLevel ((int) LogLevel::LOG_INFO);
+std::atomic<bool> running (false);
+std::thread writerThread;
+std::mutex writerMutex;
+std::condition_variable writerCv;
+bool writerStopped = false;
+AsyncLog::Sink sink;
+
+bool tryEnqueue(LogLevel level, const char* tag, const char* fmt, va_list args) {
+    size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    LogEntry* entry;
+    while (true) {
+        entry = &entries[pos % AsyncLog::BUFFER_ENTRIES];
+        size_t seq = entry->sequence.load(std::memory_order_acquire);
+        if (seq == pos) {
+            if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (seq < pos) {
+            return false; // full
+        } else {
+            pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+    entry->level = level;
+    entry->time = std::chrono::system_clock::now();
+    strncpy(entry->tag, tag, AsyncLog::TAG_SIZE - 1);
+    entry->tag[AsyncLog::TAG_SIZE - 1] = '\0';
+    vsnprintf(entry->text, AsyncLog::TEXT_SIZE, fmt, args);
+    entry->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+// Writes out the queued entries, returns false if there were none
+bool drain() {
+    bool any = false;
+    while (true) {
+        LogEntry& entry = entries[dequeuePos % AsyncLog::BUFFER_ENTRIES];
+        if (entry.sequence.load(std::memory_order_acquire) != dequeuePos + 1)
+            break;
+        Log::log(entry.level, entry.tag, "%s", entry.text);
+        if (sink)
+            sink(entry.level, entry.time, entry.tag, entry.text);
+        entry.sequence.store(dequeuePos + AsyncLog::BUFFER_ENTRIES, std::memory_order_release);
+        dequeuePos++;
+        any = true;
+    }
+    size_t dropped = droppedCount.exchange(0);
+    if (dropped > 0) {
+        char text[128];
+        snprintf(text, sizeof(text), "Dropped %zu log records, the buffer was full", dropped);
+        Log::log(LogLevel::LOG_WARN, "AsyncLog", "%s", text);
+        if (sink)
+            sink(LogLevel::LOG_WARN, std::chrono::system_clock::now(), "AsyncLog", text);
+    }
+    return any;
+}
+
+void runWriter() {
+    std::unique_lock<std::mutex> lk(writerMutex);
+    while (!writerStopped) {
+        lk.unlock();
+        bool any = drain();
+        lk.lock();
+        if (!any && !writerStopped)
+            writerCv.wait_for(lk, std::chrono::milliseconds(50));
+    }
+    lk.unlock();
+    drain();
+}
+
+}
+
+void AsyncLog::setSink(Sink s) {
+    sink = std::move(s);
+}
+
+void AsyncLog::start(LogLevel level) {
+    minLevel = (int) level;
+    for (size_t i = 0; i < BUFFER_ENTRIES; i++)
+        entries[i].sequence.store(i, std::memory_order_relaxed);
+    enqueuePos = 0;
+    dequeuePos = 0;
+    writerStopped = false;
+    writerThread = std::thread(runWriter);
+    running = true;
+}
+
+void AsyncLog::stop() {
+    if (!running)
+        return;
+    running = false;
+    {
+        std::lock_guard<std::mutex> lk(writerMutex);
+        writerStopped = true;
+    }
+    writerCv.notify_all();
+    writerThread.join();
+}
+
+LogLevel AsyncLog::parseLevel(std::string const& name, LogLevel def) {
+    if (name == "trace")
+        return LogLevel::LOG_TRACE;
+    if (name == "debug")
+        return LogLevel::LOG_DEBUG;
+    if (name == "info")
+        return LogLevel::LOG_INFO;
+    if (name == "warn")
+        return LogLevel::LOG_WARN;
+    if (name == "error")
+        return LogLevel::LOG_ERROR;
+    return def;
+}
+
+bool AsyncLog::isEnabled(LogLevel level) {
+    return (int) level >= minLevel.load(std::memory_order_relaxed);
+}
+
+void AsyncLog::vlog(LogLevel level, const char* tag, const char* fmt, va_list args) {
+    if (!isEnabled(level))
+        return;
+    if (!running) {
+        Log::vlog(level, tag, fmt, args);
+        return;
+    }
+    if (!tryEnqueue(level, tag, fmt, args)) {
+        droppedCount++;
+        return;
+    }
+    writerCv.notify_one();
+}
+
+void AsyncLog::log(LogLevel level, const char* tag, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vlog(level, tag, fmt, args);
+    va_end(args);
+}
+
+#define ASYNC_LOG_LEVEL_FUNC(name, level) \
+    void AsyncLog::name(const char* tag, const char* fmt, ...) { \
+        va_list args; \
+        va_start(args, fmt); \
+        vlog(level, tag, fmt, args); \
+        va_end(args); \
+    }
+
+ASYNC_LOG_LEVEL_FUNC(trace, LogLevel::LOG_TRACE)
+ASYNC_LOG_LEVEL_FUNC(debug, LogLevel::LOG_DEBUG)
+ASYNC_LOG_LEVEL_FUNC(info, LogLevel::LOG_INFO)
+ASYNC_LOG_LEVEL_FUNC(warn, LogLevel::LOG_WARN)
+ASYNC_LOG_LEVEL_FUNC(error, LogLevel::LOG_ERROR)
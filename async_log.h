@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdarg>
+#include <string>
+#include <chrono>
+#include <functional>
+#include <log.h>
+
+/**
+ * Leveled logging that keeps the I/O off the calling threads: records are formatted into a fixed size lock-free ring
+ * buffer and handed to the logger library by a background writer. Messages below the minimum level are dropped before
+ * being formatted, so debug dumps cost nothing in production. If the buffer is full the record is dropped and counted.
+ * Until start() is called (and after stop()) records are written synchronously.
+ */
+class AsyncLog {
+
+public:
+    // Additionally receives every written record, on the writer thread
+    using Sink = std::function<void (LogLevel level, std::chrono::system_clock::time_point time, const char* tag,
+                                     const char* text)>;
+
+    static const size_t TAG_SIZE = 32;
+    static const size_t TEXT_SIZE = 1024; // longer messages are truncated
+    static const size_t BUFFER_ENTRIES = 4096;
+
+    // Must be called before start()
+    static void setSink(Sink sink);
+
+    static void start(LogLevel minLevel);
+
+    // Writes out everything that is queued and stops the writer thread
+    static void stop();
+
+    static LogLevel parseLevel(std::string const& name, LogLevel def);
+
+    static bool isEnabled(LogLevel level);
+
+    static void vlog(LogLevel level, const char* tag, const char* fmt, va_list args);
+
+    static void log(LogLevel level, const char* tag, const char* fmt, ...) __attribute__((format(printf, 3, 4)));
+
+    static void trace(const char* tag, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+    static void debug(const char* tag, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+    static void info(const char* tag, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+    static void warn(const char* tag, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+    static void error(const char* tag, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+};
@@ -0,0 +1,23 @@
+#include "broadcast_report.h"
+#include "async_log.h"
+
+BroadcastReport::BroadcastReport(std::string name, size_t targetCount) : name(std::move(name)),
+        targetCount(targetCount), startTime(std::chrono::steady_clock::now()) {
+}
+
+void BroadcastReport::report(std::string const& target, bool success, std::string const& detail) {
+    std::lock_guard<std::mutex> lk(mutex);
+    if (!success)
+        failures.push_back({target, detail});
+    if (++reportedCount == targetCount)
+        printSummary();
+}
+
+void BroadcastReport::printSummary() {
+    auto time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime);
+    AsyncLog::info("Broadcast", "%s: delivered to %zu/%zu targets in %lli ms", name.c_str(),
+                   targetCount - failures.size(), targetCount, (long long) time.count());
+    for (auto const& f : failures)
+        AsyncLog::warn("Broadcast", "%s: failed to deliver to %s: %s", name.c_str(), f.target.c_str(),
+                       f.detail.c_str());
+}
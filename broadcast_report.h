@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+
+/**
+ * Collects the delivery result of every target of a broadcast and prints a summary once all of them have reported.
+ * Shared between the send completions, which may run on any thread.
+ */
+class BroadcastReport {
+
+private:
+    struct Failure {
+        std::string target;
+        std::string detail;
+    };
+
+    std::string name;
+    size_t targetCount;
+    std::chrono::steady_clock::time_point startTime;
+    std::mutex mutex;
+    size_t reportedCount = 0;
+    std::vector<Failure> failures;
+
+    void printSummary();
+
+public:
+    BroadcastReport(std::string name, size_t targetCount);
+
+    static std::shared_ptr<BroadcastReport> create(std::string name, size_t targetCount) {
+        return std::make_shared<BroadcastReport>(std::move(name), targetCount);
+    }
+
+    void report(std::string const& target, bool success, std::string const& detail = std::string());
+
+};
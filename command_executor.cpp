@@ -0,0 +1,84 @@
+#include "command_executor.h"
+#include "async_log.h"
+
+CommandExecutor::CommandExecutor(int threadCount, size_t maxQueued, int maxPerUser, std::chrono::seconds timeout) :
+        maxPerUser(maxPerUser), timeout(timeout), pool(threadCount, maxQueued) {
+    watchdogThread = std::thread(std::bind(&CommandExecutor::runWatchdog, this));
+}
+
+CommandExecutor::~CommandExecutor() {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        stopped = true;
+    }
+    watchdogCv.notify_all();
+    watchdogThread.join();
+}
+
+CommandExecutor::SubmitResult CommandExecutor::submit(std::string const& userId, std::string const& name, Task task,
+                                                      TimeoutCallback timeoutCallback) {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        int& count = userCommandCount[userId];
+        if (count >= maxPerUser)
+            return SubmitResult::UserLimitReached;
+        count++;
+    }
+    bool posted = pool.tryPost([this, userId, name, task, timeoutCallback]() {
+        runCommand(userId, name, task, timeoutCallback);
+    });
+    if (!posted) {
+        std::lock_guard<std::mutex> lk(mutex);
+        if (--userCommandCount[userId] == 0)
+            userCommandCount.erase(userId);
+        return SubmitResult::QueueFull;
+    }
+    return SubmitResult::Accepted;
+}
+
+void CommandExecutor::runCommand(std::string const& userId, std::string const& name, Task const& task,
+                                 TimeoutCallback const& timeoutCallback) {
+    long long id;
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        id = nextCommandId++;
+        runningCommands[id] = {name, Clock::now() + timeout, timeoutCallback};
+    }
+    try {
+        task();
+    } catch (std::exception& e) {
+        AsyncLog::error("Commands", "Command %s failed: %s", name.c_str(), e.what());
+    }
+    std::lock_guard<std::mutex> lk(mutex);
+    runningCommands.erase(id);
+    if (--userCommandCount[userId] == 0)
+        userCommandCount.erase(userId);
+}
+
+void CommandExecutor::runWatchdog() {
+    std::unique_lock<std::mutex> lk(mutex);
+    while (!stopped) {
+        watchdogCv.wait_for(lk, std::chrono::seconds(1));
+        auto now = Clock::now();
+        std::vector<TimeoutCallback> timedOut;
+        for (auto& p : runningCommands) {
+            if (p.second.timeoutCallback && now >= p.second.deadline) {
+                AsyncLog::warn("Commands", "Command %s is taking more than %lli s", p.second.name.c_str(),
+                               (long long) timeout.count());
+                timedOut.push_back(std::move(p.second.timeoutCallback));
+                p.second.timeoutCallback = TimeoutCallback();
+            }
+        }
+        if (timedOut.empty())
+            continue;
+        lk.unlock();
+        for (auto const& cb : timedOut) {
+            try {
+                cb();
+            } catch (std::exception& e) {
+                AsyncLog::error("Commands", "Command timeout callback failed: %s", e.what());
+            }
+        }
+        lk.lock();
+    }
+}
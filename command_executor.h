@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include "worker_pool.h"
+
+/**
+ * Runs chat commands on a bounded worker pool, so that the gateway loops never block on them. Each user may only
+ * have a limited number of commands queued or running at once. Commands can't be interrupted, but a watchdog calls
+ * the timeout callback of the ones running for too long.
+ */
+class CommandExecutor {
+
+public:
+    enum class SubmitResult {
+        Accepted, QueueFull, UserLimitReached
+    };
+    using Task = std::function<void ()>;
+    using TimeoutCallback = std::function<void ()>;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct RunningCommand {
+        std::string name;
+        Clock::time_point deadline;
+        TimeoutCallback timeoutCallback;
+    };
+
+    int maxPerUser;
+    std::chrono::seconds timeout;
+    std::mutex mutex;
+    std::map<std::string, int> userCommandCount;
+    std::map<long long, RunningCommand> runningCommands;
+    long long nextCommandId = 0;
+
+    std::thread watchdogThread;
+    std::condition_variable watchdogCv;
+    bool stopped = false;
+
+    WorkerPool pool;
+
+    void runWatchdog();
+
+    void runCommand(std::string const& userId, std::string const& name, Task const& task,
+                    TimeoutCallback const& timeoutCallback);
+
+public:
+    CommandExecutor(int threadCount, size_t maxQueued, int maxPerUser, std::chrono::seconds timeout);
+
+    ~CommandExecutor();
+
+    SubmitResult submit(std::string const& userId, std::string const& name, Task task,
+                        TimeoutCallback timeoutCallback);
+
+};
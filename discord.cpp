@@ -17,19 +17,86 @@ nlohmann::json discord::Api::sendRequest(playapi::http_method method, std::strin
     return json::parse(resp.get_body());
 }
 
+std::future<discord::Response> discord::Api::sendRequestAsync(std::string const& method, std::string const& path,
+                                                             std::string const& body,
+                                                             RequestQueue::CompletionCallback callback) {
+    std::unique_ptr<RequestQueue::Request> req (new RequestQueue::Request());
+    req->method = method;
+    req->url = url + path;
+    req->route = RequestQueue::getRoute(method, path);
+    req->body = body;
+    if (!authHeader.empty())
+        req->headers.emplace_back("Authorization", authHeader);
+    req->headers.emplace_back("Content-Type", "application/json");
+    req->callback = std::move(callback);
+    return requestQueue.enqueue(std::move(req));
+}
+
 std::string discord::Api::getGatewayUrl() {
     json j = sendRequest(http_method::GET, "gateway");
     return j["url"];
 }
 
-discord::Message discord::Api::createMessage(Snowflake const& channel, CreateMessageParams const& message) {
+nlohmann::json discord::Api::getGatewayBotInfo() {
+    return sendRequest(http_method::GET, "gateway/bot");
+}
+
+std::string discord::Api::buildMessageBody(CreateMessageParams const& message) {
     json j;
     j["content"] = message.content;
-    if (!message.nonce.empty())
+    if (!message.nonce.empty()) {
         j["nonce"] = message.nonce;
+        if (message.enforceNonce)
+            j["enforce_nonce"] = true;
+    }
     j["tts"] = message.tts;
     if (!message.embed.empty())
         j["embed"] = message.embed;
-    auto res = sendRequest(http_method::POST, "channels/" + channel + "/messages", j);
-    return Message::fromJson(res);
-}
\ No newline at end of file
+    return j.dump();
+}
+
+std::future<discord::Response> discord::Api::postMessage(Snowflake const& channel, std::string const& body,
+                                                        RequestQueue::CompletionCallback callback) {
+    return sendRequestAsync("POST", "channels/" + channel + "/messages", body, std::move(callback));
+}
+
+std::future<discord::Response> discord::Api::editMessage(Snowflake const& channel, Snowflake const& messageId,
+                                                        CreateMessageParams const& message,
+                                                        RequestQueue::CompletionCallback callback) {
+    json j;
+    j["content"] = message.content;
+    j["embed"] = message.embed.empty() ? json() : message.embed;
+    return sendRequestAsync("PATCH", "channels/" + channel + "/messages/" + messageId, j.dump(), std::move(callback));
+}
+
+std::vector<discord::Snowflake> discord::Api::broadcastMessageAndWait(std::string const& name,
+                                                                     std::vector<Snowflake> const& channels,
+                                                                     CreateMessageParams const& message,
+                                                                     std::map<Snowflake, Snowflake>* messageIds) {
+    std::vector<Snowflake> ret;
+    if (channels.empty())
+        return ret;
+    std::string body = buildMessageBody(message);
+    auto report = BroadcastReport::create("Discord " + name, channels.size());
+    std::vector<std::future<Response>> results;
+    for (auto const& channel : channels) {
+        // Each channel is its own rate limit bucket, so these are sent out in parallel by the request queue
+        results.push_back(postMessage(channel, body, [report, channel](Response const& r) {
+            report->report(channel, r.isSuccess(),
+                           r.statusCode != 0 ? "status " + std::to_string(r.statusCode) : r.body);
+        }));
+    }
+    for (size_t i = 0; i < channels.size(); i++) {
+        long status = 0;
+        try {
+            Response r = results[i].get();
+            status = r.statusCode;
+            if (messageIds != nullptr && r.isSuccess())
+                (*messageIds)[channels[i]] = r.getJson()["id"].get<std::string>();
+        } catch (std::exception& e) {
+        }
+        if (status == 0 || status == 429 || status >= 500)
+            ret.push_back(channels[i]);
+    }
+    return ret;
+}
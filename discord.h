@@ -3,6 +3,8 @@
 #include <string>
 #include <playapi/util/http.h>
 #include <nlohmann/json.hpp>
+#include "discord_request_queue.h"
+#include "broadcast_report.h"
 
 namespace discord {
 
@@ -31,6 +33,7 @@ struct Message {
 struct CreateMessageParams {
     std::string content;
     std::string nonce;
+    bool enforceNonce = false; // makes Discord drop a message with a nonce it has seen in the last few minutes
     bool tts = false;
     nlohmann::json embed;
 
@@ -44,6 +47,7 @@ class Api {
 private:
     std::string url;
     std::string authHeader;
+    RequestQueue requestQueue;
 
 public:
 
@@ -65,9 +69,42 @@ public:
         return sendRequest(method, path, body.dump());
     }
 
+    // Queues the request on the rate limited dispatcher; the future can be ignored if the result isn't needed
+    std::future<Response> sendRequestAsync(std::string const& method, std::string const& path,
+                                           std::string const& body = std::string(),
+                                           RequestQueue::CompletionCallback callback = RequestQueue::CompletionCallback());
+
+    std::future<Response> sendRequestAsync(std::string const& method, std::string const& path, nlohmann::json body) {
+        return sendRequestAsync(method, path, body.dump());
+    }
+
     std::string getGatewayUrl();
 
-    Message createMessage(Snowflake const& channel, CreateMessageParams const& message);
+    // The response of GET gateway/bot: the url, the recommended shard count and the session start limits
+    nlohmann::json getGatewayBotInfo();
+
+    static std::string buildMessageBody(CreateMessageParams const& message);
+
+    std::future<Response> createMessage(Snowflake const& channel, CreateMessageParams const& message) {
+        return postMessage(channel, buildMessageBody(message));
+    }
+
+    // Sends an already serialized message body
+    std::future<Response> postMessage(Snowflake const& channel, std::string const& body,
+                                      RequestQueue::CompletionCallback callback = RequestQueue::CompletionCallback());
+
+    // Replaces the content and the embed of a message sent by the bot
+    std::future<Response> editMessage(Snowflake const& channel, Snowflake const& messageId,
+                                      CreateMessageParams const& message,
+                                      RequestQueue::CompletionCallback callback = RequestQueue::CompletionCallback());
+
+    // Serializes the message once and sends it to all the channels concurrently, logging a delivery report, and waits
+    // for the results. Returns the channels that failed with an error that might go away (transport errors, rate
+    // limits, server errors); permanent failures are only reported. The ids of the sent messages are stored in
+    // messageIds if given.
+    std::vector<Snowflake> broadcastMessageAndWait(std::string const& name, std::vector<Snowflake> const& channels,
+                                                   CreateMessageParams const& message,
+                                                   std::map<Snowflake, Snowflake>* messageIds = nullptr);
 
 };
 
@@ -1,4 +1,7 @@
 #include "discord_gateway.h"
+#include "async_log.h"
+
+#include <random>
 
 using namespace playapi;
 using namespace nlohmann;
@@ -8,26 +11,68 @@ static const char* ZLIB_SUFFIX = "\x00\x00\xff\xff";
 
 const int Connection::INITIAL_RECONNECT_DELAY;
 const int Connection::MAX_RECONNECT_DELAY;
+const size_t Connection::INITIAL_INFLATE_BUFFER_SIZE;
+const int Connection::GATEWAY_VERSION;
+const int Connection::DEFAULT_INTENTS;
+const int Connection::SESSION_CHECKPOINT_INTERVAL;
+const int Connection::RESUMABLE_CLOSE_CODE;
+const int Connection::MIN_INVALID_SESSION_DELAY;
+const int Connection::MAX_INVALID_SESSION_DELAY;
+const int IdentifyLimiter::IDENTIFY_INTERVAL;
 
-std::string Connection::decompress(const char* data, size_t length) {
+size_t Connection::decompress(const char* data, size_t length) {
     zs.avail_in = (uInt) length;
     zs.next_in = (unsigned char*) data;
-    std::string out;
-    while(true) {
-        out.resize(out.size() + 4096);
-        zs.avail_out = 4096;
-        zs.next_out = (unsigned char*) (out.data() + out.size() - 4096);
+    if (inflateBuffer.size() < INITIAL_INFLATE_BUFFER_SIZE)
+        inflateBuffer.resize(INITIAL_INFLATE_BUFFER_SIZE);
+    size_t outSize = 0;
+    while (true) {
+        zs.avail_out = (uInt) (inflateBuffer.size() - outSize);
+        zs.next_out = (unsigned char*) &inflateBuffer[outSize];
         int ret = inflate(&zs, Z_SYNC_FLUSH);
         assert(ret != Z_STREAM_ERROR);
-        if (zs.avail_out != 0) {
-            out.resize(out.size() - zs.avail_out);
+        outSize = inflateBuffer.size() - zs.avail_out;
+        if (zs.avail_out != 0)
             break;
-        }
+        inflateBuffer.resize(inflateBuffer.size() * 2);
+    }
+    return outSize;
+}
+
+void Connection::handleMessage(const char* data, size_t length) {
+    if (!codec->isBinary())
+        AsyncLog::debug("Gateway", "Received: %.*s", (int) length, data);
+    Payload payload;
+    try {
+        codec->decode(data, length, payload);
+    } catch (std::exception& e) {
+        if (dynamic_cast<JsonCodec*>(codec.get()) != nullptr)
+            throw;
+        // Don't keep getting stuck on a payload we can't decode, the JSON encoding is always understood
+        AsyncLog::warn("Gateway", "Failed to decode a %s payload, falling back to JSON: %s", codec->getName(),
+                       e.what());
+        std::unique_lock<std::recursive_mutex> lock(dataMutex);
+        codec.reset(new JsonCodec());
+        if (!gatewayUrl.empty())
+            uri = buildUri();
+        if (ws != nullptr)
+            ws->close(RESUMABLE_CLOSE_CODE);
+        return;
+    }
+    handlePayload(payload);
+}
+
+void Connection::setEncoding(std::string const& encoding) {
+    std::unique_lock<std::recursive_mutex> lock(dataMutex);
+    try {
+        codec = Codec::create(encoding);
+    } catch (std::exception& e) {
+        AsyncLog::warn("Gateway", "%s, using JSON", e.what());
+        codec.reset(new JsonCodec());
     }
-    return out;
 }
 
-Connection::Connection() {
+Connection::Connection() : codec(new JsonCodec()) {
     zs.zalloc = Z_NULL;
     zs.zfree = Z_NULL;
     zs.opaque = Z_NULL;
@@ -35,7 +80,7 @@ Connection::Connection() {
     assert(ret == Z_OK);
 
     hub.onConnection([this](uWS::WebSocket<uWS::CLIENT>* ws, uWS::HttpRequest req) {
-        printf("Connected!\n");
+        AsyncLog::info("Gateway", "Connected");
         std::unique_lock<std::recursive_mutex> lock(dataMutex);
         this->ws = ws;
         inflateReset(&zs);
@@ -44,39 +89,40 @@ Connection::Connection() {
         hasReceivedACK = true;
     });
     hub.onError([this](void*) {
-        printf("Unknown error\n");
+        AsyncLog::error("Gateway", "Unknown error");
         std::unique_lock<std::recursive_mutex> lock(dataMutex);
         handleDisconnect();
     });
     hub.onDisconnection([this](uWS::WebSocket<uWS::CLIENT> *ws, int code, char *message, size_t length) {
-        printf("Disconnected! %i %s\n", code, std::string(message, length).c_str());
         std::unique_lock<std::recursive_mutex> lock(dataMutex);
         this->ws = nullptr;
+        const char* fatalReason = getFatalCloseReason(code);
+        if (fatalReason != nullptr) {
+            AsyncLog::error("Gateway", "Shard %i: Disconnected with %i (%s), not reconnecting: %.*s", shardId, code,
+                            fatalReason, (int) length, message);
+            stopLoop();
+            return;
+        }
+        AsyncLog::warn("Gateway", "Disconnected: %i %.*s", code, (int) length, message);
         handleDisconnect();
     });
     hub.onMessage([this](uWS::WebSocket<uWS::CLIENT>* ws, char* message, size_t length, uWS::OpCode opCode) {
-        std::string outp;
-        json j;
-        if (isCompressed) {
+        if (!isCompressed) {
+            handleMessage(message, length);
+            return;
+        }
+        bool isComplete = (length >= 4 && memcmp(&message[length - 4], ZLIB_SUFFIX, 4) == 0);
+        if (isComplete && compressedBuffer.empty()) {
+            // The common case of the whole message being in a single frame, no need to copy it anywhere
+            handleMessage(inflateBuffer.data(), decompress(message, length));
+        } else {
             compressedBuffer.append(message, length);
-            if (length > 4 && memcmp(&message[length - 4], ZLIB_SUFFIX, 4) == 0) {
-                outp = decompress(compressedBuffer.data(), compressedBuffer.length());
+            if (isComplete) {
+                size_t outSize = decompress(compressedBuffer.data(), compressedBuffer.length());
                 compressedBuffer.clear();
-                printf("Got compressed message: %s\n", outp.c_str());
-                j = json::parse(outp);
+                handleMessage(inflateBuffer.data(), outSize);
             }
-        } else {
-            printf("Got message: %.*s\n", (int) length, message);
-            j = json::parse(detail::input_adapter(message, length));
         }
-        Payload payload;
-        payload.op = j["op"];
-        payload.data = j["d"];
-        if (j.count("s") > 0 && j["s"] != nullptr)
-            payload.sequenceNumber = j["s"];
-        if (j.count("t") > 0 && j["t"] != nullptr)
-            payload.eventName = j["t"];
-        handlePayload(payload);
     });
 }
 
@@ -86,7 +132,7 @@ Connection::~Connection() {
 
 void Connection::connect(std::string const& uri) {
     std::unique_lock<std::recursive_mutex> lock(dataMutex);
-    printf("Connecting: %s\n", uri.c_str());
+    AsyncLog::info("Gateway", "Connecting: %s", uri.c_str());
     if (ws != nullptr || reconnectNumber != -1)
         throw std::runtime_error("Already connected");
     this->uri = uri;
@@ -98,12 +144,105 @@ void Connection::connect(std::string const& uri) {
         reconnectHandle = new uS::Async(hub.getLoop());
         reconnectHandle->start([](uS::Async*) {});
     }
+    if (postHandle == nullptr) {
+        postHandle = new uS::Async(hub.getLoop());
+        postHandle->setData(this);
+        postHandle->start([](uS::Async* handle) {
+            ((Connection*) handle->getData())->runPosted();
+        });
+    }
+    if (checkpointTimer == nullptr && sessionCheckpointCallback) {
+        checkpointTimer = new uS::Timer(hub.getLoop());
+        checkpointTimer->setData(this);
+        checkpointTimer->start([](uS::Timer* timer) {
+            ((Connection*) timer->getData())->checkpointSession(false);
+        }, SESSION_CHECKPOINT_INTERVAL, SESSION_CHECKPOINT_INTERVAL);
+    }
+}
+
+void Connection::runOnLoop(std::function<void ()> fn) {
+    std::unique_lock<std::recursive_mutex> lock(dataMutex);
+    if (postHandle == nullptr) {
+        // The loop isn't running yet
+        fn();
+        return;
+    }
+    postQueue.push_back(std::move(fn));
+    postHandle->send();
+}
+
+void Connection::runPosted() {
+    std::vector<std::function<void ()>> queue;
+    {
+        std::unique_lock<std::recursive_mutex> lock(dataMutex);
+        queue.swap(postQueue);
+    }
+    for (auto const& fn : queue)
+        fn();
+}
+
+ShardHealth Connection::getHealth() {
+    std::unique_lock<std::recursive_mutex> lock(dataMutex);
+    ShardHealth ret;
+    ret.shardId = shardId;
+    ret.connected = (ws != nullptr);
+    ret.hasSession = !sessionId.empty();
+    ret.sequenceNumber = lastSeqReceived;
+    ret.reconnectCount = totalReconnectCount;
+    ret.heartbeatLatency = heartbeatLatency;
+    ret.lastHeartbeatACK = lastHeartbeatACK;
+    return ret;
+}
+
+void Connection::checkpointSession(bool force) {
+    std::unique_lock<std::recursive_mutex> lock(dataMutex);
+    if (!sessionCheckpointCallback)
+        return;
+    if (!force && checkpointedSeq == lastSeqReceived && checkpointedSessionId == sessionId)
+        return;
+    checkpointedSessionId = sessionId;
+    checkpointedSeq = lastSeqReceived;
+    SessionCheckpointCallback callback = sessionCheckpointCallback;
+    lock.unlock();
+    callback();
+}
+
+const char* Connection::getFatalCloseReason(int code) {
+    switch (code) {
+        case 4004: return "authentication failed, check the token";
+        case 4010: return "invalid shard";
+        case 4011: return "sharding required, raise shard_count";
+        case 4012: return "invalid API version";
+        case 4013: return "invalid intents";
+        case 4014: return "disallowed intents, enable the privileged ones (eg. Message Content) in the developer "
+                          "portal or change gateway.intents";
+        default: return nullptr;
+    }
+}
+
+void Connection::stopLoop() {
+    std::unique_lock<std::recursive_mutex> lock(dataMutex);
+    // hub.run() returns once nothing is left on the loop
+    for (uS::Timer** timer : {&pingTimer, &reconnectTimer, &checkpointTimer, &identifyTimer, &invalidSessionTimer}) {
+        if (*timer != nullptr) {
+            (*timer)->stop();
+            (*timer)->close();
+            *timer = nullptr;
+        }
+    }
+    for (uS::Async** handle : {&reconnectHandle, &postHandle}) {
+        if (*handle != nullptr) {
+            (*handle)->close();
+            *handle = nullptr;
+        }
+    }
 }
 
 void Connection::handleDisconnect() {
     std::unique_lock<std::recursive_mutex> lock(dataMutex);
     long long delay = nextReconnectDelay;
     reconnectNumber++;
+    totalReconnectCount++;
     nextReconnectDelay = std::min(nextReconnectDelay * 2, MAX_RECONNECT_DELAY);
 
     if (pingTimer != nullptr) {
@@ -111,6 +250,8 @@ void Connection::handleDisconnect() {
         pingTimer->close();
         pingTimer = nullptr;
     }
+    if (!gatewayUrl.empty())
+        uri = buildUri();
     if (reconnectTimer == nullptr)
         reconnectTimer = new uS::Timer(hub.getLoop());
     else
@@ -124,24 +265,21 @@ void Connection::handleDisconnect() {
 }
 
 void Connection::sendPayload(Payload const& payload) {
-    nlohmann::json pk;
-    pk["op"] = payload.op;
-    pk["d"] = payload.data;
-    if (payload.op == Payload::Op::Dispatch) {
-        pk["s"] = payload.sequenceNumber;
-        pk["t"] = payload.eventName;
-    }
-    std::string data = pk.dump();
     std::unique_lock<std::recursive_mutex> lock(dataMutex);
     if (ws == nullptr)
         throw std::runtime_error("No connection available");
-    printf("Send message: %s\n", data.c_str());
-    ws->send(data.c_str(), data.length(), uWS::OpCode::TEXT);
+    std::string data = codec->encode(payload);
+    if (codec->isBinary())
+        AsyncLog::debug("Gateway", "Send: op %i", (int) payload.op);
+    else
+        AsyncLog::debug("Gateway", "Send: %s", data.c_str());
+    ws->send(data.c_str(), data.length(), codec->isBinary() ? uWS::OpCode::BINARY : uWS::OpCode::TEXT);
 }
 
 void Connection::sendHeartbeat() {
     std::unique_lock<std::recursive_mutex> lock(dataMutex);
     hasReceivedACK = false;
+    lastHeartbeatSent = std::chrono::steady_clock::now();
     Payload ping;
     ping.op = Payload::Op::Heartbeat;
     if (lastSeqReceived != -1)
@@ -153,20 +291,58 @@ void Connection::sendHeartbeat() {
 }
 
 void Connection::sendIdentifyRequest() {
+    std::unique_lock<std::recursive_mutex> lock(dataMutex);
+    long long delay = identifyLimiter != nullptr ? identifyLimiter->reserve(shardId).count() : 0;
+    if (delay <= 0) {
+        lock.unlock();
+        doSendIdentifyRequest();
+        return;
+    }
+    AsyncLog::info("Gateway", "Shard %i: Waiting %lli ms before identifying", shardId, delay);
+    if (identifyTimer == nullptr)
+        identifyTimer = new uS::Timer(hub.getLoop());
+    else
+        identifyTimer->stop();
+    identifyTimer->setData(this);
+    identifyTimer->start([](uS::Timer* timer) {
+        Connection* conn = ((Connection*) timer->getData());
+        std::unique_lock<std::recursive_mutex> lock(conn->dataMutex);
+        if (conn->ws == nullptr)
+            return;
+        lock.unlock();
+        conn->doSendIdentifyRequest();
+    }, (int) delay, 0);
+}
+
+void Connection::doSendIdentifyRequest() {
     std::unique_lock<std::recursive_mutex> lock(dataMutex);
     Payload reply;
     reply.op = Payload::Op::Identify;
     reply.data["token"] = token;
-    reply.data["properties"]["$os"] = "linux";
-    reply.data["properties"]["$browser"] = "updateprocessor";
+    reply.data["properties"]["os"] = "linux";
+    reply.data["properties"]["browser"] = "updateprocessor";
     reply.data["properties"]["device"] = "updateprocessor";
-    reply.data["compress"] = true;
+    // The whole connection is already zlib-stream compressed; we don't subscribe to GUILDS, so large_threshold only
+    // has to be the minimum
     reply.data["large_threshold"] = 50;
+    reply.data["intents"] = intents;
+    reply.data["shard"] = {shardId, shardCount};
     reply.data["presence"] = status.toJson();
     lock.unlock();
     sendPayload(reply);
 }
 
+void Connection::sendResumeRequest() {
+    std::unique_lock<std::recursive_mutex> lock(dataMutex);
+    Payload reply;
+    reply.op = Payload::Op::Resume;
+    reply.data["token"] = token;
+    reply.data["session_id"] = sessionId;
+    reply.data["seq"] = lastSeqReceived;
+    lock.unlock();
+    sendPayload(reply);
+}
+
 void Connection::handlePayload(Payload const& payload) {
     if (payload.op == Payload::Op::Dispatch)
         handleDispatchPayload(payload);
@@ -178,28 +354,56 @@ void Connection::handlePayload(Payload const& payload) {
         handleHeartbeatACK(payload);
     else if (payload.op == Payload::Op::InvalidSession)
         handleInvalidSessionPayload(payload);
+    else if (payload.op == Payload::Op::Reconnect)
+        ws->close(RESUMABLE_CLOSE_CODE);
 }
 
 void Connection::handleHelloPayload(Payload const& payload) {
     startHeartbeat(payload.data["heartbeat_interval"]);
 
     std::unique_lock<std::recursive_mutex> lock(dataMutex);
-    if (!sessionId.empty()) {
-        Payload reply;
-        reply.op = Payload::Op::Resume;
-        reply.data["token"] = token;
-        reply.data["session_id"] = sessionId;
-        reply.data["seq"] = lastSeqReceived;
-        lock.unlock();
-        sendPayload(reply);
-        return;
-    }
+    bool canResume = !sessionId.empty();
     lock.unlock();
-    sendIdentifyRequest();
+    if (canResume)
+        sendResumeRequest();
+    else
+        sendIdentifyRequest();
 }
 
 void Connection::handleInvalidSessionPayload(Payload const& payload) {
-    sendIdentifyRequest();
+    bool resumable = payload.data.is_boolean() && payload.data.get<bool>();
+    std::unique_lock<std::recursive_mutex> lock(dataMutex);
+    // Can also come while identifying (eg. too many at once), when there is nothing to resume
+    if (!resumable && !sessionId.empty()) {
+        sessionId.clear();
+        resumeGatewayUrl.clear();
+        lastSeqReceived = -1;
+        lock.unlock();
+        checkpointSession(true);
+        lock.lock();
+    }
+
+    static std::mt19937 random ((std::random_device()()));
+    int delay = std::uniform_int_distribution<int>(MIN_INVALID_SESSION_DELAY, MAX_INVALID_SESSION_DELAY)(random);
+    AsyncLog::warn("Gateway", "Shard %i: Invalid session, %s in %i ms", shardId,
+                   sessionId.empty() ? "identifying" : "resuming", delay);
+    if (invalidSessionTimer == nullptr)
+        invalidSessionTimer = new uS::Timer(hub.getLoop());
+    else
+        invalidSessionTimer->stop();
+    invalidSessionTimer->setData(this);
+    invalidSessionTimer->start([](uS::Timer* timer) {
+        Connection* conn = ((Connection*) timer->getData());
+        std::unique_lock<std::recursive_mutex> lock(conn->dataMutex);
+        if (conn->ws == nullptr)
+            return;
+        bool canResume = !conn->sessionId.empty();
+        lock.unlock();
+        if (canResume)
+            conn->sendResumeRequest();
+        else
+            conn->sendIdentifyRequest();
+    }, delay, 0);
 }
 
 void Connection::handleDispatchPayload(Payload const& payload) {
@@ -209,13 +413,22 @@ void Connection::handleDispatchPayload(Payload const& payload) {
     }
 
     if (payload.eventName == "READY") {
-        std::unique_lock<std::recursive_mutex> lock(dataMutex);
-        sessionId = payload.data["session_id"];
+        {
+            std::unique_lock<std::recursive_mutex> lock(dataMutex);
+            sessionId = payload.data["session_id"];
+            if (payload.data.count("resume_gateway_url") > 0)
+                resumeGatewayUrl = payload.data["resume_gateway_url"];
+        }
+        checkpointSession(true);
+    } else if (payload.eventName == "RESUMED") {
+        checkpointSession(true);
     } else if (payload.eventName == "MESSAGE_CREATE") {
         Message m = Message::fromJson(payload.data);
         std::unique_lock<std::recursive_mutex> lock(dataMutex);
-        if (messageCallback)
-            messageCallback(m);
+        MessageCallback callback = messageCallback;
+        lock.unlock();
+        if (callback)
+            callback(m);
     }
 }
 
@@ -226,13 +439,16 @@ void Connection::handleHeartbeat(Payload const& payload) {
 void Connection::handleHeartbeatACK(Payload const& payload) {
     std::unique_lock<std::recursive_mutex> lock(dataMutex);
     hasReceivedACK = true;
+    lastHeartbeatACK = std::chrono::steady_clock::now();
+    heartbeatLatency = (int) std::chrono::duration_cast<std::chrono::milliseconds>(
+            lastHeartbeatACK - lastHeartbeatSent).count();
 }
 
 bool Connection::checkReceivedHeartbeatACK() {
     std::unique_lock<std::recursive_mutex> lock(dataMutex);
     if (!hasReceivedACK) {
         lock.unlock();
-        ws->close(1001);
+        ws->close(RESUMABLE_CLOSE_CODE);
         return false;
     }
     return true;
@@ -254,13 +470,15 @@ void Connection::startHeartbeat(int interval) {
 void Connection::setStatus(StatusInfo const& status) {
     std::unique_lock<std::recursive_mutex> lock(dataMutex);
     this->status = status;
-    if (ws != nullptr) {
+    lock.unlock();
+    runOnLoop([this]() {
+        std::unique_lock<std::recursive_mutex> lock(dataMutex);
+        if (ws == nullptr)
+            return;
         Payload reply;
         reply.op = Payload::Op::StatusUpdate;
-        reply.data = status.toJson();
+        reply.data = this->status.toJson();
         lock.unlock();
         sendPayload(reply);
-    } else {
-        lock.unlock();
-    }
+    });
 }
\ No newline at end of file
@@ -1,37 +1,30 @@
 #pragma once
 
 #include "discord.h"
+#include "discord_gateway_codec.h"
 #include <uWS.h>
+#include <mutex>
+#include <vector>
+#include <chrono>
+#include <algorithm>
 
 namespace discord {
 
 namespace gateway {
 
-struct Payload {
-    enum class Op {
-        Dispatch = 0,
-        Heartbeat,
-        Identify,
-        StatusUpdate,
-        VoiceStateUpdate,
-        VoiceServerPing,
-        Resume,
-        Reconnect,
-        RequestGuildMembers,
-        InvalidSession,
-        Hello,
-        HeartbeatACK
-    };
-
-    Op op;
-    nlohmann::json data;
-    int sequenceNumber;
-    std::string eventName;
+// Gateway intents, only the events of the subscribed groups are sent to us
+namespace Intents {
+enum : int {
+    Guilds = 1 << 0,
+    GuildMessages = 1 << 9,
+    DirectMessages = 1 << 12,
+    MessageContent = 1 << 15
 };
+}
 
 struct Activity {
 
-    enum Type { Game, Streaming, Listening };
+    enum Type { Game, Streaming, Listening, Watching };
 
     std::string name;
     Type type;
@@ -58,8 +51,10 @@ struct StatusInfo {
 
     nlohmann::json toJson() const {
         nlohmann::json ret;
-        ret["since"] = since.time_since_epoch().count();
-        ret["game"] = activity.toJson();
+        ret["since"] = std::chrono::duration_cast<std::chrono::milliseconds>(since.time_since_epoch()).count();
+        ret["activities"] = nlohmann::json::array();
+        if (!activity.name.empty())
+            ret["activities"].push_back(activity.toJson());
         ret["status"] = status;
         ret["afk"] = afk;
         return ret;
@@ -68,14 +63,65 @@ struct StatusInfo {
 };
 
 
+/**
+ * Spreads out the IDENTIFYs of the shards: every max_concurrency bucket (shard id % max_concurrency) may identify once
+ * every 5 seconds. Shared between all the connections of a bot.
+ */
+class IdentifyLimiter {
+
+private:
+    std::mutex mutex;
+    std::vector<std::chrono::steady_clock::time_point> nextAvailable;
+
+public:
+    static const int IDENTIFY_INTERVAL = 5000;
+
+    explicit IdentifyLimiter(int maxConcurrency = 1) : nextAvailable((size_t) std::max(maxConcurrency, 1)) {}
+
+    // Reserves the next identify slot of the shard, returns how long to wait for it
+    std::chrono::milliseconds reserve(int shardId) {
+        std::lock_guard<std::mutex> lk(mutex);
+        auto now = std::chrono::steady_clock::now();
+        auto& next = nextAvailable[shardId % nextAvailable.size()];
+        auto slot = std::max(now, next);
+        next = slot + std::chrono::milliseconds(IDENTIFY_INTERVAL);
+        return std::chrono::duration_cast<std::chrono::milliseconds>(slot - now);
+    }
+
+};
+
+struct ShardHealth {
+    int shardId;
+    bool connected;
+    bool hasSession;
+    int sequenceNumber;
+    int reconnectCount;
+    int heartbeatLatency; // in ms, -1 if unknown
+    std::chrono::steady_clock::time_point lastHeartbeatACK;
+};
+
 class Connection {
 
 public:
     using MessageCallback = std::function<void (Message const&)>;
+    // Called on the loop thread when the session should be persisted; see setSessionCheckpointCallback
+    using SessionCheckpointCallback = std::function<void ()>;
+
+    // All we handle are message commands. Message Content is a privileged intent that has to be enabled for the bot,
+    // or the gateway closes the connection with 4014.
+    static const int DEFAULT_INTENTS = Intents::GuildMessages | Intents::DirectMessages | Intents::MessageContent;
 
 private:
     static const int INITIAL_RECONNECT_DELAY = 500;
     static const int MAX_RECONNECT_DELAY = 10 * 60 * 1000; // 10 minutes
+    static const size_t INITIAL_INFLATE_BUFFER_SIZE = 64 * 1024;
+    static const int GATEWAY_VERSION = 9;
+    static const int SESSION_CHECKPOINT_INTERVAL = 5000;
+    // Closing with 1000 or 1001 invalidates the session, use a custom code whenever we want to resume afterwards
+    static const int RESUMABLE_CLOSE_CODE = 4000;
+    // Discord wants a random wait of 1-5 s after INVALID_SESSION
+    static const int MIN_INVALID_SESSION_DELAY = 1000;
+    static const int MAX_INVALID_SESSION_DELAY = 5000;
 
     uWS::Hub hub;
     // TODO: Free those in the destructor?
@@ -83,22 +129,49 @@ private:
     uS::Timer* pingTimer = nullptr;
     uS::Timer* reconnectTimer = nullptr;
     uS::Async* reconnectHandle = nullptr;
+    uS::Timer* checkpointTimer = nullptr;
+    uS::Timer* identifyTimer = nullptr;
+    uS::Timer* invalidSessionTimer = nullptr;
+    uS::Async* postHandle = nullptr;
+    std::vector<std::function<void ()>> postQueue;
     z_stream zs;
+    std::unique_ptr<Codec> codec;
 
     std::recursive_mutex dataMutex;
+    std::string gatewayUrl;
     std::string uri;
     std::string token;
     std::string sessionId;
+    std::string resumeGatewayUrl;
     StatusInfo status;
+    int intents = DEFAULT_INTENTS;
+    int shardId = 0, shardCount = 1;
+    IdentifyLimiter* identifyLimiter = nullptr;
+    int totalReconnectCount = 0;
+    std::chrono::steady_clock::time_point lastHeartbeatSent, lastHeartbeatACK;
+    int heartbeatLatency = -1;
     int lastSeqReceived = -1;
     std::string compressedBuffer;
+    std::string inflateBuffer; // reused between messages, only ever grows
     bool isCompressed = true;
     bool hasReceivedACK = true;
     MessageCallback messageCallback;
+    SessionCheckpointCallback sessionCheckpointCallback;
+    std::string checkpointedSessionId;
+    int checkpointedSeq = -1;
     int reconnectNumber = -1;
     int nextReconnectDelay = INITIAL_RECONNECT_DELAY;
 
-    std::string decompress(const char* data, size_t length);
+    size_t decompress(const char* data, size_t length);
+
+    void handleMessage(const char* data, size_t length);
+
+    std::string buildUri() const {
+        // RESUME has to go to the URL we were given in READY
+        std::string const& url = (!sessionId.empty() && !resumeGatewayUrl.empty()) ? resumeGatewayUrl : gatewayUrl;
+        return url + "/?v=" + std::to_string(GATEWAY_VERSION) + "&encoding=" + codec->getName() +
+                "&compress=zlib-stream";
+    }
 
     void sendPayload(Payload const& payload);
 
@@ -106,6 +179,14 @@ private:
 
     void sendIdentifyRequest();
 
+    void doSendIdentifyRequest();
+
+    void sendResumeRequest();
+
+    void runPosted();
+
+    void checkpointSession(bool force);
+
     void handlePayload(Payload const& payload);
 
     void handleHelloPayload(Payload const& payload);
@@ -123,6 +204,12 @@ private:
 
     bool checkReceivedHeartbeatACK();
 
+    // Describes the close codes that reconnecting can't fix (bad token or configuration), nullptr for the others
+    static const char* getFatalCloseReason(int code);
+
+    // Lets loop() return; used when the connection gives up for good
+    void stopLoop();
+
     void handleDisconnect();
 
 public:
@@ -132,26 +219,67 @@ public:
 
     void connect(std::string const& uri);
 
+    void connectToGateway(std::string const& url) {
+        std::unique_lock<std::recursive_mutex> lock(dataMutex);
+        gatewayUrl = url;
+        connect(buildUri());
+    }
+
     void connect(Api& api) {
-        connect(api.getGatewayUrl() + "/?v=6&encoding=json&compress=zlib-stream");
+        connectToGateway(api.getGatewayUrl());
+    }
+
+    // Must be called before connect(); the limiter has to outlive the connection
+    void setShard(int id, int count, IdentifyLimiter* limiter) {
+        std::unique_lock<std::recursive_mutex> lock(dataMutex);
+        shardId = id;
+        shardCount = count;
+        identifyLimiter = limiter;
     }
 
+    int getShardId() {
+        std::unique_lock<std::recursive_mutex> lock(dataMutex);
+        return shardId;
+    }
+
+    ShardHealth getHealth();
+
+    // Runs the function on the loop thread; anything touching the socket from other threads has to go through this
+    void runOnLoop(std::function<void ()> fn);
+
+    // Must be called before connect(); unknown encodings fall back to JSON
+    void setEncoding(std::string const& encoding);
+
     void setToken(std::string const& token) {
         std::unique_lock<std::recursive_mutex> lock(dataMutex);
         this->token = token;
     }
 
-    void setSessionId(std::string const& session, int seq) {
+    // Must be called before connect()
+    void setIntents(int intents) {
+        std::unique_lock<std::recursive_mutex> lock(dataMutex);
+        this->intents = intents;
+    }
+
+    void setSessionId(std::string const& session, int seq, std::string const& resumeUrl = std::string()) {
         std::unique_lock<std::recursive_mutex> lock(dataMutex);
         sessionId = session;
         lastSeqReceived = seq;
+        resumeGatewayUrl = resumeUrl;
+        checkpointedSessionId = session;
+        checkpointedSeq = seq;
     }
 
-    inline std::string const& getSession() {
+    inline std::string getSession() {
         std::unique_lock<std::recursive_mutex> lock(dataMutex);
         return sessionId;
     }
 
+    inline std::string getResumeGatewayUrl() {
+        std::unique_lock<std::recursive_mutex> lock(dataMutex);
+        return resumeGatewayUrl;
+    }
+
     inline int getSessionSeq() {
         std::unique_lock<std::recursive_mutex> lock(dataMutex);
         return lastSeqReceived;
@@ -164,13 +292,23 @@ public:
         messageCallback = callback;
     }
 
+    // The callback runs when a session is established or lost, and periodically while the sequence number advances.
+    // Must be called before connect()
+    void setSessionCheckpointCallback(SessionCheckpointCallback const& callback) {
+        std::unique_lock<std::recursive_mutex> lock(dataMutex);
+        sessionCheckpointCallback = callback;
+    }
+
     void loop() {
         hub.run();
     }
 
     void disconnect() {
-        std::unique_lock<std::recursive_mutex> lock(dataMutex);
-        ws->close();
+        runOnLoop([this]() {
+            std::unique_lock<std::recursive_mutex> lock(dataMutex);
+            if (ws != nullptr)
+                ws->close();
+        });
     }
 
 };
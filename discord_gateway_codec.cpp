@@ -0,0 +1,503 @@
+#include "discord_gateway_codec.h"
+
+#include <set>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+
+using namespace discord::gateway;
+
+namespace {
+
+/**
+ * Builds a Payload straight from the parser events. Only op, s, t and the few fields of d that we actually use are
+ * materialized; everything else (most of GUILD_CREATE, presences, etc.) is skipped without being stored.
+ */
+class PayloadSaxHandler {
+
+private:
+    static const std::set<std::string> CAPTURED_FIELDS;
+
+    Payload& payload;
+    // Keys under which the currently open containers were opened; arrays use "[]" for their elements
+    std::vector<std::string> keyStack;
+    std::string currentKey;
+    std::string path;
+
+    bool getPath() {
+        if (keyStack.size() > 3)
+            return false;
+        path.clear();
+        for (size_t i = 1; i < keyStack.size(); i++) {
+            path += keyStack[i];
+            path += '/';
+        }
+        path += currentKey;
+        return true;
+    }
+
+    template <typename T>
+    void setField(T&& value) {
+        if (path == "d")
+            payload.data = std::forward<T>(value);
+        else if (CAPTURED_FIELDS.count(path) > 0)
+            payload.data[nlohmann::json::json_pointer(path.substr(1))] = std::forward<T>(value);
+    }
+
+public:
+    PayloadSaxHandler(Payload& payload) : payload(payload) {}
+
+    bool null() {
+        return true;
+    }
+
+    bool boolean(bool val) {
+        if (getPath())
+            setField(val);
+        return true;
+    }
+
+    bool number_integer(std::int64_t val) {
+        if (!getPath())
+            return true;
+        if (path == "op")
+            payload.op = (Payload::Op) val;
+        else if (path == "s")
+            payload.sequenceNumber = (int) val;
+        else
+            setField(val);
+        return true;
+    }
+
+    bool number_unsigned(std::uint64_t val) {
+        return number_integer((std::int64_t) val);
+    }
+
+    bool number_float(double val, std::string const&) {
+        return true;
+    }
+
+    bool string(std::string& val) {
+        if (!getPath())
+            return true;
+        if (path == "t")
+            payload.eventName = std::move(val);
+        else
+            setField(std::move(val));
+        return true;
+    }
+
+    template <typename T>
+    bool binary(T&) {
+        return true;
+    }
+
+    bool start_object(std::size_t) {
+        keyStack.push_back(std::move(currentKey));
+        currentKey.clear();
+        return true;
+    }
+
+    bool key(std::string& val) {
+        currentKey = std::move(val);
+        return true;
+    }
+
+    bool end_object() {
+        currentKey = std::move(keyStack.back());
+        keyStack.pop_back();
+        return true;
+    }
+
+    bool start_array(std::size_t) {
+        keyStack.push_back(std::move(currentKey));
+        currentKey = "[]";
+        return true;
+    }
+
+    bool end_array() {
+        return end_object();
+    }
+
+    template <typename Exception>
+    bool parse_error(std::size_t, std::string const&, Exception const&) {
+        return false;
+    }
+
+};
+
+const std::set<std::string> PayloadSaxHandler::CAPTURED_FIELDS = {
+        "d/session_id", "d/resume_gateway_url", "d/heartbeat_interval", "d/id", "d/channel_id", "d/content", "d/author/id"
+};
+
+enum EtfTag : unsigned char {
+    NEW_FLOAT_EXT = 70,
+    SMALL_INTEGER_EXT = 97,
+    INTEGER_EXT = 98,
+    FLOAT_EXT = 99,
+    ATOM_EXT = 100,
+    SMALL_TUPLE_EXT = 104,
+    LARGE_TUPLE_EXT = 105,
+    NIL_EXT = 106,
+    STRING_EXT = 107,
+    LIST_EXT = 108,
+    BINARY_EXT = 109,
+    SMALL_BIG_EXT = 110,
+    LARGE_BIG_EXT = 111,
+    SMALL_ATOM_EXT = 115,
+    MAP_EXT = 116,
+    ATOM_UTF8_EXT = 118,
+    SMALL_ATOM_UTF8_EXT = 119
+};
+const unsigned char ETF_VERSION = 131;
+
+/**
+ * Walks an ETF term and reports it to the SAX handler as if it was the equivalent JSON. Atoms are mapped to null and
+ * booleans where applicable, tuples to arrays and big integers (snowflakes) to their decimal string.
+ */
+class EtfReader {
+
+private:
+    static const int MAX_DEPTH = 256;
+
+    const unsigned char* ptr;
+    const unsigned char* end;
+    PayloadSaxHandler& handler;
+    std::string tmp;
+
+    void need(size_t n) {
+        if ((size_t) (end - ptr) < n)
+            throw std::runtime_error("ETF: Unexpected end of data");
+    }
+
+    uint8_t readU8() {
+        need(1);
+        return *(ptr++);
+    }
+
+    uint16_t readU16() {
+        need(2);
+        uint16_t ret = (uint16_t) ((ptr[0] << 8) | ptr[1]);
+        ptr += 2;
+        return ret;
+    }
+
+    uint32_t readU32() {
+        need(4);
+        uint32_t ret = ((uint32_t) ptr[0] << 24) | ((uint32_t) ptr[1] << 16) | ((uint32_t) ptr[2] << 8) | ptr[3];
+        ptr += 4;
+        return ret;
+    }
+
+    void readBytes(size_t n, std::string& out) {
+        need(n);
+        out.assign((const char*) ptr, n);
+        ptr += n;
+    }
+
+    void readBig(size_t n, std::string& out) {
+        bool negative = readU8() != 0;
+        if (n > 8)
+            throw std::runtime_error("ETF: Big integer too large");
+        need(n);
+        uint64_t val = 0;
+        for (size_t i = 0; i < n; i++)
+            val |= (uint64_t) ptr[i] << (i * 8);
+        ptr += n;
+        out = negative ? "-" + std::to_string(val) : std::to_string(val);
+    }
+
+    void readKey() {
+        uint8_t tag = readU8();
+        switch (tag) {
+            case ATOM_EXT:
+            case ATOM_UTF8_EXT:
+                readBytes(readU16(), tmp);
+                break;
+            case SMALL_ATOM_EXT:
+            case SMALL_ATOM_UTF8_EXT:
+                readBytes(readU8(), tmp);
+                break;
+            case BINARY_EXT:
+                readBytes(readU32(), tmp);
+                break;
+            case SMALL_INTEGER_EXT:
+                tmp = std::to_string(readU8());
+                break;
+            case INTEGER_EXT:
+                tmp = std::to_string((int32_t) readU32());
+                break;
+            case SMALL_BIG_EXT:
+                readBig(readU8(), tmp);
+                break;
+            default:
+                throw std::runtime_error("ETF: Unsupported map key type " + std::to_string(tag));
+        }
+        handler.key(tmp);
+    }
+
+    void readAtom(size_t n) {
+        readBytes(n, tmp);
+        if (tmp == "nil" || tmp == "null")
+            handler.null();
+        else if (tmp == "true")
+            handler.boolean(true);
+        else if (tmp == "false")
+            handler.boolean(false);
+        else
+            handler.string(tmp);
+    }
+
+    void readList(size_t n, int depth, bool hasTail) {
+        handler.start_array(n);
+        for (size_t i = 0; i < n; i++)
+            readTerm(depth + 1);
+        if (hasTail) {
+            need(1);
+            if (*ptr == NIL_EXT)
+                ptr++;
+            else
+                readTerm(depth + 1);
+        }
+        handler.end_array();
+    }
+
+public:
+    EtfReader(const char* data, size_t length, PayloadSaxHandler& handler) :
+            ptr((const unsigned char*) data), end((const unsigned char*) data + length), handler(handler) {}
+
+    bool isAtEnd() const {
+        return ptr == end;
+    }
+
+    void readVersion() {
+        if (readU8() != ETF_VERSION)
+            throw std::runtime_error("ETF: Unsupported version");
+    }
+
+    void readTerm(int depth = 0) {
+        if (depth > MAX_DEPTH)
+            throw std::runtime_error("ETF: Nesting too deep");
+        uint8_t tag = readU8();
+        switch (tag) {
+            case SMALL_INTEGER_EXT:
+                handler.number_unsigned(readU8());
+                break;
+            case INTEGER_EXT:
+                handler.number_integer((int32_t) readU32());
+                break;
+            case NEW_FLOAT_EXT: {
+                need(8);
+                uint64_t bits = 0;
+                for (int i = 0; i < 8; i++)
+                    bits = (bits << 8) | ptr[i];
+                ptr += 8;
+                double val;
+                memcpy(&val, &bits, sizeof(val));
+                handler.number_float(val, std::string());
+                break;
+            }
+            case FLOAT_EXT:
+                readBytes(31, tmp);
+                handler.number_float(strtod(tmp.c_str(), nullptr), tmp);
+                break;
+            case ATOM_EXT:
+            case ATOM_UTF8_EXT:
+                readAtom(readU16());
+                break;
+            case SMALL_ATOM_EXT:
+            case SMALL_ATOM_UTF8_EXT:
+                readAtom(readU8());
+                break;
+            case BINARY_EXT:
+                readBytes(readU32(), tmp);
+                handler.string(tmp);
+                break;
+            case SMALL_BIG_EXT:
+                readBig(readU8(), tmp);
+                handler.string(tmp);
+                break;
+            case LARGE_BIG_EXT:
+                readBig(readU32(), tmp);
+                handler.string(tmp);
+                break;
+            case NIL_EXT:
+                handler.start_array(0);
+                handler.end_array();
+                break;
+            case STRING_EXT: {
+                // A list of bytes
+                uint16_t n = readU16();
+                need(n);
+                handler.start_array(n);
+                for (uint16_t i = 0; i < n; i++)
+                    handler.number_unsigned(*(ptr++));
+                handler.end_array();
+                break;
+            }
+            case SMALL_TUPLE_EXT:
+                readList(readU8(), depth, false);
+                break;
+            case LARGE_TUPLE_EXT:
+                readList(readU32(), depth, false);
+                break;
+            case LIST_EXT:
+                readList(readU32(), depth, true);
+                break;
+            case MAP_EXT: {
+                uint32_t n = readU32();
+                handler.start_object(n);
+                for (uint32_t i = 0; i < n; i++) {
+                    readKey();
+                    readTerm(depth + 1);
+                }
+                handler.end_object();
+                break;
+            }
+            default:
+                throw std::runtime_error("ETF: Unsupported term type " + std::to_string(tag));
+        }
+    }
+
+};
+
+void etfWriteU32(std::string& out, uint32_t val) {
+    out.push_back((char) (val >> 24));
+    out.push_back((char) (val >> 16));
+    out.push_back((char) (val >> 8));
+    out.push_back((char) val);
+}
+
+void etfWriteAtom(std::string& out, const char* name) {
+    size_t len = strlen(name);
+    out.push_back((char) SMALL_ATOM_UTF8_EXT);
+    out.push_back((char) len);
+    out.append(name, len);
+}
+
+void etfWriteBinary(std::string& out, std::string const& val) {
+    out.push_back((char) BINARY_EXT);
+    etfWriteU32(out, (uint32_t) val.size());
+    out.append(val);
+}
+
+void etfWriteInteger(std::string& out, bool negative, uint64_t absVal) {
+    if (!negative && absVal <= 255) {
+        out.push_back((char) SMALL_INTEGER_EXT);
+        out.push_back((char) absVal);
+    } else if ((!negative && absVal <= 0x7fffffffULL) || (negative && absVal <= 0x80000000ULL)) {
+        out.push_back((char) INTEGER_EXT);
+        etfWriteU32(out, negative ? (uint32_t) (0 - absVal) : (uint32_t) absVal);
+    } else {
+        size_t start = out.size();
+        out.push_back((char) SMALL_BIG_EXT);
+        out.push_back(0);
+        out.push_back((char) (negative ? 1 : 0));
+        unsigned char n = 0;
+        for ( ; absVal != 0; absVal >>= 8, n++)
+            out.push_back((char) (absVal & 0xff));
+        out[start + 1] = (char) n;
+    }
+}
+
+void etfWriteTerm(std::string& out, nlohmann::json const& value) {
+    switch (value.type()) {
+        case nlohmann::json::value_t::null:
+            etfWriteAtom(out, "nil");
+            break;
+        case nlohmann::json::value_t::boolean:
+            etfWriteAtom(out, value.get<bool>() ? "true" : "false");
+            break;
+        case nlohmann::json::value_t::number_integer: {
+            int64_t val = value.get<int64_t>();
+            etfWriteInteger(out, val < 0, val < 0 ? 0 - (uint64_t) val : (uint64_t) val);
+            break;
+        }
+        case nlohmann::json::value_t::number_unsigned:
+            etfWriteInteger(out, false, value.get<uint64_t>());
+            break;
+        case nlohmann::json::value_t::number_float: {
+            double val = value.get<double>();
+            uint64_t bits;
+            memcpy(&bits, &val, sizeof(bits));
+            out.push_back((char) NEW_FLOAT_EXT);
+            for (int i = 7; i >= 0; i--)
+                out.push_back((char) (bits >> (i * 8)));
+            break;
+        }
+        case nlohmann::json::value_t::string:
+            etfWriteBinary(out, value.get_ref<std::string const&>());
+            break;
+        case nlohmann::json::value_t::array:
+            if (!value.empty()) {
+                out.push_back((char) LIST_EXT);
+                etfWriteU32(out, (uint32_t) value.size());
+                for (auto const& el : value)
+                    etfWriteTerm(out, el);
+            }
+            out.push_back((char) NIL_EXT);
+            break;
+        case nlohmann::json::value_t::object:
+            out.push_back((char) MAP_EXT);
+            etfWriteU32(out, (uint32_t) value.size());
+            for (auto it = value.begin(); it != value.end(); it++) {
+                etfWriteBinary(out, it.key());
+                etfWriteTerm(out, it.value());
+            }
+            break;
+        default:
+            throw std::runtime_error("ETF: Unsupported value type");
+    }
+}
+
+}
+
+std::unique_ptr<Codec> Codec::create(std::string const& name) {
+    if (name == "json")
+        return std::unique_ptr<Codec>(new JsonCodec());
+    if (name == "etf")
+        return std::unique_ptr<Codec>(new EtfCodec());
+    throw std::runtime_error("Unknown gateway encoding: " + name);
+}
+
+nlohmann::json Codec::toJson(Payload const& payload) {
+    nlohmann::json pk;
+    pk["op"] = payload.op;
+    pk["d"] = payload.data;
+    if (payload.op == Payload::Op::Dispatch) {
+        pk["s"] = payload.sequenceNumber;
+        pk["t"] = payload.eventName;
+    }
+    return pk;
+}
+
+void JsonCodec::decode(const char* data, size_t length, Payload& payload) {
+    PayloadSaxHandler handler (payload);
+    if (!nlohmann::json::sax_parse(data, data + length, &handler))
+        throw std::runtime_error("Failed to parse the gateway payload");
+}
+
+std::string JsonCodec::encode(Payload const& payload) {
+    return toJson(payload).dump();
+}
+
+void EtfCodec::decode(const char* data, size_t length, Payload& payload) {
+    PayloadSaxHandler handler (payload);
+    EtfReader reader (data, length, handler);
+    reader.readVersion();
+    reader.readTerm();
+    if (!reader.isAtEnd())
+        throw std::runtime_error("ETF: Trailing data after the payload");
+}
+
+std::string EtfCodec::encode(Payload const& payload) {
+    return encodeJson(toJson(payload));
+}
+
+std::string EtfCodec::encodeJson(nlohmann::json const& value) {
+    std::string ret;
+    ret.push_back((char) ETF_VERSION);
+    etfWriteTerm(ret, value);
+    return ret;
+}
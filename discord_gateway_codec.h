@@ -0,0 +1,91 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <nlohmann/json.hpp>
+
+namespace discord {
+
+namespace gateway {
+
+struct Payload {
+    enum class Op {
+        Dispatch = 0,
+        Heartbeat,
+        Identify,
+        StatusUpdate,
+        VoiceStateUpdate,
+        VoiceServerPing,
+        Resume,
+        Reconnect,
+        RequestGuildMembers,
+        InvalidSession,
+        Hello,
+        HeartbeatACK
+    };
+
+    Op op;
+    nlohmann::json data;
+    int sequenceNumber = -1;
+    std::string eventName;
+};
+
+/**
+ * Converts gateway payloads from and to their wire representation. Decoding only materializes the fields of the
+ * payload the connection uses, independently of the encoding; snowflakes are always exposed as strings.
+ */
+class Codec {
+
+public:
+    virtual ~Codec() {}
+
+    // The value of the encoding parameter of the gateway URL
+    virtual const char* getName() const = 0;
+
+    virtual bool isBinary() const = 0;
+
+    virtual void decode(const char* data, size_t length, Payload& payload) = 0;
+
+    virtual std::string encode(Payload const& payload) = 0;
+
+    static std::unique_ptr<Codec> create(std::string const& name);
+
+protected:
+    static nlohmann::json toJson(Payload const& payload);
+
+};
+
+class JsonCodec : public Codec {
+
+public:
+    const char* getName() const override { return "json"; }
+
+    bool isBinary() const override { return false; }
+
+    void decode(const char* data, size_t length, Payload& payload) override;
+
+    std::string encode(Payload const& payload) override;
+
+};
+
+/**
+ * Erlang External Term Format, as used by the gateway with encoding=etf.
+ */
+class EtfCodec : public Codec {
+
+public:
+    const char* getName() const override { return "etf"; }
+
+    bool isBinary() const override { return true; }
+
+    void decode(const char* data, size_t length, Payload& payload) override;
+
+    std::string encode(Payload const& payload) override;
+
+    static std::string encodeJson(nlohmann::json const& value);
+
+};
+
+}
+
+}
@@ -0,0 +1,233 @@
+#include "discord_request_queue.h"
+#include "async_log.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+
+using namespace discord;
+
+const int RequestQueue::MAX_ATTEMPTS;
+const int RequestQueue::GLOBAL_REQUESTS_PER_SECOND;
+
+RequestQueue::RequestQueue(int workerCount) {
+    for (int i = 0; i < workerCount; i++)
+        threads.emplace_back(std::bind(&RequestQueue::runWorker, this));
+}
+
+RequestQueue::~RequestQueue() {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        stopped = true;
+    }
+    cv.notify_all();
+    for (auto& t : threads)
+        t.join();
+}
+
+std::string RequestQueue::getRoute(std::string const& method, std::string const& path) {
+    std::string ret = method + " ";
+    std::string first;
+    size_t index = 0;
+    for (size_t i = 0; i <= path.size(); index++) {
+        size_t j = std::min(path.find('/', i), path.size());
+        std::string segment = path.substr(i, j - i);
+        bool isId = !segment.empty() && std::all_of(segment.begin(), segment.end(), ::isdigit);
+        // Only the major parameters (the channel, guild or webhook id right after the resource name) split buckets
+        if (isId && !(index == 1 && (first == "channels" || first == "guilds" || first == "webhooks")))
+            segment = ":id";
+        if (index == 0)
+            first = segment;
+        else
+            ret += '/';
+        ret += segment;
+        i = j + 1;
+    }
+    return ret;
+}
+
+std::future<Response> RequestQueue::enqueue(std::unique_ptr<Request> request) {
+    auto ret = request->promise.get_future();
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        buckets[request->route].queue.push_back(std::move(request));
+    }
+    cv.notify_one();
+    return ret;
+}
+
+RequestQueue::Bucket* RequestQueue::findReadyBucket(Clock::time_point now, Clock::time_point& nextTime) {
+    if (now < globalBlockedUntil) {
+        nextTime = globalBlockedUntil;
+        return nullptr;
+    }
+    if (now - globalWindowStart >= std::chrono::seconds(1)) {
+        globalWindowStart = now;
+        globalWindowCount = 0;
+    }
+    if (globalWindowCount >= GLOBAL_REQUESTS_PER_SECOND) {
+        nextTime = globalWindowStart + std::chrono::seconds(1);
+        return nullptr;
+    }
+    for (auto& p : buckets) {
+        Bucket& bucket = p.second;
+        if (bucket.busy || bucket.queue.empty())
+            continue;
+        if (bucket.remaining <= 0 && now < bucket.resetAt) {
+            nextTime = std::min(nextTime, bucket.resetAt);
+            continue;
+        }
+        if (bucket.remaining <= 0)
+            bucket.remaining = 1; // the window has passed, the response will tell us the actual value
+        bucket.remaining--;
+        bucket.busy = true;
+        globalWindowCount++;
+        return &bucket;
+    }
+    return nullptr;
+}
+
+bool RequestQueue::handleResponse(Bucket& bucket, std::unique_ptr<Request>& request, Response const& response) {
+    bucket.busy = false;
+    auto now = Clock::now();
+    auto it = response.headers.find("x-ratelimit-remaining");
+    if (it != response.headers.end())
+        bucket.remaining = atoi(it->second.c_str());
+    it = response.headers.find("x-ratelimit-reset-after");
+    if (it != response.headers.end())
+        bucket.resetAt = now + std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(atof(it->second.c_str())));
+
+    if (response.statusCode == 429) {
+        double retryAfter = 1.0;
+        it = response.headers.find("retry-after");
+        if (it != response.headers.end())
+            retryAfter = atof(it->second.c_str());
+        bool isGlobal = response.headers.count("x-ratelimit-global") > 0;
+        try {
+            nlohmann::json j = response.getJson();
+            if (j.count("retry_after") > 0)
+                retryAfter = j["retry_after"].get<double>() / 1000.0; // v6 reports it in milliseconds
+            isGlobal = isGlobal || j.value("global", false);
+        } catch (std::exception& e) {
+        }
+        auto retryAt = now + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(retryAfter));
+        if (isGlobal) {
+            globalBlockedUntil = retryAt;
+        } else {
+            bucket.remaining = 0;
+            bucket.resetAt = retryAt;
+        }
+        if (++request->attempt < MAX_ATTEMPTS) {
+            AsyncLog::warn("Discord", "Rate limited on %s, retrying in %.3fs", request->route.c_str(), retryAfter);
+            bucket.queue.push_front(std::move(request));
+            return true;
+        }
+    }
+    if (!response.isSuccess())
+        AsyncLog::warn("Discord", "Request %s failed with status %li: %s", request->route.c_str(),
+                       response.statusCode, response.body.c_str());
+    return false;
+}
+
+void RequestQueue::complete(Request& request, Response response, std::exception_ptr error) {
+    if (request.callback) {
+        try {
+            request.callback(response);
+        } catch (std::exception& e) {
+            AsyncLog::error("Discord", "Request %s: completion callback failed: %s", request.route.c_str(), e.what());
+        }
+    }
+    if (error)
+        request.promise.set_exception(error);
+    else
+        request.promise.set_value(std::move(response));
+}
+
+void RequestQueue::runWorker() {
+    CURL* curl = curl_easy_init(); // kept for the lifetime of the worker, so that the connection gets reused
+    std::unique_lock<std::mutex> lk(mutex);
+    while (!stopped) {
+        Clock::time_point nextTime = Clock::time_point::max();
+        Bucket* bucket = findReadyBucket(Clock::now(), nextTime);
+        if (bucket == nullptr) {
+            if (nextTime == Clock::time_point::max())
+                cv.wait(lk);
+            else
+                cv.wait_until(lk, nextTime);
+            continue;
+        }
+        std::unique_ptr<Request> request = std::move(bucket->queue.front());
+        bucket->queue.pop_front();
+        lk.unlock();
+        Response response;
+        std::exception_ptr error;
+        try {
+            response = perform(curl, *request);
+        } catch (std::exception& e) {
+            AsyncLog::warn("Discord", "Request %s failed: %s", request->route.c_str(), e.what());
+            error = std::current_exception();
+            response.body = e.what();
+        }
+        lk.lock();
+        bool retried = false;
+        if (error)
+            bucket->busy = false;
+        else
+            retried = handleResponse(*bucket, request, response);
+        cv.notify_all();
+        if (!retried) {
+            lk.unlock();
+            complete(*request, std::move(response), error);
+            lk.lock();
+        }
+    }
+    lk.unlock();
+    curl_easy_cleanup(curl);
+}
+
+static size_t curlHeaderFunc(char* buffer, size_t size, size_t nitems, void* userdata) {
+    auto& headers = *((std::map<std::string, std::string>*) userdata);
+    std::string line (buffer, size * nitems);
+    auto iof = line.find(':');
+    if (iof == std::string::npos)
+        return size * nitems;
+    std::string name = line.substr(0, iof);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    auto start = line.find_first_not_of(' ', iof + 1);
+    auto end = line.find_last_not_of("\r\n");
+    headers[name] = (start != std::string::npos && end != std::string::npos && end >= start) ?
+            line.substr(start, end - start + 1) : std::string();
+    return size * nitems;
+}
+
+static size_t curlWriteFunc(char* ptr, size_t size, size_t nmemb, void* userdata) {
+    ((std::string*) userdata)->append(ptr, size * nmemb);
+    return size * nmemb;
+}
+
+Response RequestQueue::perform(CURL* curl, Request const& request) {
+    Response ret;
+    curl_easy_reset(curl);
+    curl_easy_setopt(curl, CURLOPT_URL, request.url.c_str());
+    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, request.method.c_str());
+    if (request.method != "GET") {
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request.body.data());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) request.body.size());
+    }
+    struct curl_slist* headers = nullptr;
+    for (auto const& h : request.headers)
+        headers = curl_slist_append(headers, (h.first + ": " + h.second).c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curlHeaderFunc);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &ret.headers);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlWriteFunc);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &ret.body);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
+    CURLcode res = curl_easy_perform(curl);
+    curl_slist_free_all(headers);
+    if (res != CURLE_OK)
+        throw std::runtime_error(std::string("Failed to perform http request: ") + curl_easy_strerror(res));
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &ret.statusCode);
+    return ret;
+}
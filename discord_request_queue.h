@@ -0,0 +1,101 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <nlohmann/json.hpp>
+#include <curl/curl.h>
+
+namespace discord {
+
+struct Response {
+    long statusCode = 0;
+    std::map<std::string, std::string> headers; // the names are lowercase
+    std::string body;
+
+    bool isSuccess() const {
+        return statusCode >= 200 && statusCode < 300;
+    }
+
+    nlohmann::json getJson() const {
+        return nlohmann::json::parse(body);
+    }
+};
+
+/**
+ * Performs REST requests on its own worker threads, following the Discord rate limits. Requests are grouped into
+ * buckets by their route (the method, the path with only the major parameters kept); within a bucket requests are
+ * sent one at a time and in order. The limits are respected proactively using the X-RateLimit headers, and requests
+ * that get a 429 anyway are retried after the specified delay.
+ */
+class RequestQueue {
+
+public:
+    using Clock = std::chrono::steady_clock;
+    // Called on the worker thread once the request is done; on a transport error the status code is 0 and the body
+    // holds the error message
+    using CompletionCallback = std::function<void (Response const& response)>;
+
+    struct Request {
+        std::string method;
+        std::string url;
+        std::string route;
+        std::string body;
+        std::vector<std::pair<std::string, std::string>> headers;
+        int attempt = 0;
+        std::promise<Response> promise;
+        CompletionCallback callback;
+    };
+
+private:
+    static const int MAX_ATTEMPTS = 5;
+    static const int GLOBAL_REQUESTS_PER_SECOND = 50;
+
+    struct Bucket {
+        std::deque<std::unique_ptr<Request>> queue;
+        int remaining = 1;
+        Clock::time_point resetAt;
+        bool busy = false;
+    };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopped = false;
+    std::vector<std::thread> threads;
+    std::map<std::string, Bucket> buckets;
+    Clock::time_point globalBlockedUntil;
+    Clock::time_point globalWindowStart;
+    int globalWindowCount = 0;
+
+    // Returns a bucket that can be sent now, or sets nextTime to when one might become available
+    Bucket* findReadyBucket(Clock::time_point now, Clock::time_point& nextTime);
+
+    // Updates the bucket from the response headers; returns true if the request was requeued for a retry
+    bool handleResponse(Bucket& bucket, std::unique_ptr<Request>& request, Response const& response);
+
+    static void complete(Request& request, Response response, std::exception_ptr error);
+
+    void runWorker();
+
+    static Response perform(CURL* curl, Request const& request);
+
+public:
+    explicit RequestQueue(int workerCount = 2);
+
+    ~RequestQueue();
+
+    static std::string getRoute(std::string const& method, std::string const& path);
+
+    std::future<Response> enqueue(std::unique_ptr<Request> request);
+
+};
+
+}
@@ -0,0 +1,52 @@
+#include "discord_shard_manager.h"
+#include "async_log.h"
+
+using namespace discord::gateway;
+
+void ShardManager::init(Api& api, int shardCount) {
+    nlohmann::json info = api.getGatewayBotInfo();
+    gatewayUrl = info["url"];
+    int maxConcurrency = 1;
+    if (info.count("session_start_limit") > 0)
+        maxConcurrency = info["session_start_limit"].value("max_concurrency", 1);
+    if (shardCount <= 0)
+        shardCount = info.value("shards", 1);
+    AsyncLog::info("Gateway", "Using %i shard(s), identify concurrency: %i", shardCount, maxConcurrency);
+
+    identifyLimiter.reset(new IdentifyLimiter(maxConcurrency));
+    for (int i = 0; i < shardCount; i++) {
+        connections.emplace_back(new Connection());
+        connections.back()->setShard(i, shardCount, identifyLimiter.get());
+    }
+}
+
+void ShardManager::start() {
+    for (auto& conn : connections) {
+        Connection* c = conn.get();
+        c->connectToGateway(gatewayUrl);
+        threads.emplace_back([c]() { c->loop(); });
+    }
+}
+
+void ShardManager::join() {
+    for (auto& t : threads)
+        t.join();
+    threads.clear();
+}
+
+void ShardManager::setStatus(StatusInfo const& status) {
+    for (auto& conn : connections)
+        conn->setStatus(status);
+}
+
+void ShardManager::disconnectAll() {
+    for (auto& conn : connections)
+        conn->disconnect();
+}
+
+std::vector<ShardHealth> ShardManager::getHealth() {
+    std::vector<ShardHealth> ret;
+    for (auto& conn : connections)
+        ret.push_back(conn->getHealth());
+    return ret;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "discord_gateway.h"
+#include <thread>
+
+namespace discord {
+
+namespace gateway {
+
+/**
+ * Owns the gateway connections of a bot, one per shard, each running its own loop on a separate thread. The
+ * connections are configured by the owner between init() and start().
+ */
+class ShardManager {
+
+private:
+    std::string gatewayUrl;
+    std::unique_ptr<IdentifyLimiter> identifyLimiter;
+    std::vector<std::unique_ptr<Connection>> connections;
+    std::vector<std::thread> threads;
+
+public:
+    // A shardCount of 0 uses the number of shards recommended by Discord
+    void init(Api& api, int shardCount);
+
+    int getShardCount() const {
+        return (int) connections.size();
+    }
+
+    Connection& getShard(int shardId) {
+        return *connections[shardId];
+    }
+
+    void start();
+
+    // Blocks until all of the loops exit
+    void join();
+
+    void setStatus(StatusInfo const& status);
+
+    void disconnectAll();
+
+    std::vector<ShardHealth> getHealth();
+
+};
+
+}
+
+}
@@ -1,97 +1,256 @@
 #include "discord_state.h"
+#include "async_log.h"
+#include "win10_version_text_db.h"
 
 #include <fstream>
 #include <regex>
+#include <limits>
 
 DiscordState::DiscordState(PlayManager& playManager, ApkManager& apkManager) : playManager(playManager),
                                                                                apkManager(apkManager) {
     std::ifstream ifs("priv/discord.conf");
     discordConf.load(ifs);
 
-    broadcastChannels = discordConf.get_array("broadcast_channels", {});
-    broadcastChannelsW10 = discordConf.get_array("broadcast_channels_w10", {});
+    loadSubscriptions();
+    loadDeliveredChannels();
     std::vector<std::string> ops = discordConf.get_array("ops", {});
     operatorList = std::set<std::string>(ops.begin(), ops.end());
 
+    api.setBothAuth(discordConf.get("token"));
+    // Unbounded, so that a notification is never left without its links; new versions don't come often
+    enrichmentPool.reset(new WorkerPool(1, std::numeric_limits<size_t>::max()));
+    commandExecutor.reset(new CommandExecutor((int) discordConf.get_int("commands.threads", 4),
+                                              (size_t) discordConf.get_int("commands.max_queued", 32),
+                                              (int) discordConf.get_int("commands.max_per_user", 2),
+                                              std::chrono::seconds(discordConf.get_int("commands.timeout", 60))));
+    shards.init(api, (int) discordConf.get_int("shard_count", 1));
+
+    playapi::config sessionConf;
+    std::ifstream sessionIfs("priv/discord_session.conf");
+    if (sessionIfs)
+        sessionConf.load(sessionIfs);
+    else
+        sessionConf = discordConf;
+    // Sessions can only be resumed with the same shard layout
+    bool canResume = sessionConf.get_int("shard_count", 1) == shards.getShardCount();
+
+    discord::gateway::StatusInfo status;
+    status.since = std::chrono::system_clock::now();
+    status.status = "online";
+    status.activity.name = "over Mojang";
+    status.activity.type = discord::gateway::Activity::Watching;
+
+    for (int i = 0; i < shards.getShardCount(); i++) {
+        auto& conn = shards.getShard(i);
+        conn.setToken(discordConf.get("token"));
+        std::string prefix = "shard." + std::to_string(i) + ".";
+        if (canResume && !sessionConf.get(prefix + "session_id").empty())
+            conn.setSessionId(sessionConf.get(prefix + "session_id"),
+                              (int) sessionConf.get_int(prefix + "session_seq", -1),
+                              sessionConf.get(prefix + "resume_gateway_url"));
+        else if (canResume && i == 0)
+            conn.setSessionId(sessionConf.get("session_id"), (int) sessionConf.get_int("session_seq", -1),
+                              sessionConf.get("resume_gateway_url"));
+        conn.setSessionCheckpointCallback(std::bind(&DiscordState::storeSessionInfo, this));
+        conn.setMessageCallback(std::bind(&DiscordState::onMessage, this, std::placeholders::_1));
+        conn.setEncoding(discordConf.get("gateway.encoding", "json"));
+        conn.setIntents((int) discordConf.get_int("gateway.intents", discord::gateway::Connection::DEFAULT_INTENTS));
+    }
+    rebuildVersionReply();
+    rebuildHealthcheckText();
+    apkManager.addCheckCompletedCallback([this]() {
+        rebuildVersionReply();
+        rebuildHealthcheckText();
+    });
+
+    shards.setStatus(status);
+    shards.start();
+
+    using namespace std::placeholders;
+    releaseCoalescer.reset(new ReleaseCoalescer("DiscordReleases", "priv/discord_releases.json",
+            std::chrono::seconds(discordConf.get_int("coalesce_window", 300)), [this](ReleaseGroup const& group) {
+                return subscriptions.matchTargets(group.getTopics())["embed"];
+            },
+            std::bind(&DiscordState::sendRelease, this, _1, _2, _3),
+            std::bind(&DiscordState::editRelease, this, _1, _2, _3, _4)));
+    releaseCoalescer->start();
+
+    apkManager.addNewVersionSubscriber("discord.apk", std::bind(&DiscordState::onNewVersion, this, _1, _2));
+}
+
+DiscordState::~DiscordState() {
+    releaseCoalescer->stop();
+    enrichmentPool.reset();
+}
+
+void DiscordState::loadSubscriptions() {
+    // "<channel> [platform=android,win10] [track=release,beta,preview] [arch=arm64,x64,...] [format=embed|json]"
+    for (auto const& s : discordConf.get_array("subscriptions", {})) {
+        Subscription subscription = SubscriptionRegistry::parse(s, "embed");
+        if (subscription.format != "embed" && subscription.format != "json")
+            throw std::runtime_error("Unknown subscription format: " + subscription.format);
+        subscriptions.add(std::move(subscription));
+    }
+
+    // The older settings map onto subscriptions as well
+    for (auto const& c : discordConf.get_array("broadcast_channels", {}))
+        subscriptions.add({c, "embed", {"android"}, {}, {}});
+    for (auto const& c : discordConf.get_array("broadcast_channels_w10", {}))
+        subscriptions.add({c, "embed", {"win10"}, {}, {}});
     for (auto const& s : discordConf.get_array("json_notify", {})) {
         auto j = s.find(';');
         if (j == std::string::npos)
             continue;
-        JsonNotifyRule rule;
-        rule.channel = s.substr(0, j);
+        Subscription subscription {s.substr(0, j), "json", {"win10"}, {}, {}};
         for (auto i = j + 1; i != std::string::npos; ) {
             j = s.find(';', i);
             auto text = j != std::string::npos ? s.substr(i, j - i) : s.substr(i);
             if (text == "W10Release")
-                rule.notifyW10Release = true;
+                subscription.tracks.insert("release");
             if (text == "W10Beta")
-                rule.notifyW10Beta = true;
+                subscription.tracks.insert({"beta", "preview", "unknown"});
             i = j != std::string::npos ? (j + 1) : j;
         }
-        jsonNotifyRules.push_back(std::move(rule));
+        if (!subscription.tracks.empty())
+            subscriptions.add(std::move(subscription));
     }
+}
 
-    api.setBothAuth(discordConf.get("token"));
-    conn.setToken(discordConf.get("token"));
-    conn.setSessionId(discordConf.get("session_id"), discordConf.get_int("session_seq"));
-    conn.setMessageCallback(std::bind(&DiscordState::onMessage, this, std::placeholders::_1));
-    conn.connect(api);
-
-    discord::gateway::StatusInfo status;
-    status.since = std::chrono::system_clock::now();
-    status.status = "online";
-    status.activity.name = "over Mojang";
-    status.activity.type = (discord::gateway::Activity::Type) 3;
-    conn.setStatus(status);
-
-    using namespace std::placeholders;
-    apkManager.addNewVersionCallback(std::bind(&DiscordState::onNewVersion, this, _1, _2, _3, _4));
+std::string DiscordState::getWin10Track(Win10VersionType type) {
+    if (type == Win10VersionType::Release)
+        return "release";
+    if (type == Win10VersionType::Beta)
+        return "beta";
+    if (type == Win10VersionType::Preview)
+        return "preview";
+    return "unknown";
 }
 
 void DiscordState::addWin10StoreMgr(Win10StoreManager &mgr) {
     using namespace std::placeholders;
-    mgr.addNewVersionCallback(std::bind(&DiscordState::onNewWin10Version, this, _1, _2, _3));
+    mgr.addNewVersionSubscriber("discord.win10", std::bind(&DiscordState::onNewWin10Version, this, _1, _2));
+    mgr.addCheckCompletedCallback(std::bind(&DiscordState::rebuildHealthcheckText, this));
     win10StoreManager = &mgr;
+    rebuildHealthcheckText();
+}
+
+const std::set<std::string> DiscordState::COMMANDS = {
+        "!version", "!get_version", "!force_check", "!force_download_arm", "!kill", "!getip", "!link", "!dl",
+        "!all_em_apks", "!healthcheck", "!restartbot", "!cleargplay"
+};
+
+static std::string formatTime(std::chrono::system_clock::time_point time) {
+    std::time_t t = std::chrono::system_clock::to_time_t(time);
+    char tt[512];
+    if (!std::strftime(tt, sizeof(tt), "%F %T UTC", std::gmtime(&t)))
+        tt[0] = '\0';
+    return tt;
+}
+
+static std::string formatFileSize(long long size) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.1f MB", size / (1024.0 * 1024.0));
+    return buf;
+}
+
+void DiscordState::rebuildVersionReply() {
+    ApkVersionSnapshot v = apkManager.getVersionSnapshot();
+    discord::CreateMessageParams params ("Here's a list of the currently available Minecraft versions:");
+    params.embed["title"] = "Minecraft versions";
+    params.embed["fields"][0]["name"] = "Release";
+    params.embed["fields"][0]["value"] = buildVersionFieldString(v.releaseARM, v.releaseX86, v.releaseARM64,
+                                                                 v.releaseX8664);
+    params.embed["fields"][1]["name"] = "Beta";
+    params.embed["fields"][1]["value"] = buildVersionFieldString(v.betaARM, v.betaX86, v.betaARM64, v.betaX8664);
+    params.embed["footer"]["text"] = "Checked on " + formatTime(v.lastUpdate);
+    std::shared_ptr<const std::string> body (new std::string(discord::Api::buildMessageBody(params)));
+    std::lock_guard<std::mutex> lk(replyCacheMutex);
+    versionReply = std::move(body);
+}
+
+void DiscordState::rebuildHealthcheckText() {
+    ApkVersionSnapshot v = apkManager.getVersionSnapshot();
+    std::stringstream ss;
+    ss << "**Android**\n";
+    ss << "arm64 rel: " << formatTime(v.releaseARM64.lastSuccess);
+    ss << "\narm32 rel: " << formatTime(v.releaseARM.lastSuccess);
+    ss << "\narm64 beta: " << formatTime(v.betaARM64.lastSuccess);
+    ss << "\narm32 beta: " << formatTime(v.betaARM.lastSuccess);
+    if (win10StoreManager) {
+        ss << "\n**Windows**\n";
+        ss << "last check: " << formatTime(win10StoreManager->getLastSuccessfulCheck());
+    }
+    std::lock_guard<std::mutex> lk(replyCacheMutex);
+    healthcheckText = ss.str();
+}
+
+std::string DiscordState::buildHealthcheckReply() {
+    std::stringstream ss;
+    {
+        std::lock_guard<std::mutex> lk(replyCacheMutex);
+        ss << healthcheckText;
+    }
+    // The shard state changes all the time and is cheap to get, so it is not cached
+    ss << "\n**Discord**";
+    auto now = std::chrono::steady_clock::now();
+    for (auto const& h : shards.getHealth()) {
+        ss << "\nshard " << h.shardId << ": " << (h.connected ? "connected" : "disconnected")
+           << ", seq " << h.sequenceNumber << ", reconnects " << h.reconnectCount;
+        if (h.heartbeatLatency >= 0)
+            ss << ", latency " << h.heartbeatLatency << " ms, last ACK "
+               << std::chrono::duration_cast<std::chrono::seconds>(now - h.lastHeartbeatACK).count() << "s ago";
+    }
+    return ss.str();
 }
 
 void DiscordState::onMessage(discord::Message const& m) {
+    // This runs on a gateway loop: only parse the command here, the handlers may block on network requests
+    std::string command = m.content.substr(0, m.content.find(' '));
+    if (COMMANDS.count(command) == 0)
+        return;
+    // The status commands are answered from the prebuilt replies right away
+    if (command == "!version" || command == "!get_version") {
+        std::shared_ptr<const std::string> reply;
+        {
+            std::lock_guard<std::mutex> lk(replyCacheMutex);
+            reply = versionReply;
+        }
+        api.postMessage(m.channel, *reply);
+        return;
+    }
+    if (command == "!healthcheck") {
+        if (checkOp(m))
+            api.createMessage(m.channel, buildHealthcheckReply());
+        return;
+    }
+    auto result = commandExecutor->submit(m.author_id, command, std::bind(&DiscordState::executeCommand, this, m),
+            [this, m, command]() {
+        api.createMessage(m.channel, "`" + command + "` is taking longer than expected, I'll reply once it's done");
+    });
+    if (result == CommandExecutor::SubmitResult::QueueFull)
+        api.createMessage(m.channel, "I'm a bit busy right now, please try again in a moment");
+    else if (result == CommandExecutor::SubmitResult::UserLimitReached)
+        api.createMessage(m.channel, "Please wait for your previous commands to finish");
+}
+
+void DiscordState::executeCommand(discord::Message const& m) {
     if (m.content.size() > 0 && m.content[0] == '!') {
         std::string command = m.content;
         auto it = command.find(' ');
         if (it != std::string::npos)
             command = m.content.substr(0, it);
-        if (command == "!version" || command == "!get_version") {
-            std::time_t t = std::chrono::system_clock::to_time_t(apkManager.getLastUpdateTime());
-            char tt[512];
-            if (!std::strftime(tt, sizeof(tt), "%F %T UTC", std::gmtime(&t)))
-                tt[0] = '\0';
-
-            discord::CreateMessageParams params ("Here's a list of the currently available Minecraft versions:");
-            params.embed["title"] = "Minecraft versions";
-            params.embed["fields"][0]["name"] = "Release";
-            params.embed["fields"][0]["value"] = buildVersionFieldString(apkManager.getReleaseARMVersionInfo(),
-                    apkManager.getReleaseX86VersionInfo(), apkManager.getReleaseARM64VersionInfo(),
-                    apkManager.getReleaseX8664VersionInfo());
-            params.embed["fields"][1]["name"] = "Beta";
-            params.embed["fields"][1]["value"] = buildVersionFieldString(apkManager.getBetaARMVersionInfo(),
-                    apkManager.getBetaX86VersionInfo(), apkManager.getBetaARM64VersionInfo(),
-                    apkManager.getBetaX8664VersionInfo());
-            params.embed["footer"]["text"] = std::string("Checked on ") + tt;
-            try {
-                api.createMessage(m.channel, params);
-            } catch (std::exception& e) {
-            }
-        } else if (command == "!force_check" && checkOp(m)) {
+        if (command == "!force_check" && checkOp(m)) {
             apkManager.requestForceCheck();
             api.createMessage(m.channel, "Did force check!");
         } else if (command == "!force_download_arm" && checkOp(m)) {
             try {
-                apkManager.downloadAndProcessApk(playManager.getBetaDeviceARM(), std::stoi(m.content.substr(it + 1)));
+                apkManager.downloadAndProcessApk(playManager.getBetaDeviceARM(), std::stoi(m.content.substr(it + 1)),
+                                                 false, JobPriority::URGENT);
             } catch(std::exception& e) {
                 api.createMessage(m.channel, "Failed to download the apk");
             }
         } else if (command == "!kill" && checkOp(m)) {
-            conn.disconnect();
+            shards.disconnectAll();
         } else if (command == "!getip" && checkOp(m)) {
             try {
                 playapi::http_request req ("http://api.ipify.org/");
@@ -171,39 +330,13 @@ void DiscordState::onMessage(discord::Message const& m) {
             } catch (std::exception& e) {
                 api.createMessage(m.channel, "Error getting version info");
             }
-        } else if (command == "!healthcheck" && checkOp(m)) {
-            std::stringstream ss;
-
-            auto print_time = [&](std::chrono::system_clock::time_point time) {
-                std::time_t t = std::chrono::system_clock::to_time_t(time);
-                char tt[512];
-                if (!std::strftime(tt, sizeof(tt), "%F %T UTC", std::gmtime(&t)))
-                    tt[0] = '\0';
-                ss << tt;
-            };
-
-            ss << "**Android**\n";
-            ss << "arm64 rel: ";
-            print_time(apkManager.getReleaseARM64VersionInfo().lastSuccess);
-            ss << "\narm32 rel: ";
-            print_time(apkManager.getReleaseARMVersionInfo().lastSuccess);
-            ss << "\narm64 beta: ";
-            print_time(apkManager.getBetaARM64VersionInfo().lastSuccess);
-            ss << "\narm32 beta: ";
-            print_time(apkManager.getBetaARMVersionInfo().lastSuccess);
-
-            if (win10StoreManager) {
-                ss << "\n**Windows**\n";
-                ss << "last check: ";
-                print_time(win10StoreManager->getLastSuccessfulCheck());
-            }
-
-            api.createMessage(m.channel, ss.str());
         } else if (command == "!restartbot" && checkOp(m)) {
+            storeSessionInfo();
             char *const argv[] = {(char *) "/proc/self/exe", nullptr};
             execv("/proc/self/exe", argv);
         } else if (command == "!cleargplay" && checkOp(m)) {
             playManager.deleteStateData();
+            storeSessionInfo();
             char *const argv[] = {(char *) "/proc/self/exe", nullptr};
             execv("/proc/self/exe", argv);
         }
@@ -228,42 +361,144 @@ bool DiscordState::checkOp(discord::Message const& m) {
 }
 
 void DiscordState::loop() {
-    conn.loop();
+    shards.join();
 }
 
 void DiscordState::storeSessionInfo() {
-    printf("Storing session information\n");
-    discordConf.set("session_id", conn.getSession());
-    discordConf.set_int("session_seq", conn.getSessionSeq());
-    std::ofstream ofs("priv/discord.conf");
-    discordConf.save(ofs);
+    // Kept out of discord.conf so that the frequent checkpoints never rewrite the main configuration
+    std::lock_guard<std::mutex> lk(sessionMutex);
+    playapi::config sessionConf;
+    sessionConf.set_int("shard_count", shards.getShardCount());
+    for (int i = 0; i < shards.getShardCount(); i++) {
+        auto& conn = shards.getShard(i);
+        std::string prefix = "shard." + std::to_string(i) + ".";
+        sessionConf.set(prefix + "session_id", conn.getSession());
+        sessionConf.set_int(prefix + "session_seq", conn.getSessionSeq());
+        sessionConf.set(prefix + "resume_gateway_url", conn.getResumeGatewayUrl());
+    }
+    {
+        std::ofstream ofs("priv/discord_session.conf.new");
+        sessionConf.save(ofs);
+    }
+    rename("priv/discord_session.conf.new", "priv/discord_session.conf");
 }
 
-void DiscordState::onNewVersion(int version, std::string const& versionString,
-                                std::string const& changelog, std::string const& variant) {
-    static std::regex regexNewlines ("<br>");
+std::map<discord::Snowflake, discord::Snowflake> DiscordState::deliverNotification(
+        std::string const& key, std::string const& name, std::vector<discord::Snowflake> const& channels,
+        discord::CreateMessageParams params) {
+    std::vector<discord::Snowflake> remaining;
+    {
+        std::lock_guard<std::mutex> lk(deliveryMutex);
+        auto const& delivered = deliveredChannels[key];
+        for (auto const& c : channels) {
+            if (delivered.count(c) == 0)
+                remaining.push_back(c);
+        }
+    }
+    // Discord drops messages with a nonce it has recently seen, which covers a redelivery after a restart
+    params.nonce = key;
+    params.enforceNonce = true;
+    std::map<discord::Snowflake, discord::Snowflake> messageIds;
+    std::vector<discord::Snowflake> failed = api.broadcastMessageAndWait(name, remaining, params, &messageIds);
+
+    std::lock_guard<std::mutex> lk(deliveryMutex);
+    auto& delivered = deliveredChannels[key];
+    std::set<std::string> failedSet (failed.begin(), failed.end());
+    for (auto const& c : remaining) {
+        if (failedSet.count(c) == 0)
+            delivered[c] = messageIds.count(c) > 0 ? messageIds[c] : std::string();
+    }
+    if (!remaining.empty())
+        saveDeliveredChannels();
+    if (!failed.empty())
+        throw std::runtime_error("Failed to deliver " + name + " to " + std::to_string(failed.size()) + " channels");
+    return delivered;
+}
+
+void DiscordState::forgetDeliveries(std::vector<std::string> const& keys) {
+    std::lock_guard<std::mutex> lk(deliveryMutex);
+    bool changed = false;
+    for (auto const& key : keys)
+        changed |= deliveredChannels.erase(key) > 0;
+    if (changed)
+        saveDeliveredChannels();
+}
 
-    bool isARM = variant == "beta/arm" || variant == "release/arm";
-    if (!isARM)
+void DiscordState::loadDeliveredChannels() {
+    std::ifstream ifs("priv/discord_deliveries.json");
+    if (!ifs)
         return;
+    try {
+        deliveredChannels = nlohmann::json::parse(ifs)
+                .get<std::map<std::string, std::map<discord::Snowflake, discord::Snowflake>>>();
+    } catch (std::exception& e) {
+        AsyncLog::error("Discord", "Failed to load the delivered notifications: %s", e.what());
+    }
+}
 
-    bool isBeta = variant.length() >= 5 && memcmp(variant.c_str(), "beta/", 5) == 0;
+void DiscordState::saveDeliveredChannels() {
+    {
+        std::ofstream ofs("priv/discord_deliveries.json.new");
+        ofs << nlohmann::json(deliveredChannels);
+        if (!ofs) {
+            AsyncLog::error("Discord", "Failed to save the delivered notifications");
+            return;
+        }
+    }
+    rename("priv/discord_deliveries.json.new", "priv/discord_deliveries.json");
+}
 
-    discord::CreateMessageParams params (isBeta ? "**New beta available**" : "**New version available**");
-    params.embed["title"] = versionString + (isBeta ? " (beta)" : "");
-    if (isARM)
-        params.embed["description"] = std::regex_replace(changelog, regexNewlines, "\n");
-    params.embed["footer"]["text"] = "Variant: " + variant + "; version code: " + std::to_string(version);
+void DiscordState::onNewVersion(long long notificationId, ApkNewVersionEvent const& event) {
+    releaseCoalescer->add(event);
+}
+
+discord::CreateMessageParams DiscordState::buildReleaseMessage(ReleaseGroup const& group) {
+    static std::regex regexNewlines ("<br>");
 
-    for (std::string const& chan : broadcastChannels) {
-        api.createMessage(chan, params);
+    discord::CreateMessageParams params (group.isBeta ? "**New beta available**" : "**New version available**");
+    params.embed["title"] = group.versionString + (group.isBeta ? " (beta)" : "");
+    params.embed["description"] = std::regex_replace(group.changelog, regexNewlines, "\n");
+    params.embed["fields"] = nlohmann::json::array();
+    for (auto const& v : group.variants) {
+        nlohmann::json field;
+        field["name"] = v.first;
+        field["value"] = "Version code: " + std::to_string(v.second);
+        field["inline"] = true;
+        params.embed["fields"].push_back(field);
     }
+    return params;
 }
 
-void DiscordState::onNewWin10Version(std::vector<Win10StoreNetwork::UpdateInfo> const &u, Win10VersionType versionType,
-                                     bool hasNewPackageMoniker) {
-    if (!hasNewPackageMoniker)
-        return;
+void DiscordState::sendRelease(discord::Snowflake const& channel, ReleaseGroup const& group,
+                               ReleaseCoalescer::DoneCallback done) {
+    api.postMessage(channel, discord::Api::buildMessageBody(buildReleaseMessage(group)),
+            [done, channel](discord::Response const& r) {
+        if (!r.isSuccess()) {
+            done(false, std::string());
+            return;
+        }
+        // The message is out even if we can't tell its id, resending it would only make a duplicate
+        std::string messageId;
+        try {
+            messageId = r.getJson()["id"].get<std::string>();
+        } catch (std::exception& e) {
+            AsyncLog::warn("Discord", "Sent a release to %s but failed to parse its id: %s", channel.c_str(), e.what());
+        }
+        done(true, messageId);
+    });
+}
+
+void DiscordState::editRelease(discord::Snowflake const& channel, discord::Snowflake const& messageId,
+                               ReleaseGroup const& group, ReleaseCoalescer::DoneCallback done) {
+    api.editMessage(channel, messageId, buildReleaseMessage(group), [done, messageId](discord::Response const& r) {
+        done(r.isSuccess(), messageId);
+    });
+}
+
+discord::CreateMessageParams DiscordState::buildWin10Message(Win10NewVersionEvent const& event,
+                                                            std::map<std::string, Win10Download> const& downloads,
+                                                            nlohmann::json& jsonData) {
+    Win10VersionType versionType = event.versionType;
     std::string header = "**New Windows 10 version of unknown type**";
     if (versionType == Win10VersionType::Release)
         header = "**New Windows 10 release**";
@@ -273,36 +508,111 @@ void DiscordState::onNewWin10Version(std::vector<Win10StoreNetwork::UpdateInfo>
         header = "**New Windows 10 preview**";
 
     discord::CreateMessageParams params (header);
-    std::string desc;
     params.embed["fields"] = nlohmann::json::array();
-    nlohmann::json jsonData = nlohmann::json::object();
+    jsonData = nlohmann::json::object();
     jsonData["type"] = (int) versionType;
     jsonData["updates"] = nlohmann::json::array();
-    for (auto const& e : u) {
-        desc += "**" + e.packageMoniker + "**\n" + e.updateId + "\n";
+    for (auto const& e : event.updates) {
+        auto download = downloads.find(e.updateId);
         nlohmann::json val;
         val["name"] = e.packageMoniker;
         val["value"] = e.updateId;
+        if (download != downloads.end()) {
+            val["value"] = e.updateId + "\n[Download](" + download->second.url + ")";
+            if (download->second.size >= 0)
+                val["value"] = val["value"].get<std::string>() + " (" + formatFileSize(download->second.size) + ")";
+        }
         params.embed["fields"].push_back(val);
 
         nlohmann::json valj;
         valj["packageMoniker"] = e.packageMoniker;
         valj["updateId"] = e.updateId;
         valj["serverId"] = e.serverId;
-        if (e.packageMoniker.find(".0_x64_") != std::string::npos)
-            valj["downloadUrl"] = win10StoreManager->getDownloadUrl(e.updateId, 1);
+        try {
+            valj["version"] = Win10VersionTextDb::convertVersion(e.packageMoniker).toString();
+        } catch (std::exception& ex) {
+        }
+        if (download != downloads.end()) {
+            valj["downloadUrl"] = download->second.url;
+            if (download->second.size >= 0)
+                valj["downloadSize"] = download->second.size;
+        }
         jsonData["updates"].push_back(valj);
     }
-//    params.embed["description"] = desc;
+    return params;
+}
 
-    for (std::string const& chan : broadcastChannelsW10) {
-        api.createMessage(chan, params);
+void DiscordState::onNewWin10Version(long long notificationId, Win10NewVersionEvent const& event) {
+    if (!event.hasAnyNewPackageMoniker)
+        return;
+    // Sent right away without the download links, which take a few SOAP round trips each; they are edited in later
+    nlohmann::json jsonData;
+    discord::CreateMessageParams params = buildWin10Message(event, {}, jsonData);
+
+    std::vector<SubscriptionTopic> topics;
+    for (auto const& e : event.updates)
+        topics.push_back({"win10", getWin10Track(event.versionType),
+                          Win10VersionTextDb::getArchitecture(e.packageMoniker)});
+    auto targets = subscriptions.matchTargets(topics);
+    // Both messages are attempted before failing, so that one of them can't hold the other one up
+    // The channels that got either of them are remembered until both have gone everywhere, so a redelivery doesn't
+    // repost the one that succeeded
+    std::string embedKey = "n" + std::to_string(notificationId) + "w";
+    std::string jsonKey = "n" + std::to_string(notificationId) + "j";
+    std::string error;
+    std::map<discord::Snowflake, discord::Snowflake> messages, jsonMessages;
+    try {
+        messages = deliverNotification(embedKey, "Windows 10 update", targets["embed"], params);
+    } catch (std::exception& e) {
+        error = e.what();
     }
+    jsonMessages = deliverNotification(jsonKey, "Windows 10 update JSON", targets["json"],
+                                       "`" + jsonData.dump() + "`");
+    if (!error.empty())
+        throw std::runtime_error(error);
+    forgetDeliveries({embedKey, jsonKey});
 
-    for (auto const& r : jsonNotifyRules) {
-        if (versionType != Win10VersionType::Release ? (!r.notifyW10Beta) : (!r.notifyW10Release))
-            continue;
+    if (win10StoreManager != nullptr)
+        enrichmentPool->post(std::bind(&DiscordState::enrichWin10Notification, this, event, messages, jsonMessages));
+}
 
-        api.createMessage(r.channel, "`" + jsonData.dump() + "`");
+void DiscordState::enrichWin10Notification(Win10NewVersionEvent const& event,
+                                           std::map<discord::Snowflake, discord::Snowflake> const& messages,
+                                           std::map<discord::Snowflake, discord::Snowflake> const& jsonMessages) {
+    std::map<std::string, Win10Download> downloads;
+    for (auto const& e : event.updates) {
+        if (e.packageMoniker.find(".0_x64_") == std::string::npos)
+            continue;
+        try {
+            Win10Download download;
+            download.url = win10StoreManager->getDownloadUrl(e.updateId, 1);
+            if (download.url.empty())
+                continue;
+            download.size = Win10StoreNetwork::getFileSize(download.url);
+            downloads[e.updateId] = std::move(download);
+        } catch (std::exception& ex) {
+            AsyncLog::warn("Discord", "Failed to get the download link of %s: %s", e.packageMoniker.c_str(),
+                           ex.what());
+        }
     }
+    if (downloads.empty())
+        return;
+
+    nlohmann::json jsonData;
+    discord::CreateMessageParams params = buildWin10Message(event, downloads, jsonData);
+    auto edit = [this](std::map<discord::Snowflake, discord::Snowflake> const& messages,
+                       discord::CreateMessageParams const& params) {
+        for (auto const& m : messages) {
+            if (m.second.empty())
+                continue;
+            std::string channel = m.first;
+            api.editMessage(m.first, m.second, params, [channel](discord::Response const& r) {
+                if (!r.isSuccess())
+                    AsyncLog::warn("Discord", "Failed to edit the notification in %s: status %li", channel.c_str(),
+                                   r.statusCode);
+            });
+        }
+    };
+    edit(messages, params);
+    edit(jsonMessages, "`" + jsonData.dump() + "`");
 }
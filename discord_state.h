@@ -1,48 +1,112 @@
 #pragma once
 
 #include "play_manager.h"
-#include "discord_gateway.h"
+#include "discord_shard_manager.h"
 #include "apk_manager.h"
 #include "win10_store_manager.h"
+#include "command_executor.h"
+#include "release_coalescer.h"
 
 class DiscordState {
 
 private:
-    struct JsonNotifyRule {
-        std::string channel;
-        bool notifyW10Release = false;
-        bool notifyW10Beta = false;
+    struct Win10Download {
+        std::string url;
+        long long size = -1;
     };
 
     playapi::config discordConf;
     PlayManager& playManager;
     ApkManager& apkManager;
     Win10StoreManager* win10StoreManager = nullptr;
-    std::vector<std::string> broadcastChannels;
-    std::vector<std::string> broadcastChannelsW10;
+    // The formats are "embed" and "json" (the latter only for Windows 10)
+    SubscriptionRegistry subscriptions;
     std::set<std::string> operatorList;
-    std::vector<JsonNotifyRule> jsonNotifyRules;
+    std::mutex sessionMutex;
+    std::unique_ptr<CommandExecutor> commandExecutor;
+    // Prebuilt replies of the status commands, rebuilt by the version check callbacks
+    std::mutex replyCacheMutex;
+    std::shared_ptr<const std::string> versionReply;
+    std::string healthcheckText;
+    // The channels a notification has already been delivered to (with the message ids), so that a redelivery only
+    // retries the others. Kept until the whole notification has been delivered, and saved to
+    // priv/discord_deliveries.json so that it survives a restart as well.
+    std::mutex deliveryMutex;
+    std::map<std::string, std::map<discord::Snowflake, discord::Snowflake>> deliveredChannels;
+    // Fills in the slow parts of the sent notifications (eg. download links) and edits the messages
+    std::unique_ptr<WorkerPool> enrichmentPool;
+    // Declared before the api, which has to go away first as its completion callbacks use it
+    std::unique_ptr<ReleaseCoalescer> releaseCoalescer;
+
+    static const std::set<std::string> COMMANDS;
+
+    // Runs on the command executor
+    void executeCommand(discord::Message const& m);
 
     bool checkOp(discord::Message const& m);
 
+    void rebuildVersionReply();
+
+    void rebuildHealthcheckText();
+
+    std::string buildHealthcheckReply();
+
+    // Sends the message to the channels it hasn't been delivered to yet; the key identifies the message across
+    // redeliveries and is used as the nonce. Returns the message id for each channel. The state of the key is kept
+    // until forgetDeliveries() is called for it.
+    std::map<discord::Snowflake, discord::Snowflake> deliverNotification(
+            std::string const& key, std::string const& name, std::vector<discord::Snowflake> const& channels,
+            discord::CreateMessageParams params);
+
+    void forgetDeliveries(std::vector<std::string> const& keys);
+
+    // The downloads are by update id, the JSON notification is stored in jsonData
+    static discord::CreateMessageParams buildWin10Message(Win10NewVersionEvent const& event,
+                                                          std::map<std::string, Win10Download> const& downloads,
+                                                          nlohmann::json& jsonData);
+
+    // Runs on the enrichment pool
+    void enrichWin10Notification(Win10NewVersionEvent const& event,
+                                 std::map<discord::Snowflake, discord::Snowflake> const& messages,
+                                 std::map<discord::Snowflake, discord::Snowflake> const& jsonMessages);
+
+    void loadSubscriptions();
+
+    void loadDeliveredChannels();
+
+    // Called with the delivery mutex held
+    void saveDeliveredChannels();
+
+    static std::string getWin10Track(Win10VersionType type);
+
+    static discord::CreateMessageParams buildReleaseMessage(ReleaseGroup const& group);
+
+    void sendRelease(discord::Snowflake const& channel, ReleaseGroup const& group,
+                     ReleaseCoalescer::DoneCallback done);
+
+    void editRelease(discord::Snowflake const& channel, discord::Snowflake const& messageId, ReleaseGroup const& group,
+                     ReleaseCoalescer::DoneCallback done);
+
     std::string buildVersionFieldString(ApkVersionInfo const& arm, ApkVersionInfo const& x86,
                                         ApkVersionInfo const& arm64, ApkVersionInfo const& x8664);
 
 public:
     discord::Api api;
-    discord::gateway::Connection conn;
+    discord::gateway::ShardManager shards;
 
     DiscordState(PlayManager& playManager, ApkManager& apkManager);
 
+    ~DiscordState();
+
     void addWin10StoreMgr(Win10StoreManager& mgr);
 
     void onMessage(discord::Message const& m);
 
-    void onNewVersion(int version, std::string const& versionString,
-                      std::string const& changelog, std::string const& variant);
+    // Runs on the notification outbox, hands the variant to the release coalescer
+    void onNewVersion(long long notificationId, ApkNewVersionEvent const& event);
 
-    void onNewWin10Version(std::vector<Win10StoreNetwork::UpdateInfo> const& u, Win10VersionType versionType,
-                           bool hasNewPackageMoniker);
+    // Runs on the notification outbox and throws if some channels should be retried
+    void onNewWin10Version(long long notificationId, Win10NewVersionEvent const& event);
 
     void loop();
 
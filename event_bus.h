@@ -0,0 +1,114 @@
+#pragma once
+
+#include "async_log.h"
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+/**
+ * Delivers published events to the subscribers asynchronously. Every subscriber has its own bounded queue and
+ * dispatch thread, so a slow subscriber only delays itself and publish() never waits. When a subscriber falls more
+ * than its queue size behind, its oldest events are dropped (and logged). Exceptions thrown by a handler are logged
+ * and don't affect the other subscribers.
+ *
+ * Subscribing is meant to happen during setup; the handlers have to outlive the bus.
+ */
+template <typename Event>
+class EventBus {
+
+public:
+    using Handler = std::function<void (Event const& event)>;
+
+    static const size_t DEFAULT_MAX_QUEUED = 64;
+
+private:
+    struct Subscriber {
+        std::string name;
+        Handler handler;
+        size_t maxQueued;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<std::shared_ptr<const Event>> queue;
+        bool stopped = false;
+        std::thread thread;
+
+        void run() {
+            std::unique_lock<std::mutex> lk(mutex);
+            while (true) {
+                cv.wait(lk, [this]() { return stopped || !queue.empty(); });
+                if (queue.empty())
+                    break; // only once stopped, the remaining events are still delivered
+                std::shared_ptr<const Event> event = std::move(queue.front());
+                queue.pop_front();
+                lk.unlock();
+                try {
+                    handler(*event);
+                } catch (std::exception& e) {
+                    AsyncLog::error("EventBus", "%s: handler failed: %s", name.c_str(), e.what());
+                }
+                lk.lock();
+            }
+        }
+    };
+
+    std::string name;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Subscriber>> subscribers;
+
+public:
+    explicit EventBus(std::string name) : name(std::move(name)) {}
+
+    // Delivers the events that are already queued and stops the dispatch threads
+    ~EventBus() {
+        std::lock_guard<std::mutex> lk(mutex);
+        for (auto& s : subscribers) {
+            {
+                std::lock_guard<std::mutex> slk(s->mutex);
+                s->stopped = true;
+            }
+            s->cv.notify_all();
+        }
+        for (auto& s : subscribers)
+            s->thread.join();
+    }
+
+    void subscribe(Handler handler, size_t maxQueued = DEFAULT_MAX_QUEUED) {
+        std::lock_guard<std::mutex> lk(mutex);
+        std::unique_ptr<Subscriber> s (new Subscriber());
+        s->name = name + "#" + std::to_string(subscribers.size());
+        s->handler = std::move(handler);
+        s->maxQueued = maxQueued;
+        Subscriber* sp = s.get();
+        s->thread = std::thread([sp]() { sp->run(); });
+        subscribers.push_back(std::move(s));
+    }
+
+    void publish(Event event) {
+        std::shared_ptr<const Event> shared = std::make_shared<const Event>(std::move(event));
+        std::lock_guard<std::mutex> lk(mutex);
+        for (auto& s : subscribers) {
+            bool dropped = false;
+            {
+                std::lock_guard<std::mutex> slk(s->mutex);
+                if (s->queue.size() >= s->maxQueued) {
+                    s->queue.pop_front();
+                    dropped = true;
+                }
+                s->queue.push_back(shared);
+            }
+            s->cv.notify_one();
+            if (dropped)
+                AsyncLog::warn("EventBus", "%s is falling behind, dropped its oldest event", s->name.c_str());
+        }
+    }
+
+};
+
+template <typename Event>
+const size_t EventBus<Event>::DEFAULT_MAX_QUEUED;
@@ -2,6 +2,7 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <cerrno>
 
 std::string FileUtils::getParent(std::string const& path) {
     auto iof = path.rfind('/');
@@ -32,4 +33,40 @@ void FileUtils::deleteDir(std::string const &path, int fd) {
     closedir(d);
     close(dfd);
     unlinkat(fd, path.c_str(), AT_REMOVEDIR);
-}
\ No newline at end of file
+}
+
+bool FileUtils::writeFileDurably(std::string const& path, std::string const& data) {
+    std::string newPath = path + ".new";
+    int fd = open(newPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return false;
+    for (size_t off = 0; off < data.size(); ) {
+        ssize_t r = write(fd, data.data() + off, data.size() - off);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return false;
+        }
+        off += r;
+    }
+    if (fsync(fd) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return false;
+    }
+    if (close(fd) != 0 || rename(newPath.c_str(), path.c_str()) != 0)
+        return false;
+    std::string dir = getParent(path);
+    if (dir.empty())
+        dir = ".";
+    int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd == -1)
+        return false;
+    bool ok = fsync(dirFd) == 0;
+    close(dirFd);
+    return ok;
+}
@@ -13,4 +13,8 @@ public:
 
     static void deleteDir(std::string const& path, int fd = AT_FDCWD);
 
+    // Writes the file next to the path, syncs it and renames it over the path, then syncs the directory so that the
+    // rename survives a crash too. Returns false and sets errno on failure.
+    static bool writeFileDurably(std::string const& path, std::string const& data);
+
 };
\ No newline at end of file
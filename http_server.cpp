@@ -0,0 +1,245 @@
+#include "http_server.h"
+#include "async_log.h"
+
+#include <fstream>
+#include <cstring>
+#include <cctype>
+#include <playapi/util/config.h>
+#include <zlib.h>
+
+static std::string gzipCompress(std::string const& data) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw std::runtime_error("deflateInit2 failed");
+    std::string out;
+    out.resize(deflateBound(&zs, data.size()));
+    zs.next_in = (Bytef*) data.data();
+    zs.avail_in = (uInt) data.size();
+    zs.next_out = (Bytef*) &out[0];
+    zs.avail_out = (uInt) out.size();
+    int ret = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END)
+        throw std::runtime_error("deflate failed");
+    return out;
+}
+
+std::shared_ptr<const HttpPreparedResponse> HttpPreparedResponse::create(std::string const& contentType,
+                                                                         std::string const& body) {
+    std::shared_ptr<HttpPreparedResponse> ret (new HttpPreparedResponse());
+    char etag[64];
+    snprintf(etag, sizeof(etag), "\"%zx-%zx\"", body.size(), std::hash<std::string>()(body));
+    ret->etag = etag;
+    std::string headers = "ETag: " + ret->etag + "\r\nCache-Control: no-cache\r\nVary: Accept-Encoding\r\n";
+    ret->identityResponse = HttpServer::buildResponse(200, contentType, body, headers);
+    ret->gzipResponse = HttpServer::buildResponse(200, contentType, gzipCompress(body),
+            headers + "Content-Encoding: gzip\r\n");
+    ret->notModifiedResponse = "HTTP/1.1 304 Not Modified\r\n" + headers + "\r\n";
+    return ret;
+}
+
+const int HttpServer::TICK_INTERVAL;
+
+HttpServer::HttpServer() {
+    playapi::config conf;
+    std::ifstream ifs("priv/http.conf");
+    conf.load(ifs);
+    host = conf.get("listen.host", "127.0.0.1");
+    port = (int) conf.get_int("listen.port", 9454);
+
+    hub.onHttpRequest([this](uWS::HttpResponse* res, uWS::HttpRequest req, char* data, size_t length,
+                             size_t remainingBytes) {
+        handleRequest(res, req);
+    });
+
+    hub.onCancelledHttpRequest([this](uWS::HttpResponse* res) {
+        for (auto const& h : cancelledHandlers)
+            h(res);
+    });
+
+    postHandle = new uS::Async(hub.getLoop());
+    postHandle->setData(this);
+    postHandle->start([](uS::Async* handle) {
+        ((HttpServer*) handle->getData())->runPosted();
+    });
+    tickTimer = new uS::Timer(hub.getLoop());
+    tickTimer->setData(this);
+    tickTimer->start([](uS::Timer* timer) {
+        ((HttpServer*) timer->getData())->runTick();
+    }, TICK_INTERVAL, TICK_INTERVAL);
+}
+
+HttpServer::~HttpServer() {
+    if (!thread.joinable())
+        return;
+    post([this]() {
+        // The owners of the deferred responses might be gone already
+        cancelledHandlers.clear();
+        hub.getDefaultGroup<uWS::SERVER>().close();
+        tickTimer->stop();
+        tickTimer->close();
+        postHandle->close();
+    });
+    thread.join();
+}
+
+void HttpServer::addPreparedResponse(std::string const& path) {
+    preparedResponses[path] = std::shared_ptr<const HttpPreparedResponse>();
+}
+
+void HttpServer::setPreparedResponse(std::string const& path, std::shared_ptr<const HttpPreparedResponse> response) {
+    auto it = preparedResponses.find(path);
+    if (it == preparedResponses.end())
+        throw std::runtime_error("No prepared response registered for " + path);
+    std::atomic_store(&it->second, std::move(response));
+}
+
+void HttpServer::addHandler(std::string const& pathPrefix, Handler handler) {
+    handlers.emplace_back(pathPrefix, std::move(handler));
+}
+
+void HttpServer::addCancelledHandler(CancelledHandler handler) {
+    cancelledHandlers.push_back(std::move(handler));
+}
+
+void HttpServer::addTickHandler(TickHandler handler) {
+    tickHandlers.push_back(std::move(handler));
+}
+
+void HttpServer::start() {
+    if (!hub.listen(host.c_str(), port)) {
+        AsyncLog::error("HttpServer", "Failed to listen on %s:%i", host.c_str(), port);
+        return;
+    }
+    AsyncLog::info("HttpServer", "Listening on %s:%i", host.c_str(), port);
+    thread = std::thread([this]() { hub.run(); });
+}
+
+void HttpServer::post(std::function<void ()> fn) {
+    std::lock_guard<std::mutex> lk(postMutex);
+    postQueue.push_back(std::move(fn));
+    postHandle->send();
+}
+
+void HttpServer::runPosted() {
+    std::vector<std::function<void ()>> queue;
+    {
+        std::lock_guard<std::mutex> lk(postMutex);
+        queue.swap(postQueue);
+    }
+    for (auto const& fn : queue)
+        fn();
+}
+
+void HttpServer::runTick() {
+    for (auto const& h : tickHandlers)
+        h();
+}
+
+void HttpServer::handleRequest(uWS::HttpResponse* res, uWS::HttpRequest& req) {
+    std::string path = req.getUrl().toString();
+    auto iof = path.find('?');
+    if (iof != std::string::npos)
+        path.resize(iof);
+
+    auto it = preparedResponses.find(path);
+    if (it != preparedResponses.end()) {
+        if (req.getMethod() != uWS::METHOD_GET) {
+            sendResponse(res, 405, "text/plain", "Method not allowed");
+            return;
+        }
+        auto resp = std::atomic_load(&it->second);
+        if (!resp) {
+            sendResponse(res, 503, "text/plain", "Not available yet");
+            return;
+        }
+        uWS::Header ifNoneMatch = req.getHeader("if-none-match");
+        if (ifNoneMatch && resp->etag.compare(0, std::string::npos, ifNoneMatch.value, ifNoneMatch.valueLength) == 0) {
+            sendRaw(res, resp->notModifiedResponse);
+            return;
+        }
+        uWS::Header acceptEncoding = req.getHeader("accept-encoding");
+        if (acceptEncoding && std::string(acceptEncoding.value, acceptEncoding.valueLength).find("gzip") != std::string::npos)
+            sendRaw(res, resp->gzipResponse);
+        else
+            sendRaw(res, resp->identityResponse);
+        return;
+    }
+
+    for (auto const& h : handlers) {
+        if (path.compare(0, h.first.size(), h.first) == 0) {
+            h.second(res, req, path);
+            return;
+        }
+    }
+    sendResponse(res, 404, "text/plain", "Not found");
+}
+
+const char* HttpServer::getStatusText(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 204: return "No Content";
+        case 206: return "Partial Content";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 409: return "Conflict";
+        case 416: return "Range Not Satisfiable";
+        case 503: return "Service Unavailable";
+        default: return "Unknown";
+    }
+}
+
+std::string HttpServer::buildResponse(int status, std::string const& contentType, std::string const& body,
+                                      std::string const& extraHeaders) {
+    std::string ret = "HTTP/1.1 " + std::to_string(status) + " " + getStatusText(status) + "\r\n";
+    ret += "Content-Type: " + contentType + "\r\n";
+    ret += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    ret += extraHeaders;
+    ret += "\r\n";
+    ret += body;
+    return ret;
+}
+
+void HttpServer::sendRaw(uWS::HttpResponse* res, std::string const& response) {
+    // write() sends the data as-is and marks the head as sent, so end() won't add its own status line
+    res->write(response.data(), response.size());
+    res->end();
+}
+
+bool HttpServer::percentDecode(std::string const& str, std::string& out) {
+    out.clear();
+    for (size_t i = 0; i < str.size(); i++) {
+        if (str[i] != '%') {
+            out += str[i];
+            continue;
+        }
+        if (i + 2 >= str.size() || !isxdigit(str[i + 1]) || !isxdigit(str[i + 2]))
+            return false;
+        out += (char) strtol(str.substr(i + 1, 2).c_str(), nullptr, 16);
+        i += 2;
+    }
+    return true;
+}
+
+std::string HttpServer::getQueryParameter(uWS::HttpRequest& req, const char* name) {
+    uWS::Header url = req.getUrl();
+    std::string query (url.value, url.valueLength);
+    auto start = query.find('?');
+    size_t nameLen = strlen(name);
+    while (start != std::string::npos) {
+        start++;
+        auto end = query.find('&', start);
+        if (query.compare(start, nameLen, name) == 0 && start + nameLen < query.size() &&
+                query[start + nameLen] == '=') {
+            start += nameLen + 1;
+            return query.substr(start, end != std::string::npos ? end - start : std::string::npos);
+        }
+        start = end;
+    }
+    return std::string();
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <uWS.h>
+
+struct HttpPreparedResponse {
+    std::string etag;
+    // Complete HTTP responses (status line, headers and body), ready to be written to the socket as-is
+    std::string identityResponse;
+    std::string gzipResponse;
+    std::string notModifiedResponse;
+
+    static std::shared_ptr<const HttpPreparedResponse> create(std::string const& contentType, std::string const& body);
+};
+
+class HttpServer {
+
+public:
+    using Handler = std::function<void (uWS::HttpResponse* res, uWS::HttpRequest& req, std::string const& path)>;
+    // Called when the client goes away before a deferred response was ended; the response must not be used anymore
+    using CancelledHandler = std::function<void (uWS::HttpResponse* res)>;
+    using TickHandler = std::function<void ()>;
+
+private:
+    static const int TICK_INTERVAL = 1000;
+
+    uWS::Hub hub;
+    std::thread thread;
+    uS::Async* postHandle = nullptr;
+    uS::Timer* tickTimer = nullptr;
+    std::mutex postMutex;
+    std::vector<std::function<void ()>> postQueue;
+    std::string host;
+    int port;
+    // The maps themselves are only modified before start(), the response pointers are swapped atomically
+    std::map<std::string, std::shared_ptr<const HttpPreparedResponse>> preparedResponses;
+    std::vector<std::pair<std::string, Handler>> handlers;
+    std::vector<CancelledHandler> cancelledHandlers;
+    std::vector<TickHandler> tickHandlers;
+
+    void handleRequest(uWS::HttpResponse* res, uWS::HttpRequest& req);
+
+    void runPosted();
+
+    void runTick();
+
+public:
+    static const char* getStatusText(int status);
+
+    static std::string buildResponse(int status, std::string const& contentType, std::string const& body,
+                                     std::string const& extraHeaders = std::string());
+
+    static void sendRaw(uWS::HttpResponse* res, std::string const& response);
+
+    // Returns the raw (not percent decoded) value of the query parameter, or an empty string if it isn't there
+    static std::string getQueryParameter(uWS::HttpRequest& req, const char* name);
+
+    // Returns false if there is a malformed escape
+    static bool percentDecode(std::string const& str, std::string& out);
+
+    static void sendResponse(uWS::HttpResponse* res, int status, std::string const& contentType,
+                             std::string const& body) {
+        sendRaw(res, buildResponse(status, contentType, body));
+    }
+
+    HttpServer();
+
+    ~HttpServer();
+
+    void addPreparedResponse(std::string const& path);
+
+    void setPreparedResponse(std::string const& path, std::shared_ptr<const HttpPreparedResponse> response);
+
+    void addHandler(std::string const& pathPrefix, Handler handler);
+
+    // The following must be called before start(); the handlers run on the server's thread
+    void addCancelledHandler(CancelledHandler handler);
+
+    // Runs the handler about once a second
+    void addTickHandler(TickHandler handler);
+
+    void start();
+
+    void post(std::function<void ()> fn);
+
+};
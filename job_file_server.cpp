@@ -0,0 +1,440 @@
+#include "job_file_server.h"
+#include "http_server.h"
+#include "async_log.h"
+
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <csignal>
+#include <algorithm>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <openssl/evp.h>
+#include <playapi/util/config.h>
+#include <nlohmann/json.hpp>
+
+const int JobFileServer::MAX_CONNECTIONS;
+const size_t JobFileServer::MAX_HEADER_SIZE;
+const int JobFileServer::IO_TIMEOUT;
+
+// Only relative paths that stay within the job directory
+static bool isValidFileName(std::string const& name) {
+    if (name.empty() || name.find('\0') != std::string::npos)
+        return false;
+    size_t start = 0;
+    while (true) {
+        size_t end = name.find('/', start);
+        std::string part = name.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        if (part.empty() || part == "." || part == "..")
+            return false;
+        if (end == std::string::npos)
+            return true;
+        start = end + 1;
+    }
+}
+
+// Returns false if the range can't be satisfied; anything but a single byte range is ignored and the whole file sent
+static bool parseRange(std::string const& range, off_t size, off_t& first, off_t& last, bool& partial) {
+    first = 0;
+    last = size - 1;
+    partial = false;
+    if (range.compare(0, 6, "bytes=") != 0 || range.find(',') != std::string::npos)
+        return true;
+    std::string spec = range.substr(6);
+    auto dash = spec.find('-');
+    if (dash == std::string::npos)
+        return true;
+    std::string a = spec.substr(0, dash), b = spec.substr(dash + 1);
+    if ((a.empty() && b.empty()) || a.find_first_not_of("0123456789") != std::string::npos ||
+        b.find_first_not_of("0123456789") != std::string::npos)
+        return true;
+    partial = true;
+    if (a.empty()) {
+        // The last n bytes
+        off_t n = (off_t) strtoll(b.c_str(), nullptr, 10);
+        if (n <= 0)
+            return false;
+        first = std::max<off_t>(size - n, 0);
+        return size > 0;
+    }
+    first = (off_t) strtoll(a.c_str(), nullptr, 10);
+    if (!b.empty())
+        last = std::min<off_t>((off_t) strtoll(b.c_str(), nullptr, 10), size - 1);
+    return first < size && first <= last;
+}
+
+JobFileServer::JobFileServer(JobManager& jobManager) : jobManager(jobManager) {
+    playapi::config conf;
+    std::ifstream ifs("priv/job_queue.conf");
+    conf.load(ifs);
+    host = conf.get("files.host", "127.0.0.1");
+    port = (int) conf.get_int("files.port", 9455);
+    std::string token = conf.get("token", "");
+    if (!token.empty())
+        authHeader = "Bearer " + token;
+}
+
+JobFileServer::~JobFileServer() {
+    if (!acceptThread.joinable())
+        return;
+    std::unique_lock<std::mutex> lk(mutex);
+    stopped = true;
+    // Wakes up accept() and the connections blocked on reading or sending
+    shutdown(listenFd, SHUT_RDWR);
+    for (int fd : connections)
+        shutdown(fd, SHUT_RDWR);
+    connectionsCv.notify_all();
+    connectionsCv.wait(lk, [this]() { return connections.empty(); });
+    lk.unlock();
+    acceptThread.join();
+    close(listenFd);
+}
+
+void JobFileServer::start() {
+    if (authHeader.empty()) {
+        AsyncLog::info("JobFiles", "No token is configured, the job file server is disabled");
+        return;
+    }
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* result;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result) != 0) {
+        AsyncLog::error("JobFiles", "Failed to resolve %s", host.c_str());
+        return;
+    }
+    for (addrinfo* ai = result; ai != nullptr && listenFd < 0; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0)
+            listenFd = fd;
+        else
+            close(fd);
+    }
+    freeaddrinfo(result);
+    if (listenFd < 0) {
+        AsyncLog::error("JobFiles", "Failed to listen on %s:%i", host.c_str(), port);
+        return;
+    }
+    // sendfile() has no MSG_NOSIGNAL; a worker going away has to show up as EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+    AsyncLog::info("JobFiles", "Listening on %s:%i", host.c_str(), port);
+    acceptThread = std::thread(std::bind(&JobFileServer::runAcceptThread, this));
+}
+
+void JobFileServer::runAcceptThread() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lk(mutex);
+            connectionsCv.wait(lk, [this]() { return stopped || connections.size() < MAX_CONNECTIONS; });
+            if (stopped)
+                return;
+        }
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE)
+                continue;
+            std::lock_guard<std::mutex> lk(mutex);
+            if (!stopped)
+                AsyncLog::error("JobFiles", "accept failed: %s", strerror(errno));
+            return;
+        }
+        timeval timeout = {IO_TIMEOUT, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            if (stopped) {
+                close(fd);
+                return;
+            }
+            connections.insert(fd);
+        }
+        std::thread(std::bind(&JobFileServer::handleConnection, this, fd)).detach();
+    }
+}
+
+void JobFileServer::handleConnection(int fd) {
+    std::string buf;
+    Request req;
+    try {
+        while (readRequest(fd, buf, req) && handleRequest(fd, req))
+            req = Request();
+    } catch (std::exception& e) {
+        AsyncLog::error("JobFiles", "Failed to handle %s: %s", req.path.c_str(), e.what());
+    }
+    std::lock_guard<std::mutex> lk(mutex);
+    close(fd);
+    connections.erase(fd);
+    connectionsCv.notify_all();
+}
+
+bool JobFileServer::readRequest(int fd, std::string& buf, Request& req) {
+    size_t headEnd;
+    while ((headEnd = buf.find("\r\n\r\n")) == std::string::npos) {
+        if (buf.size() >= MAX_HEADER_SIZE)
+            return false;
+        char tmp[4096];
+        ssize_t r = recv(fd, tmp, sizeof(tmp), 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        buf.append(tmp, (size_t) r);
+    }
+    std::string head = buf.substr(0, headEnd);
+    buf.erase(0, headEnd + 4);
+
+    size_t lineEnd = head.find("\r\n");
+    std::string requestLine = head.substr(0, lineEnd);
+    size_t sp1 = requestLine.find(' '), sp2 = requestLine.rfind(' ');
+    if (sp1 == std::string::npos || sp1 == sp2)
+        return false;
+    req.method = requestLine.substr(0, sp1);
+    req.path = requestLine.substr(sp1 + 1, sp2 - sp1 - 1);
+    req.keepAlive = requestLine.compare(sp2 + 1, std::string::npos, "HTTP/1.1") == 0;
+    while (lineEnd != std::string::npos) {
+        size_t start = lineEnd + 2;
+        lineEnd = head.find("\r\n", start);
+        std::string line = head.substr(start, lineEnd == std::string::npos ? std::string::npos : lineEnd - start);
+        size_t colon = line.find(':');
+        if (colon == std::string::npos)
+            continue;
+        std::string name = line.substr(0, colon);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        size_t valueStart = line.find_first_not_of(" \t", colon + 1);
+        std::string value = valueStart == std::string::npos ? std::string() : line.substr(valueStart);
+        if (name == "authorization")
+            req.authorization = value;
+        else if (name == "range")
+            req.range = value;
+        else if (name == "connection")
+            req.keepAlive = strcasecmp(value.c_str(), "close") != 0 &&
+                    (req.keepAlive || strcasecmp(value.c_str(), "keep-alive") == 0);
+        else if (name == "content-length" || name == "transfer-encoding")
+            return false; // only bodyless GETs are served
+    }
+    return true;
+}
+
+bool JobFileServer::checkAuth(Request const& req) {
+    if (req.authorization.size() != authHeader.size())
+        return false;
+    // Compares the whole value regardless of where the first difference is
+    unsigned char diff = 0;
+    for (size_t i = 0; i < authHeader.size(); i++)
+        diff |= (unsigned char) (req.authorization[i] ^ authHeader[i]);
+    return diff == 0;
+}
+
+bool JobFileServer::handleRequest(int fd, Request const& req) {
+    if (req.method != "GET")
+        return sendResponse(fd, 405, "text/plain", "Method not allowed", false);
+    if (!checkAuth(req))
+        return sendResponse(fd, 401, "text/plain", "Unauthorized", req.keepAlive);
+
+    // /jobs/<id>/manifest or /jobs/<id>/files/<name>
+    static const std::string prefix = "/jobs/";
+    std::string path = req.path.substr(0, req.path.find('?'));
+    size_t idEnd = path.find('/', prefix.size());
+    if (path.compare(0, prefix.size(), prefix) != 0 || idEnd == std::string::npos)
+        return sendResponse(fd, 404, "text/plain", "Not found", req.keepAlive);
+    std::string id = path.substr(prefix.size(), idEnd - prefix.size());
+    std::string dir = jobManager.getJobDataDir(id);
+    if (dir.empty())
+        return sendResponse(fd, 404, "text/plain", "No such job", req.keepAlive);
+
+    std::string rest = path.substr(idEnd);
+    if (rest == "/manifest")
+        return sendManifest(fd, id, dir, req.keepAlive);
+    std::string name;
+    if (rest.compare(0, 7, "/files/") == 0 && HttpServer::percentDecode(rest.substr(7), name) && isValidFileName(name))
+        return sendFile(fd, dir, name, req);
+    return sendResponse(fd, 404, "text/plain", "Not found", req.keepAlive);
+}
+
+void JobFileServer::listFiles(std::string const& dir, std::string const& prefix,
+                              std::map<std::string, struct stat>& files) {
+    DIR* d = opendir(dir.c_str());
+    if (d == nullptr)
+        return;
+    dirent* ent;
+    while ((ent = readdir(d)) != nullptr) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        std::string path = dir + "/" + ent->d_name;
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0)
+            continue;
+        // Symlinks are skipped, so that nothing outside of the job directory is listed
+        if (S_ISDIR(st.st_mode))
+            listFiles(path, prefix + ent->d_name + "/", files);
+        else if (S_ISREG(st.st_mode))
+            files[prefix + ent->d_name] = st;
+    }
+    closedir(d);
+}
+
+std::string JobFileServer::hashFile(std::string const& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error("Failed to open " + path);
+    EVP_MD_CTX* ctx = EVP_MD_CTX_create();
+    EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+    std::vector<char> buf (1024 * 1024);
+    ssize_t r;
+    while ((r = read(fd, buf.data(), buf.size())) > 0 || (r < 0 && errno == EINTR)) {
+        if (r > 0)
+            EVP_DigestUpdate(ctx, buf.data(), (size_t) r);
+    }
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLen = 0;
+    EVP_DigestFinal_ex(ctx, digest, &digestLen);
+    EVP_MD_CTX_destroy(ctx);
+    close(fd);
+    if (r < 0)
+        throw std::runtime_error("Failed to read " + path);
+    char hex[EVP_MAX_MD_SIZE * 2 + 1];
+    for (unsigned int i = 0; i < digestLen; i++)
+        snprintf(&hex[i * 2], 3, "%02x", digest[i]);
+    return std::string(hex, digestLen * 2);
+}
+
+std::string JobFileServer::getFileHash(std::string const& id, std::string const& name, std::string const& path,
+                                       struct stat const& st) {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        auto job = hashCache.find(id);
+        if (job != hashCache.end()) {
+            auto it = job->second.find(name);
+            if (it != job->second.end() && it->second.size == st.st_size && it->second.mtime == st.st_mtime)
+                return it->second.sha256;
+        }
+    }
+    // Hashed without the lock; two workers asking for the same new job at once just both hash it
+    std::string hash = hashFile(path);
+    std::lock_guard<std::mutex> lk(mutex);
+    hashCache[id][name] = {st.st_size, st.st_mtime, hash};
+    return hash;
+}
+
+bool JobFileServer::sendManifest(int fd, std::string const& id, std::string const& dir, bool keepAlive) {
+    std::map<std::string, struct stat> files;
+    listFiles(dir, std::string(), files);
+
+    nlohmann::json list = nlohmann::json::array();
+    for (auto const& f : files) {
+        list.push_back({
+            {"name", f.first},
+            {"size", (long long) f.second.st_size},
+            {"sha256", getFileHash(id, f.first, dir + "/" + f.first, f.second)}
+        });
+    }
+    {
+        // Forgets the jobs that are gone, and the files that are gone from this one
+        std::lock_guard<std::mutex> lk(mutex);
+        for (auto it = hashCache.begin(); it != hashCache.end(); ) {
+            if (it->first != id && jobManager.getJobDataDir(it->first).empty())
+                it = hashCache.erase(it);
+            else
+                ++it;
+        }
+        auto& job = hashCache[id];
+        for (auto it = job.begin(); it != job.end(); ) {
+            if (files.count(it->first) == 0)
+                it = job.erase(it);
+            else
+                ++it;
+        }
+    }
+    nlohmann::json ret;
+    ret["files"] = list;
+    return sendResponse(fd, 200, "application/json", ret.dump(), keepAlive);
+}
+
+bool JobFileServer::sendFile(int fd, std::string const& dir, std::string const& name, Request const& req) {
+    std::string path = dir + "/" + name;
+    // The name can't contain "..", but a symlink in the job directory could still point outside of it
+    char* realPath = realpath(path.c_str(), nullptr);
+    bool inside = realPath != nullptr && strncmp(realPath, (dir + "/").c_str(), dir.size() + 1) == 0;
+    free(realPath);
+    int fileFd = inside ? open(path.c_str(), O_RDONLY | O_CLOEXEC) : -1;
+    struct stat st;
+    if (fileFd < 0 || fstat(fileFd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (fileFd >= 0)
+            close(fileFd);
+        return sendResponse(fd, 404, "text/plain", "No such file", req.keepAlive);
+    }
+
+    off_t first, last;
+    bool partial;
+    if (!parseRange(req.range, st.st_size, first, last, partial)) {
+        close(fileFd);
+        std::string head = "HTTP/1.1 416 " + std::string(HttpServer::getStatusText(416)) + "\r\n";
+        head += "Content-Range: bytes */" + std::to_string((long long) st.st_size) + "\r\n";
+        head += "Content-Length: 0\r\n";
+        head += req.keepAlive ? "" : "Connection: close\r\n";
+        head += "\r\n";
+        return sendAll(fd, head) && req.keepAlive;
+    }
+
+    off_t length = st.st_size > 0 ? last - first + 1 : 0;
+    int status = partial ? 206 : 200;
+    std::string head = "HTTP/1.1 " + std::to_string(status) + " " + HttpServer::getStatusText(status) + "\r\n";
+    head += "Content-Type: application/octet-stream\r\n";
+    head += "Content-Length: " + std::to_string((long long) length) + "\r\n";
+    head += "Accept-Ranges: bytes\r\n";
+    if (partial)
+        head += "Content-Range: bytes " + std::to_string((long long) first) + "-" +
+                std::to_string((long long) last) + "/" + std::to_string((long long) st.st_size) + "\r\n";
+    head += req.keepAlive ? "" : "Connection: close\r\n";
+    head += "\r\n";
+    bool ok = sendAll(fd, head);
+
+    off_t offset = first;
+    while (ok && length > 0) {
+        ssize_t r = sendfile(fd, fileFd, &offset, (size_t) std::min<off_t>(length, 1 << 30));
+        if (r < 0 && errno == EINTR)
+            continue;
+        // The file might have been truncated, in which case the response can't be completed either
+        if (r <= 0)
+            ok = false;
+        else
+            length -= r;
+    }
+    close(fileFd);
+    return ok && req.keepAlive;
+}
+
+bool JobFileServer::sendAll(int fd, std::string const& data) {
+    size_t off = 0;
+    while (off < data.size()) {
+        ssize_t r = send(fd, data.data() + off, data.size() - off, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        off += (size_t) r;
+    }
+    return true;
+}
+
+bool JobFileServer::sendResponse(int fd, int status, std::string const& contentType, std::string const& body,
+                                 bool keepAlive) {
+    std::string response = HttpServer::buildResponse(status, contentType, body,
+                                                     keepAlive ? std::string() : "Connection: close\r\n");
+    return sendAll(fd, response) && keepAlive;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "job_manager.h"
+#include <string>
+#include <map>
+#include <set>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/**
+ * Serves the files of the jobs to the workers, so that they don't have to be copied with scp. uWS can only send data
+ * from memory, so this has its own listening socket (files.host and files.port in priv/job_queue.conf) and a thread
+ * per connection, which sends the files straight from the page cache with sendfile(). The requests are authenticated
+ * with the same "Authorization: Bearer <token>" as JobQueueService:
+ *
+ *   GET /jobs/<id>/manifest       {"files": [{"name", "size", "sha256"}]}, the names being relative to the job dir
+ *   GET /jobs/<id>/files/<name>   the file; a single "Range: bytes=<first>-[<last>]" resumes a partial download
+ *
+ * The hashes are cached for as long as the file's size and modification time stay the same.
+ */
+class JobFileServer {
+
+private:
+    static const int MAX_CONNECTIONS = 16;
+    static const size_t MAX_HEADER_SIZE = 8192;
+    static const int IO_TIMEOUT = 60; // seconds
+
+    struct Request {
+        std::string method, path;
+        std::string authorization, range;
+        bool keepAlive = false;
+    };
+
+    struct FileHash {
+        off_t size;
+        time_t mtime;
+        std::string sha256;
+    };
+
+    JobManager& jobManager;
+    std::string host;
+    int port;
+    std::string authHeader;
+    int listenFd = -1;
+    std::thread acceptThread;
+    std::mutex mutex;
+    std::condition_variable connectionsCv;
+    bool stopped = false;
+    std::set<int> connections;
+    // job id -> file name -> hash
+    std::map<std::string, std::map<std::string, FileHash>> hashCache;
+
+    void runAcceptThread();
+
+    void handleConnection(int fd);
+
+    // Reads the next request head; the buffer keeps whatever came after it
+    static bool readRequest(int fd, std::string& buf, Request& req);
+
+    // Returns false if the connection has to be closed
+    bool handleRequest(int fd, Request const& req);
+
+    bool checkAuth(Request const& req);
+
+    bool sendManifest(int fd, std::string const& id, std::string const& dir, bool keepAlive);
+
+    bool sendFile(int fd, std::string const& dir, std::string const& name, Request const& req);
+
+    std::string getFileHash(std::string const& id, std::string const& name, std::string const& path,
+                            struct stat const& st);
+
+    static void listFiles(std::string const& dir, std::string const& prefix,
+                          std::map<std::string, struct stat>& files);
+
+    static std::string hashFile(std::string const& path);
+
+    static bool sendAll(int fd, std::string const& data);
+
+    static bool sendResponse(int fd, int status, std::string const& contentType, std::string const& body,
+                             bool keepAlive);
+
+public:
+    JobFileServer(JobManager& jobManager);
+
+    ~JobFileServer();
+
+    void start();
+
+};
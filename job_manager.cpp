@@ -1,19 +1,53 @@
 #include "job_manager.h"
+#include "async_log.h"
 #include "file_utils.h"
 
 #include <uuid/uuid.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <set>
+#include <algorithm>
+#include <cstdio>
 #include <fstream>
 #include <nlohmann/json.hpp>
 
-JobManager::JobManager() : dataRoot("priv/jobs/data"), pendingRoot("priv/jobs/pending"), activeRoot("priv/jobs/active") {
+const int JobManager::LEASE_TIMEOUT;
+const int JobManager::MAX_JOB_ATTEMPTS;
+
+// Serializes the moves of the job links, both within this process and with tool/pull_job.py
+class JobManager::QueueLock {
+
+private:
+    std::lock_guard<std::mutex> lk;
+    int fd;
+
+public:
+    explicit QueueLock(JobManager& manager) : lk(manager.jobMutex), fd(manager.lockFd) {
+        lseek(fd, 0, SEEK_SET);
+        if (lockf(fd, F_LOCK, 0) != 0)
+            throw std::runtime_error("Failed to lock the job queue");
+    }
+
+    ~QueueLock() {
+        lseek(fd, 0, SEEK_SET);
+        lockf(fd, F_ULOCK, 0);
+    }
+
+};
+
+JobManager::JobManager() : dataRoot("priv/jobs/data"), pendingRoot("priv/jobs/pending"), activeRoot("priv/jobs/active"),
+                           leaseTokensPath("priv/jobs/leases.json") {
     FileUtils::mkdirs(dataRoot);
     FileUtils::mkdirs(pendingRoot);
     FileUtils::mkdirs(activeRoot);
+    lockFd = open("priv/jobs/lock", O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lockFd < 0)
+        throw std::runtime_error("Failed to open the job queue lock file");
     cleanUpDataDir();
+    loadLeaseTokens();
     handleJobTimeOut();
 }
 
@@ -24,6 +58,7 @@ JobManager::~JobManager() {
     timeOutThreadMutex.unlock();
     if (timeOutThread.joinable())
         timeOutThread.join();
+    close(lockFd);
 }
 
 void JobManager::cleanUpDataDir() {
@@ -47,7 +82,7 @@ void JobManager::cleanUpDataDir() {
     d = opendir(dataRoot.c_str());
     while ((ent = readdir(d)) != nullptr) {
         if (ent->d_name[0] != '.' && actualJobs.count(ent->d_name) == 0) {
-            printf("Found mismatched job directory: %s\n", ent->d_name);
+            AsyncLog::warn("JobManager", "Found mismatched job directory: %s", ent->d_name);
             FileUtils::deleteDir(dataRoot + "/" + ent->d_name);
         }
     }
@@ -66,9 +101,12 @@ JobMeta JobManager::createJob() {
 }
 
 void JobManager::addApkJob(JobMeta const &meta, ApkJobDescription const &desc) {
+    std::string dedupKey = getApkJobDedupKey(desc.versionCode);
     nlohmann::json descJson = {
             {"type", "updateprocessor/addApkJob"},
             {"versionCode", desc.versionCode},
+            {"priority", (int) desc.priority},
+            {"dedupKey", dedupKey},
             {"apks", nlohmann::json::array()}
     };
     auto &versions = descJson["apks"];
@@ -83,44 +121,502 @@ void JobManager::addApkJob(JobMeta const &meta, ApkJobDescription const &desc) {
         descWriter << descJson;
     }
 
-    char *dataDirRpath = realpath(meta.dataDir.c_str(), nullptr);
-    symlink(dataDirRpath, (pendingRoot + "/" + meta.uuid).c_str());
+    bool duplicate;
+    {
+        QueueLock lock (*this);
+        duplicate = mergeDuplicateJob(meta.uuid, dedupKey, desc.priority);
+        if (!duplicate) {
+            char *dataDirRpath = realpath(meta.dataDir.c_str(), nullptr);
+            symlink(dataDirRpath, (pendingRoot + "/" + meta.uuid).c_str());
+            free(dataDirRpath);
+        }
+    }
+    if (duplicate) {
+        FileUtils::deleteDir(meta.dataDir);
+        return;
+    }
+    AsyncLog::info("JobManager", "Queued apk job %s (version code %i)", meta.uuid.c_str(), desc.versionCode);
+    notifyJobAdded();
+}
+
+bool JobManager::isValidJobId(std::string const& uuid) {
+    // Also keeps the ids coming from the workers from escaping the job directories
+    if (uuid.size() != 36)
+        return false;
+    for (char c : uuid) {
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || c == '-'))
+            return false;
+    }
+    return true;
+}
+
+std::string JobManager::getJobDataDir(std::string const& uuid) {
+    if (!isValidJobId(uuid))
+        return std::string();
+    char* dataDir = realpath((dataRoot + "/" + uuid).c_str(), nullptr);
+    if (dataDir == nullptr)
+        return std::string();
+    std::string ret (dataDir);
+    free(dataDir);
+    return ret;
+}
+
+std::string JobManager::getApkJobDedupKey(int versionCode) {
+    return "updateprocessor/addApkJob:" + std::to_string(versionCode);
+}
+
+bool JobManager::readJobInfo(std::string const& dataDir, JobInfo& info) {
+    std::ifstream ifs(dataDir + "/job.json");
+    if (!ifs)
+        return false;
+    try {
+        nlohmann::json j;
+        ifs >> j;
+        info.type = j.value("type", std::string());
+        info.priority = (JobPriority) j.value("priority", (int) JobPriority::NORMAL);
+        info.dedupKey = j.value("dedupKey", std::string());
+    } catch (std::exception& e) {
+        return false;
+    }
+    return true;
+}
+
+// Rewrites job.json, replacing it atomically
+static void updateJobDesc(std::string const& dataDir, std::function<void (nlohmann::json& desc)> const& update) {
+    std::string path = dataDir + "/job.json";
+    nlohmann::json j;
+    {
+        std::ifstream ifs(path);
+        ifs >> j;
+    }
+    update(j);
+    {
+        std::ofstream ofs(path + ".new");
+        ofs << j;
+        if (!ofs)
+            throw std::runtime_error("Failed to write " + path);
+    }
+    rename((path + ".new").c_str(), path.c_str());
+}
+
+void JobManager::writeJobPriority(std::string const& dataDir, JobPriority priority) {
+    updateJobDesc(dataDir, [priority](nlohmann::json& desc) {
+        desc["priority"] = (int) priority;
+    });
+}
+
+int JobManager::addJobAttempt(std::string const& dataDir) {
+    int attempts = 0;
+    updateJobDesc(dataDir, [&attempts](nlohmann::json& desc) {
+        attempts = desc.value("attempts", 0) + 1;
+        desc["attempts"] = attempts;
+    });
+    return attempts;
+}
+
+bool JobManager::mergeDuplicateJob(std::string const& uuid, std::string const& dedupKey, JobPriority priority) {
+    const std::string* roots[] = {&pendingRoot, &activeRoot};
+    for (auto root : roots) {
+        DIR *d = opendir(root->c_str());
+        if (d == nullptr)
+            continue;
+        dirent *ent;
+        std::string found;
+        while (found.empty() && (ent = readdir(d)) != nullptr) {
+            if (ent->d_name[0] == '.' || uuid == ent->d_name)
+                continue;
+            // Follows the link to the data directory
+            std::string dataDir = *root + "/" + ent->d_name;
+            JobInfo info;
+            if (!readJobInfo(dataDir, info) || info.dedupKey != dedupKey)
+                continue;
+            found = ent->d_name;
+            // An active job might be done with the new job.json already, so only the pending ones are raised
+            if (root == &pendingRoot && priority > info.priority) {
+                auto indexed = pendingIndex.find(found);
+                if (indexed != pendingIndex.end())
+                    indexed->second.info.priority = priority;
+                try {
+                    writeJobPriority(dataDir, priority);
+                } catch (std::exception& e) {
+                    AsyncLog::error("JobManager", "Failed to raise the priority of job %s: %s", ent->d_name, e.what());
+                }
+            }
+        }
+        closedir(d);
+        if (!found.empty()) {
+            AsyncLog::info("JobManager", "Merged a duplicate of %s job %s (%s)",
+                           root == &pendingRoot ? "pending" : "active", found.c_str(), dedupKey.c_str());
+            return true;
+        }
+    }
+    return false;
+}
+
+bool JobManager::hasDuplicateJob(std::string const& dedupKey, JobPriority priority) {
+    QueueLock lock (*this);
+    return mergeDuplicateJob(std::string(), dedupKey, priority);
+}
+
+void JobManager::addJobAddedCallback(JobAddedCallback callback) {
+    jobAddedCallbacks.push_back(std::move(callback));
+}
+
+void JobManager::notifyJobAdded() {
+    for (auto const& cb : jobAddedCallbacks)
+        cb();
+}
+
+bool JobManager::registerJob(std::string const& uuid) {
+    if (!isValidJobId(uuid))
+        return false;
+    char* dataDirRpath = realpath((dataRoot + "/" + uuid).c_str(), nullptr);
+    if (dataDirRpath == nullptr)
+        return false;
+    std::string dataDir (dataDirRpath);
     free(dataDirRpath);
+    JobInfo info;
+    readJobInfo(dataDir, info);
+    bool duplicate = false;
+    {
+        QueueLock lock (*this);
+        if (!info.dedupKey.empty() && mergeDuplicateJob(uuid, info.dedupKey, info.priority))
+            duplicate = true;
+        else if (symlink(dataDir.c_str(), (pendingRoot + "/" + uuid).c_str()) != 0)
+            return false;
+    }
+    if (duplicate) {
+        FileUtils::deleteDir(dataDir);
+        return true;
+    }
+    AsyncLog::info("JobManager", "Queued uploaded job %s", uuid.c_str());
+    notifyJobAdded();
+    return true;
 }
 
-void JobManager::handleJobTimeOut() {
-    DIR *d = opendir(activeRoot.c_str());
+static bool isSameTime(timespec const& a, timespec const& b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+bool JobManager::mightHavePendingJob(std::set<std::string> const& types) {
+    struct stat dir;
+    if (stat(pendingRoot.c_str(), &dir) != 0 || !isSameTime(dir.st_mtim, pendingIndexTime))
+        return true;
+    for (auto const& p : pendingIndex) {
+        if (types.empty() || types.count(p.second.info.type) > 0)
+            return true;
+    }
+    return false;
+}
+
+void JobManager::refreshPendingIndex() {
+    struct stat dir;
+    if (stat(pendingRoot.c_str(), &dir) != 0 || isSameTime(dir.st_mtim, pendingIndexTime))
+        return;
+    DIR *d = opendir(pendingRoot.c_str());
+    if (d == nullptr)
+        return;
+    // Taken before the scan, so that whatever changes during it causes another one
+    pendingIndexTime = dir.st_mtim;
+    std::map<std::string, PendingJob> index;
     dirent *ent;
     while ((ent = readdir(d)) != nullptr) {
         if (ent->d_name[0] == '.')
             continue;
+        std::string pendingPath = pendingRoot + "/" + ent->d_name;
+        struct stat link;
+        if (lstat(pendingPath.c_str(), &link) != 0)
+            continue;
+        auto old = pendingIndex.find(ent->d_name);
+        if (old != pendingIndex.end()) {
+            index[ent->d_name] = {old->second.info, link.st_mtim};
+            continue;
+        }
+        struct stat data;
+        if (stat(pendingPath.c_str(), &data) != 0) {
+            AsyncLog::warn("JobManager", "Removing a dangling pending job: %s", ent->d_name);
+            remove(pendingPath.c_str());
+            continue;
+        }
+        // A job without a readable job.json only goes to the workers that take any type
+        PendingJob job;
+        readJobInfo(pendingPath, job.info);
+        job.queued = link.st_mtim;
+        index[ent->d_name] = std::move(job);
+    }
+    closedir(d);
+    pendingIndex = std::move(index);
+}
+
+bool JobManager::leaseJob(JobLease& lease, std::set<std::string> const& types) {
+    {
+        // Called for every waiting worker on the HTTP server's loop, so the usual case of there being nothing for
+        // them mustn't take the lock file or read the directory
+        std::lock_guard<std::mutex> lk(jobMutex);
+        if (!mightHavePendingJob(types))
+            return false;
+    }
+
+    QueueLock lock (*this);
+    refreshPendingIndex();
+    std::vector<std::pair<std::string, PendingJob const*>> candidates;
+    for (auto const& p : pendingIndex) {
+        if (types.empty() || types.count(p.second.info.type) > 0)
+            candidates.emplace_back(p.first, &p.second);
+    }
+    std::sort(candidates.begin(), candidates.end(), [](std::pair<std::string, PendingJob const*> const& a,
+                                                      std::pair<std::string, PendingJob const*> const& b) {
+        if (a.second->info.priority != b.second->info.priority)
+            return a.second->info.priority > b.second->info.priority;
+        if (a.second->queued.tv_sec != b.second->queued.tv_sec)
+            return a.second->queued.tv_sec < b.second->queued.tv_sec;
+        return a.second->queued.tv_nsec < b.second->queued.tv_nsec;
+    });
+
+    bool found = false;
+    std::vector<std::string> gone;
+    for (auto it = candidates.begin(); !found && it != candidates.end(); ++it) {
+        std::string pendingPath = pendingRoot + "/" + it->first;
+        char* dataDir = realpath(pendingPath.c_str(), nullptr);
+        if (dataDir == nullptr) {
+            // Taken by someone else since the index was built
+            gone.push_back(it->first);
+            continue;
+        }
+        if (symlink(dataDir, (activeRoot + "/" + it->first).c_str()) == 0) {
+            remove(pendingPath.c_str());
+            // The job might have been pending for longer than the timeout
+            utimes(dataDir, nullptr);
+            lease.uuid = it->first;
+            lease.dataDir = dataDir;
+            gone.push_back(it->first);
+            found = true;
+        }
+        free(dataDir);
+    }
+    for (auto const& uuid : gone)
+        pendingIndex.erase(uuid);
+    if (!found)
+        return false;
+
+    uuid_t token;
+    uuid_generate_random(token);
+    char s[37];
+    uuid_unparse(token, s);
+    lease.token = s;
+    leaseTokens[lease.uuid] = lease.token;
+    saveLeaseTokens();
+    setLeaseDeadline(lease.uuid, Clock::now() + std::chrono::seconds(LEASE_TIMEOUT));
+    AsyncLog::info("JobManager", "Leased job %s", lease.uuid.c_str());
+    return true;
+}
+
+void JobManager::loadLeaseTokens() {
+    std::ifstream ifs(leaseTokensPath);
+    if (!ifs)
+        return;
+    try {
+        nlohmann::json j;
+        ifs >> j;
+        for (auto it = j.begin(); it != j.end(); ++it) {
+            // The job might have been completed or requeued while the tokens couldn't be saved
+            struct stat data;
+            if (isValidJobId(it.key()) && lstat((activeRoot + "/" + it.key()).c_str(), &data) == 0)
+                leaseTokens[it.key()] = it.value().get<std::string>();
+        }
+    } catch (std::exception& e) {
+        AsyncLog::error("JobManager", "Failed to load the lease tokens: %s", e.what());
+    }
+}
+
+void JobManager::saveLeaseTokens() {
+    nlohmann::json j = nlohmann::json::object();
+    for (auto const& t : leaseTokens)
+        j[t.first] = t.second;
+    {
+        std::ofstream ofs(leaseTokensPath + ".new");
+        ofs << j;
+        if (!ofs) {
+            AsyncLog::error("JobManager", "Failed to save the lease tokens");
+            return;
+        }
+    }
+    rename((leaseTokensPath + ".new").c_str(), leaseTokensPath.c_str());
+}
+
+bool JobManager::checkLease(std::string const& uuid, std::string const& token) {
+    if (!isValidJobId(uuid))
+        return false;
+    struct stat data;
+    if (lstat((activeRoot + "/" + uuid).c_str(), &data) != 0)
+        return false;
+    auto it = leaseTokens.find(uuid);
+    return it != leaseTokens.end() && it->second == token;
+}
+
+bool JobManager::renewLease(std::string const& uuid, std::string const& token) {
+    QueueLock lock (*this);
+    if (!checkLease(uuid, token))
+        return false;
+    // Follows the link, the same as touching it over SSH does
+    if (utimes((activeRoot + "/" + uuid).c_str(), nullptr) != 0)
+        return false;
+    setLeaseDeadline(uuid, Clock::now() + std::chrono::seconds(LEASE_TIMEOUT));
+    return true;
+}
+
+bool JobManager::completeJob(std::string const& uuid, std::string const& token) {
+    {
+        QueueLock lock (*this);
+        if (!checkLease(uuid, token))
+            return false;
+        remove((activeRoot + "/" + uuid).c_str());
+        leaseTokens.erase(uuid);
+        leaseDeadlines.erase(uuid);
+        saveLeaseTokens();
+    }
+    FileUtils::deleteDir(dataRoot + "/" + uuid);
+    AsyncLog::info("JobManager", "Job completed: %s", uuid.c_str());
+    return true;
+}
+
+bool JobManager::failJob(std::string const& uuid, std::string const& token, bool retry) {
+    int attempts = 0;
+    {
+        QueueLock lock (*this);
+        if (!checkLease(uuid, token))
+            return false;
+        std::string activePath = activeRoot + "/" + uuid;
+        leaseTokens.erase(uuid);
+        leaseDeadlines.erase(uuid);
+        saveLeaseTokens();
+        char* dataDir = realpath(activePath.c_str(), nullptr);
+        if (dataDir == nullptr)
+            retry = false; // nothing left to retry
+        if (retry) {
+            // A job that keeps failing would otherwise go around all the workers forever
+            try {
+                attempts = addJobAttempt(dataDir);
+            } catch (std::exception& e) {
+                AsyncLog::error("JobManager", "Failed to count the attempts of job %s: %s", uuid.c_str(), e.what());
+                attempts = MAX_JOB_ATTEMPTS;
+            }
+            if (attempts >= MAX_JOB_ATTEMPTS)
+                retry = false;
+        }
+        remove(activePath.c_str());
+        if (retry)
+            symlink(dataDir, (pendingRoot + "/" + uuid).c_str());
+        free(dataDir);
+    }
+    if (retry) {
+        AsyncLog::warn("JobManager", "Job failed: %s, queued again (attempt %i of %i)", uuid.c_str(), attempts,
+                       MAX_JOB_ATTEMPTS);
+        notifyJobAdded();
+    } else {
+        if (attempts >= MAX_JOB_ATTEMPTS)
+            AsyncLog::error("JobManager", "Job failed: %s, giving up after %i attempts", uuid.c_str(), attempts);
+        else
+            AsyncLog::warn("JobManager", "Job failed: %s", uuid.c_str());
+        FileUtils::deleteDir(dataRoot + "/" + uuid);
+    }
+    return true;
+}
+
+void JobManager::setLeaseDeadline(std::string const& uuid, Clock::time_point deadline) {
+    leaseDeadlines[uuid] = deadline;
+    leaseHeap.push({deadline, uuid});
+    std::lock_guard<std::mutex> lk(timeOutThreadMutex);
+    if (deadline < timeOutThreadWakeTime) {
+        timeOutThreadWakeRequested = true;
+        timeOutThreadStopCv.notify_all();
+    }
+}
+
+void JobManager::scanActiveJobs() {
+    DIR *d = opendir(activeRoot.c_str());
+    if (d == nullptr)
+        return;
+    dirent *ent;
+    while ((ent = readdir(d)) != nullptr) {
+        if (ent->d_name[0] == '.' || leaseDeadlines.count(ent->d_name) > 0)
+            continue;
         struct stat data;
         if (stat((activeRoot + "/" + ent->d_name).c_str(), &data))
             continue;
-        if (time(nullptr) - data.st_mtim.tv_sec > 60 * 10) {
-            printf("Job timed out: %s\n", ent->d_name);
+        setLeaseDeadline(ent->d_name, Clock::from_time_t(data.st_mtim.tv_sec) + std::chrono::seconds(LEASE_TIMEOUT));
+    }
+    closedir(d);
+}
+
+std::chrono::system_clock::time_point JobManager::handleJobTimeOut() {
+    bool requeued = false;
+    Clock::time_point nextWake;
+    {
+        QueueLock lock (*this);
+        auto now = Clock::now();
+        if (now >= nextActiveScan) {
+            scanActiveJobs();
+            nextActiveScan = now + std::chrono::seconds(LEASE_TIMEOUT);
+        }
+        while (!leaseHeap.empty() && leaseHeap.top().deadline <= now) {
+            LeaseDeadline top = leaseHeap.top();
+            leaseHeap.pop();
+            auto it = leaseDeadlines.find(top.uuid);
+            if (it == leaseDeadlines.end() || it->second != top.deadline)
+                continue;
+            std::string activePath = activeRoot + "/" + top.uuid;
+            struct stat data;
+            if (stat(activePath.c_str(), &data)) {
+                // Completed by someone else
+                leaseDeadlines.erase(it);
+                continue;
+            }
+            // Renewed by touching it over SSH
+            auto touchedDeadline = Clock::from_time_t(data.st_mtim.tv_sec) + std::chrono::seconds(LEASE_TIMEOUT);
+            if (touchedDeadline > now) {
+                setLeaseDeadline(top.uuid, touchedDeadline);
+                continue;
+            }
+            leaseDeadlines.erase(it);
+            AsyncLog::warn("JobManager", "Job timed out: %s", top.uuid.c_str());
 
             char buf[256];
-            ssize_t ret = readlink((activeRoot + "/" + ent->d_name).c_str(), buf, sizeof(buf) - 1);
-            if (ret < 0 || ret >= sizeof(buf) - 1) {
-                printf("readlink failed\n");
+            ssize_t ret = readlink(activePath.c_str(), buf, sizeof(buf) - 1);
+            if (ret < 0 || ret >= (ssize_t) sizeof(buf) - 1) {
+                AsyncLog::error("JobManager", "readlink failed");
                 continue;
             }
             buf[ret] = '\0';
-            remove((activeRoot + "/" + ent->d_name).c_str());
-            symlink(buf, (pendingRoot + "/" + ent->d_name).c_str());
+            remove(activePath.c_str());
+            symlink(buf, (pendingRoot + "/" + top.uuid).c_str());
+            // Any later request with the old token gets rejected, even if the job is leased over SSH next
+            if (leaseTokens.erase(top.uuid) > 0)
+                saveLeaseTokens();
+            requeued = true;
         }
+        nextWake = nextActiveScan;
+        if (!leaseHeap.empty() && leaseHeap.top().deadline < nextWake)
+            nextWake = leaseHeap.top().deadline;
     }
-    closedir(d);
+    if (requeued)
+        notifyJobAdded();
+    return nextWake;
 }
 
 void JobManager::runJobTimeOutThread() {
     std::unique_lock<std::mutex> lk(timeOutThreadMutex);
     while (!timeOutThreadStopped) {
-        handleJobTimeOut();
-
-        auto until = std::chrono::system_clock::now() + std::chrono::minutes(10);
-        timeOutThreadStopCv.wait_until(lk, until);
+        timeOutThreadWakeRequested = false;
+        // Any deadline set while this runs might be earlier than the one returned, so take another look then
+        timeOutThreadWakeTime = Clock::time_point::max();
+        lk.unlock();
+        auto nextWake = handleJobTimeOut();
+        lk.lock();
+        timeOutThreadWakeTime = nextWake;
+        timeOutThreadStopCv.wait_until(lk, nextWake, [this]() {
+            return timeOutThreadStopped || timeOutThreadWakeRequested;
+        });
     }
 }
 
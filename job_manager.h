@@ -2,31 +2,142 @@
 
 #include <string>
 #include <vector>
+#include <map>
+#include <set>
 #include <mutex>
 #include <condition_variable>
 #include <thread>
+#include <functional>
+#include <queue>
+#include <chrono>
+
+// Stored as a number in job.json; the pending jobs are leased highest first, and oldest first within a class
+enum class JobPriority {
+    BACKFILL = 0, NORMAL = 1, URGENT = 2
+};
 
 struct JobMeta {
     std::string uuid;
     std::string dataDir;
 };
 
+struct JobLease {
+    std::string uuid;
+    std::string dataDir; // absolute
+    std::string token; // needed to renew, complete or fail the job
+};
+
 struct ApkJobDescription {
     int versionCode;
     std::vector<std::pair<std::string, std::string>> apks;
+    JobPriority priority = JobPriority::NORMAL;
 };
 
+/**
+ * The jobs are directories in priv/jobs/data, queued by symlinks in priv/jobs/pending and moved to priv/jobs/active
+ * once a worker has taken them. Workers either take them over SSH (tool/pull_job.py) or lease them through
+ * JobQueueService; both move the links under the same lock file, so they can be used side by side.
+ *
+ * A job whose data directory hasn't been touched (renewed) for LEASE_TIMEOUT goes back to pending. The deadlines of
+ * the active jobs are kept in a heap and the time out thread sleeps until the earliest one. The jobs leased by other
+ * processes are only found by a scan of the active directory every LEASE_TIMEOUT; the deadlines come from the
+ * modification times, so they are still requeued on time, or right when they are found.
+ *
+ * Besides the "type", job.json may have a "priority" (see JobPriority) and a "dedupKey". A job whose key matches one
+ * that is pending or active already isn't queued; the queued one is raised to its priority instead. Workers may ask
+ * for only the types they can run. tool/pull_job.py reads the same fields.
+ */
 class JobManager {
 
+public:
+    using JobAddedCallback = std::function<void ()>;
+
+    static const int LEASE_TIMEOUT = 60 * 10;
+    // Failures after which a job is given up rather than retried; counted in job.json, time outs don't count
+    static const int MAX_JOB_ATTEMPTS = 3;
+
 private:
-    const std::string dataRoot, pendingRoot, activeRoot;
+    class QueueLock;
+
+    struct JobInfo {
+        std::string type;
+        JobPriority priority = JobPriority::NORMAL;
+        std::string dedupKey;
+    };
+
+    struct PendingJob {
+        JobInfo info;
+        timespec queued; // the time the link was created, ie. the job was queued (again)
+    };
+
+    using Clock = std::chrono::system_clock; // the same clock as the modification times
+
+    struct LeaseDeadline {
+        Clock::time_point deadline;
+        std::string uuid;
+
+        bool operator>(LeaseDeadline const& o) const {
+            return deadline > o.deadline;
+        }
+    };
+
+    const std::string dataRoot, pendingRoot, activeRoot, leaseTokensPath;
+    int lockFd = -1;
+    std::mutex jobMutex;
+    // The tokens of the active leases given out through leaseJob(), saved in leaseTokensPath so that they stay valid
+    // across restarts; a job that isn't in here (any more) has no valid token
+    std::map<std::string, std::string> leaseTokens;
+    // The pending directory as of its modification time below; tool/pull_job.py and SSH uploads change it too, so the
+    // index is rebuilt whenever the time changes, but the job.json of a job is only read once
+    std::map<std::string, PendingJob> pendingIndex;
+    timespec pendingIndexTime = {0, 0};
+    // A renewal pushes a new entry; the entries that don't match the current deadline of the job are skipped
+    std::priority_queue<LeaseDeadline, std::vector<LeaseDeadline>, std::greater<LeaseDeadline>> leaseHeap;
+    std::map<std::string, Clock::time_point> leaseDeadlines;
+    Clock::time_point nextActiveScan;
+    std::vector<JobAddedCallback> jobAddedCallbacks;
     std::thread timeOutThread;
     std::mutex timeOutThreadMutex;
     bool timeOutThreadStopped = false;
+    bool timeOutThreadWakeRequested = false;
+    Clock::time_point timeOutThreadWakeTime;
     std::condition_variable timeOutThreadStopCv;
 
     void runJobTimeOutThread();
 
+    void notifyJobAdded();
+
+    // Called with the queue lock held
+    void setLeaseDeadline(std::string const& uuid, Clock::time_point deadline);
+
+    // Adds the active jobs that have no deadline yet, eg. the ones leased over SSH; called with the queue lock held
+    void scanActiveJobs();
+
+    static bool readJobInfo(std::string const& dataDir, JobInfo& info);
+
+    static void writeJobPriority(std::string const& dataDir, JobPriority priority);
+
+    // Returns the number of failed attempts including this one
+    static int addJobAttempt(std::string const& dataDir);
+
+    // Called with the job mutex held; whether leaseJob() might find anything, from the index if it's up to date
+    bool mightHavePendingJob(std::set<std::string> const& types);
+
+    // Called with the queue lock held
+    void refreshPendingIndex();
+
+    // Called with the queue lock held; looks for another pending or active job with the key, and raises its priority
+    // if it's pending
+    bool mergeDuplicateJob(std::string const& uuid, std::string const& dedupKey, JobPriority priority);
+
+    void loadLeaseTokens();
+
+    // Called with the queue lock held; failing to save is only logged, the worker then loses its lease on a restart
+    void saveLeaseTokens();
+
+    // Called with the queue lock held; the jobs leased over SSH, or whose lease has timed out, have no valid token
+    bool checkLease(std::string const& uuid, std::string const& token);
+
 public:
     JobManager();
 
@@ -34,7 +145,8 @@ public:
 
     void cleanUpDataDir();
 
-    void handleJobTimeOut();
+    // Requeues the jobs whose lease has expired and returns when the next one expires
+    std::chrono::system_clock::time_point handleJobTimeOut();
 
     void startTimeOutThread();
 
@@ -42,4 +154,33 @@ public:
 
     void addApkJob(JobMeta const &meta, ApkJobDescription const &desc);
 
+    static bool isValidJobId(std::string const& uuid);
+
+    static std::string getApkJobDedupKey(int versionCode);
+
+    // Returns true if an equivalent job is pending or active already, raising a pending one to the priority; lets the
+    // callers skip preparing a job that would be dropped anyway
+    bool hasDuplicateJob(std::string const& dedupKey, JobPriority priority);
+
+    // Returns the absolute data directory of a pending or active job, or an empty string if there is no such job
+    std::string getJobDataDir(std::string const& uuid);
+
+    // Must be called before the jobs start being added; the callback may run on any thread
+    void addJobAddedCallback(JobAddedCallback callback);
+
+    // Queues a job whose directory has been created in the data root by someone else (eg. uploaded by a worker)
+    bool registerJob(std::string const& uuid);
+
+    // Moves the pending job with the highest priority, of one of the types if any are given, to active; returns false
+    // if there are none
+    bool leaseJob(JobLease& lease, std::set<std::string> const& types = std::set<std::string>());
+
+    // The following return false if the job isn't active or the token doesn't match
+    bool renewLease(std::string const& uuid, std::string const& token);
+
+    bool completeJob(std::string const& uuid, std::string const& token);
+
+    // Puts the job back to pending, or deletes it if it shouldn't be retried or has failed MAX_JOB_ATTEMPTS times
+    bool failJob(std::string const& uuid, std::string const& token, bool retry);
+
 };
\ No newline at end of file
@@ -0,0 +1,189 @@
+#include "job_queue_service.h"
+#include "async_log.h"
+
+#include <fstream>
+#include <algorithm>
+#include <cstdlib>
+#include <playapi/util/config.h>
+#include <nlohmann/json.hpp>
+
+const int JobQueueService::MAX_WAIT;
+const size_t JobQueueService::MAX_QUEUED_CALLS;
+
+JobQueueService::JobQueueService(HttpServer& server, JobManager& jobManager) : server(server),
+        jobManager(jobManager), pool(1, MAX_QUEUED_CALLS) {
+    playapi::config conf;
+    std::ifstream ifs("priv/job_queue.conf");
+    conf.load(ifs);
+    std::string token = conf.get("token", "");
+    if (token.empty()) {
+        AsyncLog::info("JobQueue", "No token is configured, the job queue API is disabled");
+        return;
+    }
+    authHeader = "Bearer " + token;
+
+    using namespace std::placeholders;
+    server.addHandler("/jobs/", std::bind(&JobQueueService::handleRequest, this, _1, _2, _3));
+    server.addCancelledHandler(std::bind(&JobQueueService::onCancelled, this, _1));
+    server.addTickHandler(std::bind(&JobQueueService::onTick, this));
+    jobManager.addJobAddedCallback([this]() {
+        this->server.post(std::bind(&JobQueueService::serveWaiters, this));
+    });
+}
+
+bool JobQueueService::checkAuth(uWS::HttpRequest& req) {
+    uWS::Header auth = req.getHeader("authorization");
+    if (!auth || auth.valueLength != authHeader.size())
+        return false;
+    // Compares the whole value regardless of where the first difference is
+    unsigned char diff = 0;
+    for (size_t i = 0; i < authHeader.size(); i++)
+        diff |= (unsigned char) (auth.value[i] ^ authHeader[i]);
+    return diff == 0;
+}
+
+std::string JobQueueService::buildLeaseResponse(JobLease const& lease) {
+    nlohmann::json j;
+    j["id"] = lease.uuid;
+    j["token"] = lease.token;
+    j["dir"] = lease.dataDir;
+    j["lease_timeout"] = JobManager::LEASE_TIMEOUT;
+    return HttpServer::buildResponse(200, "application/json", j.dump());
+}
+
+void JobQueueService::handleRequest(uWS::HttpResponse* res, uWS::HttpRequest& req, std::string const& path) {
+    if (req.getMethod() != uWS::METHOD_POST) {
+        HttpServer::sendResponse(res, 405, "text/plain", "Method not allowed");
+        return;
+    }
+    if (!checkAuth(req)) {
+        HttpServer::sendResponse(res, 401, "text/plain", "Unauthorized");
+        return;
+    }
+    std::string id = HttpServer::getQueryParameter(req, "id");
+    std::string token = HttpServer::getQueryParameter(req, "token");
+    try {
+        if (path == "/jobs/lease") {
+            int wait = std::min(std::atoi(HttpServer::getQueryParameter(req, "wait").c_str()), MAX_WAIT);
+            // Someone else might be waiting already, and they were first; this one might still get a job they can't run
+            waiters.push_back({res, Clock::now() + std::chrono::seconds(std::max(wait, 0)),
+                               parseTypes(HttpServer::getQueryParameter(req, "types"))});
+            serveWaiters();
+            if (wait <= 0 && !waiters.empty() && waiters.back().res == res) {
+                waiters.pop_back();
+                HttpServer::sendRaw(res, HttpServer::buildResponse(204, "text/plain", ""));
+            }
+            return;
+        }
+
+        JobManager& jobs = jobManager;
+        if (path == "/jobs/renew") {
+            runCall(res, path, [&jobs, id, token]() { return jobs.renewLease(id, token); }, 409);
+        } else if (path == "/jobs/complete") {
+            runCall(res, path, [&jobs, id, token]() { return jobs.completeJob(id, token); }, 409);
+        } else if (path == "/jobs/fail") {
+            bool retry = HttpServer::getQueryParameter(req, "retry") != "0";
+            runCall(res, path, [&jobs, id, token, retry]() { return jobs.failJob(id, token, retry); }, 409);
+        } else if (path == "/jobs/add") {
+            runCall(res, path, [&jobs, id]() { return jobs.registerJob(id); }, 400);
+        } else {
+            HttpServer::sendResponse(res, 404, "text/plain", "Not found");
+        }
+    } catch (std::exception& e) {
+        AsyncLog::error("JobQueue", "Failed to handle %s: %s", path.c_str(), e.what());
+        HttpServer::sendResponse(res, 503, "text/plain", "Failed");
+    }
+}
+
+void JobQueueService::runCall(uWS::HttpResponse* res, std::string const& path, std::function<bool ()> call,
+                              int rejectStatus) {
+    unsigned long long callId = nextCallId++;
+    bool posted = pool.tryPost([this, res, callId, path, call, rejectStatus]() {
+        std::string response;
+        try {
+            if (call())
+                response = HttpServer::buildResponse(204, "text/plain", "");
+            else
+                response = HttpServer::buildResponse(rejectStatus, "text/plain", "Rejected");
+        } catch (std::exception& e) {
+            AsyncLog::error("JobQueue", "Failed to handle %s: %s", path.c_str(), e.what());
+            response = HttpServer::buildResponse(503, "text/plain", "Failed");
+        }
+        server.post(std::bind(&JobQueueService::finishCall, this, res, callId, std::move(response)));
+    });
+    if (!posted) {
+        AsyncLog::warn("JobQueue", "Too many calls queued, rejected %s", path.c_str());
+        HttpServer::sendResponse(res, 503, "text/plain", "Busy");
+        return;
+    }
+    pendingCalls[res] = callId;
+}
+
+void JobQueueService::finishCall(uWS::HttpResponse* res, unsigned long long callId, std::string const& response) {
+    auto it = pendingCalls.find(res);
+    if (it == pendingCalls.end() || it->second != callId)
+        return; // the client went away
+    pendingCalls.erase(it);
+    HttpServer::sendRaw(res, response);
+}
+
+std::set<std::string> JobQueueService::parseTypes(std::string const& value) {
+    std::string decoded;
+    std::set<std::string> ret;
+    if (!HttpServer::percentDecode(value, decoded))
+        return ret;
+    size_t start = 0;
+    while (start < decoded.size()) {
+        size_t end = decoded.find(',', start);
+        if (end == std::string::npos)
+            end = decoded.size();
+        if (end > start)
+            ret.insert(decoded.substr(start, end - start));
+        start = end + 1;
+    }
+    return ret;
+}
+
+void JobQueueService::serveWaiters() {
+    JobLease lease;
+    try {
+        for (auto it = waiters.begin(); it != waiters.end(); ) {
+            if (jobManager.leaseJob(lease, it->types)) {
+                HttpServer::sendRaw(it->res, buildLeaseResponse(lease));
+                it = waiters.erase(it);
+            } else if (it->types.empty()) {
+                break; // nothing is pending for anyone
+            } else {
+                ++it;
+            }
+        }
+    } catch (std::exception& e) {
+        AsyncLog::error("JobQueue", "Failed to lease a job: %s", e.what());
+    }
+}
+
+void JobQueueService::onTick() {
+    if (waiters.empty())
+        return;
+    serveWaiters();
+    auto now = Clock::now();
+    for (auto it = waiters.begin(); it != waiters.end(); ) {
+        if (it->deadline <= now) {
+            HttpServer::sendRaw(it->res, HttpServer::buildResponse(204, "text/plain", ""));
+            it = waiters.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void JobQueueService::onCancelled(uWS::HttpResponse* res) {
+    if (pendingCalls.erase(res) > 0)
+        return;
+    for (auto it = waiters.begin(); it != waiters.end(); ++it) {
+        if (it->res == res) {
+            waiters.erase(it);
+            return;
+        }
+    }
+}
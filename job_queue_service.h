@@ -0,0 +1,79 @@
+#pragma once
+
+#include "http_server.h"
+#include "job_manager.h"
+#include "worker_pool.h"
+#include <list>
+#include <map>
+#include <set>
+#include <chrono>
+
+/**
+ * Lets the workers lease jobs over the local HTTP server instead of polling for them over SSH. All the requests are
+ * POSTs authenticated with "Authorization: Bearer <token>" (the token is in priv/job_queue.conf; without one the API
+ * is disabled):
+ *
+ *   /jobs/lease?wait=<seconds>[&types=<type>,...]
+ *                                    200 {"id", "token", "dir", "lease_timeout"}, or 204 if none came up in time
+ *   /jobs/renew?id=<id>&token=<t>    204, or 409 if the lease is gone (timed out, whether or not it was leased again)
+ *   /jobs/complete?id=<id>&token=<t> 204 or 409; deletes the job
+ *   /jobs/fail?id=<id>&token=<t>&retry=<0|1>
+ *                                    204 or 409; retried jobs are given up after JobManager::MAX_JOB_ATTEMPTS failures
+ *   /jobs/add?id=<id>                queues a job uploaded to priv/jobs/data/<id>
+ *
+ * A lease with types only gets the jobs of those types, so that workers without eg. IDA only get what they can run.
+ * Lease requests wait on the server's loop until a job is added, without holding a thread. Jobs linked into the
+ * pending directory by other processes are only noticed by the once a second rescan while someone is waiting.
+ *
+ * The other calls take the queue lock and touch the disk (completing a job deletes its whole directory), so they run
+ * on a worker thread and answer back on the loop; the loop also serves the version queries.
+ */
+class JobQueueService {
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static const int MAX_WAIT = 60;
+    static const size_t MAX_QUEUED_CALLS = 64;
+
+    struct Waiter {
+        uWS::HttpResponse* res;
+        Clock::time_point deadline;
+        std::set<std::string> types;
+    };
+
+    HttpServer& server;
+    JobManager& jobManager;
+    std::string authHeader;
+    // Only used on the server's thread
+    std::list<Waiter> waiters;
+    // The responses waiting for a call on the pool, so that the ones cancelled in the meantime are never written to;
+    // the id tells apart a new response that got the same address. Only used on the server's thread
+    std::map<uWS::HttpResponse*, unsigned long long> pendingCalls;
+    unsigned long long nextCallId = 1;
+    WorkerPool pool;
+
+    bool checkAuth(uWS::HttpRequest& req);
+
+    void handleRequest(uWS::HttpResponse* res, uWS::HttpRequest& req, std::string const& path);
+
+    // Runs the call on the pool and answers with 204, or rejectStatus if it returned false
+    void runCall(uWS::HttpResponse* res, std::string const& path, std::function<bool ()> call, int rejectStatus);
+
+    void finishCall(uWS::HttpResponse* res, unsigned long long callId, std::string const& response);
+
+    static std::set<std::string> parseTypes(std::string const& value);
+
+    // Hands out the pending jobs to the waiting workers, the ones that have waited the longest first
+    void serveWaiters();
+
+    void onTick();
+
+    void onCancelled(uWS::HttpResponse* res);
+
+    static std::string buildLeaseResponse(JobLease const& lease);
+
+public:
+    JobQueueService(HttpServer& server, JobManager& jobManager);
+
+};
@@ -5,6 +5,11 @@ import logging
 import json
 import concurrent.futures
 import uuid
+import hashlib
+import http.client
+import urllib.parse
+import urllib.request
+import urllib.error
 from threading import Lock, Thread, Event
 
 job_root_logger = logging.getLogger("job")
@@ -23,10 +28,10 @@ class SshJobSource:
         p = subprocess.run(["scp", "-qr", src, self.host + ":" + to])
         p.check_returncode()
 
-    def pull_job(self, tmp_root):
+    def pull_job(self, tmp_root, job_types):
         cmd = ["cd", self.remote_root]
         cmd = cmd + ["&&", ".", "venv/bin/activate"]
-        cmd = cmd + ["&&", "python3", "tool/pull_job.py"]
+        cmd = cmd + ["&&", "python3", "tool/pull_job.py"] + sorted(job_types)
         p = subprocess.run(self.base_cmd + cmd, capture_output=True, stdin=subprocess.DEVNULL)
         p.check_returncode()
         job = p.stdout.strip().decode('utf-8')
@@ -58,6 +63,10 @@ class SshJobSource:
         p = subprocess.run(self.base_cmd + cmd)
         p.check_returncode()
 
+    def fail_job(self, job_uuid):
+        # The job goes back to pending once its lease times out
+        pass
+
     def delete_job(self, job_uuid):
         cmd = ["cd", self.remote_root]
         cmd = cmd + ["&&", "rm", "priv/jobs/active/" + job_uuid]
@@ -84,6 +93,163 @@ class SshJobSource:
         p.check_returncode()
 
 
+class HttpJobSource(SshJobSource):
+    """Leases the jobs through the job queue API of the updateprocessor instead of polling for them over SSH. With a
+    files_url the job files are downloaded from its job file server, in parallel and resuming the partial downloads;
+    otherwise they are still transferred with scp."""
+
+    wait_time = 60
+    fetch_workers = 4
+    fetch_attempts = 5
+
+    def __init__(self, host, remote_root, api_url, token, files_url = None):
+        super().__init__(host, remote_root)
+        self.api_url = api_url.rstrip("/")
+        self.files_url = files_url.rstrip("/") if files_url else None
+        self.token = token
+        self.lease_tokens = {}
+        self.lock = Lock()
+
+    def _post(self, path, params):
+        url = self.api_url + path + "?" + urllib.parse.urlencode(params)
+        req = urllib.request.Request(url, method="POST", data=b"", headers={"Authorization": "Bearer " + self.token})
+        try:
+            with urllib.request.urlopen(req, timeout=self.wait_time + 30) as resp:
+                return resp.status, resp.read()
+        except urllib.error.HTTPError as e:
+            return e.code, e.read()
+
+    def _get_file(self, path, offset = 0):
+        headers = {"Authorization": "Bearer " + self.token}
+        if offset > 0:
+            headers["Range"] = "bytes=" + str(offset) + "-"
+        req = urllib.request.Request(self.files_url + path, headers=headers)
+        return urllib.request.urlopen(req, timeout=self.wait_time)
+
+    @staticmethod
+    def _hash_file(path):
+        h = hashlib.sha256()
+        with open(path, "rb") as f:
+            for chunk in iter(lambda: f.read(1024 * 1024), b""):
+                h.update(chunk)
+        return h.hexdigest()
+
+    def _fetch_file(self, job_uuid, entry, tmp_dir, job_logger):
+        path = os.path.join(tmp_dir, entry["name"])
+        if os.path.exists(path) and os.path.getsize(path) == entry["size"] and self._hash_file(path) == entry["sha256"]:
+            return
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        part_path = path + ".part"
+        url_path = "/jobs/" + job_uuid + "/files/" + urllib.parse.quote(entry["name"])
+        for attempt in range(self.fetch_attempts):
+            offset = os.path.getsize(part_path) if os.path.exists(part_path) else 0
+            if offset > entry["size"]:
+                os.remove(part_path)
+                offset = 0
+            try:
+                if offset < entry["size"] or not os.path.exists(part_path):
+                    with self._get_file(url_path, offset) as resp:
+                        # The server ignores the range and sends the whole file with a 200 if it can't serve it
+                        with open(part_path, "ab" if resp.status == 206 else "wb") as f:
+                            shutil.copyfileobj(resp, f, 1024 * 1024)
+            except (OSError, http.client.HTTPException):
+                job_logger.warning("Fetching " + entry["name"] + " was interrupted", exc_info=True)
+                continue
+            if self._hash_file(part_path) == entry["sha256"]:
+                os.replace(part_path, path)
+                return
+            job_logger.warning("Hash mismatch for " + entry["name"] + ", fetching it again")
+            os.remove(part_path)
+        raise Exception("Failed to fetch " + entry["name"])
+
+    def _fetch_files(self, job_uuid, tmp_dir, job_logger):
+        with self._get_file("/jobs/" + job_uuid + "/manifest") as resp:
+            files = json.loads(resp.read())["files"]
+        os.makedirs(tmp_dir, exist_ok=True)
+        # The largest first, so that they don't end up being the only ones left
+        files.sort(key=lambda f: f["size"], reverse=True)
+        with concurrent.futures.ThreadPoolExecutor(max_workers=self.fetch_workers) as executor:
+            futures = [executor.submit(self._fetch_file, job_uuid, f, tmp_dir, job_logger) for f in files]
+            for f in futures:
+                f.result()
+
+    def _lease_job(self, job_types):
+        while True:
+            status, body = self._post("/jobs/lease", {"wait": self.wait_time, "types": ",".join(sorted(job_types))})
+            if status == 200:
+                return json.loads(body)
+            if status != 204:
+                raise Exception("Failed to lease a job: status " + str(status))
+
+    def pull_job(self, tmp_root, job_types):
+        lease = self._lease_job(job_types)
+        job_uuid = lease["id"]
+        with self.lock:
+            self.lease_tokens[job_uuid] = lease["token"]
+        job_logger = logging.getLogger("job." + job_uuid)
+        job_logger.info("Leased job from remote: " + lease["dir"])
+        tmp_dir = os.path.join(tmp_root, job_uuid)
+        if not os.path.exists(tmp_root):
+            os.makedirs(tmp_root)
+        # Whatever is already there from an earlier attempt is kept if it matches the manifest
+        if os.path.exists(tmp_dir) and self.files_url is None:
+            job_logger.error("Job directory already exists; aborting")
+            self.fail_job(job_uuid)
+            return None
+
+        job_logger.info("Fetching job files to: " + tmp_dir)
+        try:
+            if self.files_url is not None:
+                self._fetch_files(job_uuid, tmp_dir, job_logger)
+            else:
+                self._scp_from_remote(lease["dir"], tmp_dir)
+        except Exception:
+            job_logger.exception("Failed to fetch job files")
+            self.fail_job(job_uuid)
+            return None
+        job_logger.info("Job pull finished")
+        return job_uuid, tmp_dir, job_logger
+
+    def _finish_lease(self, path, job_uuid, params = None):
+        with self.lock:
+            token = self.lease_tokens.get(job_uuid, "")
+        status, _ = self._post(path, dict({"id": job_uuid, "token": token}, **(params or {})))
+        if status == 409:
+            raise Exception("The lease of job " + job_uuid + " was lost")
+        if status != 204:
+            raise Exception("Job queue request " + path + " failed: status " + str(status))
+
+    def ping_job(self, job_uuid):
+        self._finish_lease("/jobs/renew", job_uuid)
+
+    def delete_job(self, job_uuid):
+        try:
+            self._finish_lease("/jobs/complete", job_uuid)
+        finally:
+            with self.lock:
+                self.lease_tokens.pop(job_uuid, None)
+
+    def fail_job(self, job_uuid):
+        try:
+            self._finish_lease("/jobs/fail", job_uuid, {"retry": 1})
+        finally:
+            with self.lock:
+                self.lease_tokens.pop(job_uuid, None)
+
+    def create_job(self, local_job_dir, logger = None):
+        logger = logger if logger is not None else job_root_logger
+
+        job_uuid = str(uuid.uuid4())
+        remote_dir = os.path.join(self.remote_root, "priv/jobs/data/" + job_uuid)
+        logger.info("Uploading job files to: " + remote_dir)
+        self._scp_to_remote(local_job_dir, remote_dir)
+
+        logger.info("Registering job")
+        status, _ = self._post("/jobs/add", {"id": job_uuid})
+        if status != 204:
+            raise Exception("Failed to register job: status " + str(status))
+
+
 class JobPingThread(Thread):
     def __init__(self, source):
         super().__init__()
@@ -111,7 +277,7 @@ class JobPingThread(Thread):
             for j in self.jobs:
                 try:
                     self.source.ping_job(j)
-                except subprocess.SubprocessError:
+                except Exception:
                     job_root_logger.error("Failed to ping job: " + j)
             self.lock.release()
             self.stop_event.wait(self.interval)
@@ -128,6 +294,9 @@ class JobExecutor:
     def register_job_handler(self, name, handler):
         self.job_handlers[name] = handler
 
+    def get_job_types(self):
+        return set(self.job_handlers.keys())
+
     def execute(self, job_source, job_uuid, job_dir, job_logger):
         job_logger.info("Execution is starting")
         self.ping_thread.add_job(job_uuid)
@@ -147,6 +316,10 @@ class JobExecutor:
                 job_logger.exception("Deleting remote job files failed")
         except:
             job_logger.exception("Job execution failed")
+            try:
+                job_source.fail_job(job_uuid)
+            except:
+                job_logger.exception("Reporting the job failure failed")
         finally:
             job_logger.info("Execution has finished")
 
@@ -174,7 +347,11 @@ class JobPoolExecutor:
                     concurrent.futures.wait(self.futures, return_when = concurrent.futures.FIRST_COMPLETED)
                     self.futures = [f for f in self.futures if f.running()]
                 job_root_logger.info("Waiting for a job...")
-                job_uuid, job_dir, job_logger = job_source.pull_job(tmp_root)
+                job = job_source.pull_job(tmp_root, self.job_executor.get_job_types())
+                if job is None:
+                    # Already logged, and failed back to the source if it was leased
+                    continue
+                job_uuid, job_dir, job_logger = job
                 self.futures.append(executor.submit(self.job_executor.execute, job_source, job_uuid, job_dir, job_logger))
         except KeyboardInterrupt:
             pass
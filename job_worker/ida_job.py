@@ -16,7 +16,9 @@ def create_ida_job(job_source, local_file, archive_path, archive_type, is_64_bit
         "archivePath": archive_path,
         "archiveType": archive_type,
         "is64bit": is_64_bit,
-        "compress": compress
+        "compress": compress,
+        # Another job archiving to the same path would do the same work
+        "dedupKey": "updateprocessor/idaJob:" + archive_path
     }
     with tempfile.TemporaryDirectory() as job_dir:
         with open(os.path.join(job_dir, "job.json"), "w") as f:
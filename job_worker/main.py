@@ -1,7 +1,7 @@
 import os
 import shutil
 import logging
-from framework import SshJobSource, JobPingThread, JobExecutor, JobPoolExecutor
+from framework import SshJobSource, HttpJobSource, JobPingThread, JobExecutor, JobPoolExecutor
 from config import config
 from apk_job import handle_add_apk_job
 from ida_job import handle_ida_job
@@ -24,12 +24,22 @@ tmp_root = config["tmp_dir"]
 if os.path.exists(tmp_root):
     shutil.rmtree(tmp_root)
 
-source = SshJobSource(config["remote"]["host"], config["remote"]["root"])
+if "api_url" in config["remote"]:
+    source = HttpJobSource(config["remote"]["host"], config["remote"]["root"], config["remote"]["api_url"],
+                           config["remote"]["api_token"], config["remote"].get("files_url"))
+else:
+    source = SshJobSource(config["remote"]["host"], config["remote"]["root"])
 ping_thread = JobPingThread(source)
 ping_thread.start()
 executor = JobExecutor(ping_thread)
-executor.register_job_handler("updateprocessor/addApkJob", handle_add_apk_job)
-executor.register_job_handler("updateprocessor/idaJob", handle_ida_job)
+# A worker only takes the jobs it has a handler for; "job_types" limits them, eg. to the machines with IDA
+job_handlers = {
+    "updateprocessor/addApkJob": handle_add_apk_job,
+    "updateprocessor/idaJob": handle_ida_job
+}
+for name, handler in job_handlers.items():
+    if "job_types" not in config or name in config["job_types"]:
+        executor.register_job_handler(name, handler)
 pool_executor = JobPoolExecutor(executor)
 pool_executor.run_main_loop(source, tmp_root)
 ping_thread.stop()
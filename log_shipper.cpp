@@ -0,0 +1,218 @@
+#include "log_shipper.h"
+
+#include <fstream>
+#include <cstdio>
+#include <sys/stat.h>
+#include <nlohmann/json.hpp>
+
+const size_t LogShipper::MAX_BUFFERED;
+const size_t LogShipper::BATCH_SIZE;
+const int LogShipper::FLUSH_INTERVAL;
+const int LogShipper::RECONNECT_DELAY;
+const long long LogShipper::MAX_SPILL_SIZE;
+
+// The shipper itself only logs through the logger library, anything going through AsyncLog would come back to it
+
+LogShipper::LogShipper(std::string uri, std::string logName, std::string spillPath) :
+        uri(std::move(uri)), logName(std::move(logName)), spillPath(std::move(spillPath)) {
+    hub.onConnection([this](uWS::WebSocket<uWS::CLIENT>* ws, uWS::HttpRequest req) {
+        Log::info("LogShipper", "Connected to the log viewer");
+        this->ws = ws;
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            if (!stopped)
+                return;
+        }
+        ws->close();
+    });
+    hub.onError([this](void*) {
+        Log::warn("LogShipper", "Failed to connect to the log viewer");
+        scheduleReconnect();
+    });
+    hub.onDisconnection([this](uWS::WebSocket<uWS::CLIENT>* ws, int code, char* message, size_t length) {
+        Log::warn("LogShipper", "Disconnected from the log viewer: %i %.*s", code, (int) length, message);
+        this->ws = nullptr;
+        scheduleReconnect();
+    });
+}
+
+LogShipper::~LogShipper() {
+    stop();
+}
+
+const char* LogShipper::getLevelName(LogLevel level) {
+    // The names the Python logging module uses, the viewer shows them as they are
+    switch (level) {
+        case LogLevel::LOG_TRACE: return "TRACE";
+        case LogLevel::LOG_DEBUG: return "DEBUG";
+        case LogLevel::LOG_INFO: return "INFO";
+        case LogLevel::LOG_WARN: return "WARNING";
+        case LogLevel::LOG_ERROR: return "ERROR";
+        default: return "UNKNOWN";
+    }
+}
+
+static std::string buildRecord(std::string const& log, const char* level, std::chrono::system_clock::time_point time,
+                               std::string const& message) {
+    nlohmann::json record;
+    record["log"] = log;
+    record["date"] = std::chrono::duration_cast<std::chrono::duration<double>>(time.time_since_epoch()).count();
+    record["level"] = level;
+    record["message"] = message;
+    return record.dump();
+}
+
+void LogShipper::start() {
+    flushTimer = new uS::Timer(hub.getLoop());
+    flushTimer->setData(this);
+    flushTimer->start([](uS::Timer* timer) {
+        ((LogShipper*) timer->getData())->flush();
+    }, FLUSH_INTERVAL, FLUSH_INTERVAL);
+    stopHandle = new uS::Async(hub.getLoop());
+    stopHandle->setData(this);
+    stopHandle->start([](uS::Async* handle) {
+        ((LogShipper*) handle->getData())->handleStop();
+    });
+    hub.connect(uri, nullptr);
+    thread = std::thread([this]() {
+        hub.run();
+    });
+}
+
+void LogShipper::stop() {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        if (stopped)
+            return;
+        stopped = true;
+    }
+    if (!thread.joinable())
+        return;
+    stopHandle->send();
+    thread.join();
+}
+
+void LogShipper::post(LogLevel level, std::chrono::system_clock::time_point time, const char* tag,
+                      const char* text) {
+    std::string record = buildRecord(logName, getLevelName(level), time, std::string("[") + tag + "] " + text);
+    std::lock_guard<std::mutex> lk(mutex);
+    pending.push_back(std::move(record));
+    if (pending.size() > MAX_BUFFERED)
+        spillOverflow(MAX_BUFFERED / 2); // spill in chunks rather than reopening the file for every record
+}
+
+void LogShipper::spillOverflow(size_t keep) {
+    if (pending.size() <= keep)
+        return;
+    size_t count = pending.size() - keep;
+    if (spillPath.empty()) {
+        pending.erase(pending.begin(), pending.begin() + count);
+        droppedCount += count;
+        return;
+    }
+    struct stat st;
+    long long size = (stat(spillPath.c_str(), &st) == 0) ? (long long) st.st_size : 0;
+    std::ofstream out(spillPath, std::ios_base::app);
+    for (size_t i = 0; i < count; i++) {
+        std::string const& record = pending[i];
+        if (!out || size + (long long) record.size() + 1 > MAX_SPILL_SIZE) {
+            droppedCount += count - i;
+            break;
+        }
+        out << record << '\n';
+        size += record.size() + 1;
+    }
+    pending.erase(pending.begin(), pending.begin() + count);
+}
+
+void LogShipper::sendBatches(std::deque<std::string>& records) {
+    while (!records.empty()) {
+        std::string batch = "{\"type\":\"log_batch\",\"records\":[";
+        for (size_t i = 0; i < BATCH_SIZE && !records.empty(); i++) {
+            if (i > 0)
+                batch += ',';
+            batch += records.front();
+            records.pop_front();
+        }
+        batch += "]}";
+        ws->send(batch.data(), batch.length(), uWS::OpCode::TEXT);
+    }
+}
+
+void LogShipper::replaySpillFile() {
+    std::deque<std::string> records;
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        if (spillPath.empty())
+            return;
+        std::ifstream in(spillPath);
+        if (!in)
+            return;
+        std::string line;
+        while (std::getline(in, line)) {
+            if (!line.empty())
+                records.push_back(std::move(line));
+        }
+        in.close();
+        remove(spillPath.c_str());
+    }
+    Log::info("LogShipper", "Replaying %zu spilled log records", records.size());
+    sendBatches(records);
+}
+
+void LogShipper::flush() {
+    if (ws == nullptr)
+        return;
+    replaySpillFile();
+    std::deque<std::string> records;
+    size_t dropped;
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        records.swap(pending);
+        dropped = droppedCount;
+        droppedCount = 0;
+    }
+    if (dropped > 0)
+        records.push_back(buildRecord(logName, getLevelName(LogLevel::LOG_WARN), std::chrono::system_clock::now(),
+                "[LogShipper] Dropped " + std::to_string(dropped) + " log records while the viewer was unavailable"));
+    sendBatches(records);
+}
+
+void LogShipper::scheduleReconnect() {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        if (stopped)
+            return;
+    }
+    if (reconnectTimer == nullptr) {
+        reconnectTimer = new uS::Timer(hub.getLoop());
+        reconnectTimer->setData(this);
+    } else {
+        reconnectTimer->stop();
+    }
+    reconnectTimer->start([](uS::Timer* timer) {
+        LogShipper* shipper = (LogShipper*) timer->getData();
+        shipper->hub.connect(shipper->uri, nullptr);
+    }, RECONNECT_DELAY, 0);
+}
+
+void LogShipper::handleStop() {
+    flush();
+    {
+        // Whatever couldn't be sent is kept for the next run
+        std::lock_guard<std::mutex> lk(mutex);
+        spillOverflow(0);
+    }
+    flushTimer->stop();
+    flushTimer->close();
+    flushTimer = nullptr;
+    if (reconnectTimer != nullptr) {
+        reconnectTimer->stop();
+        reconnectTimer->close();
+        reconnectTimer = nullptr;
+    }
+    stopHandle->close();
+    stopHandle = nullptr;
+    if (ws != nullptr)
+        ws->close();
+}
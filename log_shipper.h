@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <uWS.h>
+#include <log.h>
+
+/**
+ * Ships the log records of the daemon to the log_viewer service over a single persistent websocket. Records are
+ * collected in memory and sent as log_batch messages on a timer. While the viewer can't be reached at most
+ * MAX_BUFFERED records are kept in memory; older ones are appended to the spill file (if one is configured, and up to
+ * MAX_SPILL_SIZE) or dropped otherwise. The spill file is replayed before anything else once the viewer is back.
+ */
+class LogShipper {
+
+private:
+    static const size_t MAX_BUFFERED = 10000;
+    static const size_t BATCH_SIZE = 200;
+    static const int FLUSH_INTERVAL = 500;
+    static const int RECONNECT_DELAY = 5000;
+    static const long long MAX_SPILL_SIZE = 16 * 1024 * 1024;
+
+    const std::string uri;
+    const std::string logName;
+    const std::string spillPath;
+
+    uWS::Hub hub;
+    uWS::WebSocket<uWS::CLIENT>* ws = nullptr;
+    uS::Timer* flushTimer = nullptr;
+    uS::Timer* reconnectTimer = nullptr;
+    uS::Async* stopHandle = nullptr;
+    std::thread thread;
+
+    std::mutex mutex;
+    std::deque<std::string> pending; // serialized records
+    size_t droppedCount = 0;
+    bool stopped = false;
+
+    static const char* getLevelName(LogLevel level);
+
+    // Moves the records that don't fit in memory to the spill file; called with the mutex held
+    void spillOverflow(size_t keep);
+
+    void sendBatches(std::deque<std::string>& records);
+
+    void replaySpillFile();
+
+    void flush();
+
+    void scheduleReconnect();
+
+    void handleStop();
+
+public:
+    // spillPath may be empty, in which case the overflowing records are dropped
+    LogShipper(std::string uri, std::string logName, std::string spillPath);
+
+    ~LogShipper();
+
+    void start();
+
+    // Sends what can still be sent, spills the rest and stops the thread
+    void stop();
+
+    // Thread-safe, meant to be used as the AsyncLog sink
+    void post(LogLevel level, std::chrono::system_clock::time_point time, const char* tag, const char* text);
+
+};
@@ -91,6 +91,9 @@ async def log_client(websocket, path):
                 forwarder.cancel()
             if msg["type"] == "log":
                 log_print(msg["log"], msg["date"], msg["level"], msg["message"])
+            if msg["type"] == "log_batch":
+                for r in msg["records"]:
+                    log_print(r["log"], r["date"], r["level"], r["message"])
             if msg["type"] == "get_log":
                 entries = None
                 if msg["log"] in logs:
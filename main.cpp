@@ -1,5 +1,7 @@
-#include <iostream>
 #include <fstream>
+#include <thread>
+#include <csignal>
+#include <unistd.h>
 #include <git2.h>
 
 #include "play_manager.h"
@@ -9,37 +11,94 @@
 #include "win10_versiondb_manager.h"
 
 #include "job_manager.h"
+#include "notification_outbox.h"
+#include "http_server.h"
+#include "version_query_service.h"
+#include "job_queue_service.h"
+#include "job_file_server.h"
+#include "async_log.h"
+#include "log_shipper.h"
+
+static LogShipper* logShipper = nullptr;
+
+static void stopLogging() {
+    // Drain the async log first so that everything reaches the shipper
+    AsyncLog::stop();
+    if (logShipper != nullptr)
+        logShipper->stop();
+}
 
 int main() {
+    // Blocked before any thread starts so that they all inherit it; the main thread waits for them with sigwait() and
+    // does the shutdown outside of a signal handler
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
+
+    {
+        playapi::config logConf;
+        std::ifstream ifs("priv/log.conf");
+        logConf.load(ifs);
+        std::string shipUri = logConf.get("ship.uri", "");
+        if (!shipUri.empty()) {
+            logShipper = new LogShipper(shipUri, logConf.get("ship.log", "updateprocessor"),
+                                        logConf.get("ship.spill_path", "priv/log_spill.jsonl"));
+            logShipper->start();
+            AsyncLog::setSink(std::bind(&LogShipper::post, logShipper, std::placeholders::_1, std::placeholders::_2,
+                                        std::placeholders::_3, std::placeholders::_4));
+        }
+        AsyncLog::start(AsyncLog::parseLevel(logConf.get("level", "info"), LogLevel::LOG_INFO));
+    }
 
-    std::cout << "Starting up!" << std::endl;
+    AsyncLog::info("Main", "Starting up!");
     git_libgit2_init();
 
 
     JobManager jobManager;
     jobManager.startTimeOutThread();
 
+    NotificationOutbox notifications ("priv/notifications.journal", "priv/notification_cursors.json",
+                                      "priv/notifications.dead.jsonl");
+
     PlayManager playManager;
-    ApkManager apkManager (playManager, jobManager);
+    ApkManager apkManager (playManager, jobManager, notifications);
 
 //    apkManager.downloadAndProcessApk(playManager.getBetaDeviceARM(), 943160055, false);
 
-    Win10StoreManager win10Manager;
+    Win10StoreManager win10Manager (notifications);
     win10Manager.init();
     Win10VersionDBManager win10VdbManager;
     win10VdbManager.addWin10StoreMgr(win10Manager);
+    win10VdbManager.startPublishing();
+
+    HttpServer httpServer;
+    VersionQueryService versionQueryService (httpServer, apkManager, win10VdbManager);
+    JobQueueService jobQueueService (httpServer, jobManager);
+    httpServer.start();
+    JobFileServer jobFileServer (jobManager);
+    jobFileServer.start();
 
     static DiscordState* discordState = new DiscordState(playManager, apkManager);
     discordState->addWin10StoreMgr(win10Manager);
     TelegramState telegramState(apkManager);
+    // Everyone has subscribed by now
+    notifications.start();
 
     apkManager.startChecking();
     win10Manager.startChecking();
 
-    signal(SIGINT, [](int signo) { discordState->storeSessionInfo(); exit(0); });
-    signal(SIGTERM, [](int signo) { discordState->storeSessionInfo(); exit(0); });
-    discordState->loop();
+    // The gateway loops only exit for good on a fatal error, which shuts everything down like a signal would
+    std::thread([]() {
+        discordState->loop();
+        kill(getpid(), SIGTERM);
+    }).detach();
 
-    delete discordState;
-    return 0;
+    int signo;
+    sigwait(&stopSignals, &signo);
+    AsyncLog::info("Main", "Got signal %i, shutting down", signo);
+    discordState->storeSessionInfo();
+    stopLogging();
+    exit(0);
 }
\ No newline at end of file
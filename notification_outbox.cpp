@@ -0,0 +1,249 @@
+#include "notification_outbox.h"
+#include "async_log.h"
+#include "file_utils.h"
+
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+
+const int NotificationOutbox::INITIAL_RETRY_DELAY;
+const int NotificationOutbox::MAX_RETRY_DELAY;
+const int NotificationOutbox::MAX_ATTEMPTS;
+const off_t NotificationOutbox::COMPACT_THRESHOLD;
+
+NotificationOutbox::NotificationOutbox(std::string journalPath, std::string cursorPath, std::string deadLetterPath) :
+        journalPath(std::move(journalPath)), cursorPath(std::move(cursorPath)),
+        deadLetterPath(std::move(deadLetterPath)) {
+    load();
+    openJournal();
+}
+
+NotificationOutbox::~NotificationOutbox() {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        stopped = true;
+    }
+    cv.notify_all();
+    for (auto& s : subscribers) {
+        if (s->thread.joinable())
+            s->thread.join();
+    }
+    if (journalFd != -1)
+        close(journalFd);
+}
+
+void NotificationOutbox::load() {
+    savedCursors = nlohmann::json::object();
+    std::ifstream cursorIfs(cursorPath);
+    if (cursorIfs) {
+        try {
+            savedCursors = nlohmann::json::parse(cursorIfs);
+            lastId = savedCursors.value("last_id", 0LL);
+        } catch (std::exception& e) {
+            AsyncLog::error("Notifications", "Failed to load the cursors: %s", e.what());
+        }
+    }
+
+    std::ifstream ifs(journalPath);
+    std::string line;
+    off_t offset = 0;
+    while (std::getline(ifs, line)) {
+        bool complete = !ifs.eof();
+        offset += line.size() + (complete ? 1 : 0);
+        if (!complete) {
+            // Cut short by a crash while appending, so it was never acknowledged
+            AsyncLog::warn("Notifications", "Dropping an incomplete journal line");
+            break;
+        }
+        journalSize = offset;
+        if (line.empty())
+            continue;
+        try {
+            nlohmann::json j = nlohmann::json::parse(line);
+            Notification n;
+            n.id = j["id"].get<long long>();
+            n.type = j["type"].get<std::string>();
+            n.data = j["data"];
+            lastId = std::max(lastId, n.id);
+            entries.push_back({std::move(n), line.size() + 1});
+        } catch (std::exception& e) {
+            AsyncLog::warn("Notifications", "Skipping a broken journal line: %s", e.what());
+            compactableSize += line.size() + 1;
+        }
+    }
+    if (!entries.empty())
+        AsyncLog::info("Notifications", "Loaded %zu pending notifications", entries.size());
+}
+
+void NotificationOutbox::openJournal() {
+    journalFd = open(journalPath.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (journalFd == -1)
+        throw std::runtime_error("Failed to open the notification journal: " + journalPath);
+    if (ftruncate(journalFd, journalSize) != 0)
+        throw std::runtime_error("Failed to truncate the notification journal: " + std::string(strerror(errno)));
+}
+
+std::string NotificationOutbox::formatLine(Notification const& n) {
+    return nlohmann::json({{"id", n.id}, {"type", n.type}, {"data", n.data}}).dump() + "\n";
+}
+
+bool NotificationOutbox::writeDeadLetter(Subscriber const& subscriber, Notification const& n,
+                                         std::string const& error) {
+    std::string line = nlohmann::json({{"subscriber", subscriber.name}, {"id", n.id}, {"type", n.type},
+                                       {"data", n.data}, {"error", error}}).dump() + "\n";
+    int fd = open(deadLetterPath.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return false;
+    bool ok = write(fd, line.data(), line.size()) == (ssize_t) line.size() && fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+bool NotificationOutbox::saveCursors() {
+    nlohmann::json cursors = savedCursors.value("cursors", nlohmann::json::object());
+    for (auto const& s : subscribers)
+        cursors[s->name] = s->cursor;
+    savedCursors["cursors"] = cursors;
+    savedCursors["last_id"] = lastId;
+    if (!FileUtils::writeFileDurably(cursorPath, savedCursors.dump())) {
+        // The notifications just get handled again after a restart
+        AsyncLog::error("Notifications", "Failed to save the cursors: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void NotificationOutbox::compact() {
+    if (subscribers.empty())
+        return;
+    long long minCursor = subscribers[0]->cursor;
+    for (auto const& s : subscribers)
+        minCursor = std::min(minCursor, s->cursor);
+    while (!entries.empty() && entries.front().notification.id <= minCursor) {
+        compactableSize += entries.front().size;
+        entries.pop_front();
+    }
+    if (compactableSize < COMPACT_THRESHOLD)
+        return;
+    // The last id has to be in the cursor file first, as the journal may end up empty
+    if (!saveCursors())
+        return;
+    std::string data;
+    for (auto const& e : entries)
+        data += formatLine(e.notification);
+    if (!FileUtils::writeFileDurably(journalPath, data)) {
+        AsyncLog::error("Notifications", "Failed to compact the journal: %s", strerror(errno));
+        return;
+    }
+    close(journalFd);
+    journalFd = -1;
+    journalSize = (off_t) data.size();
+    compactableSize = 0;
+    openJournal();
+}
+
+void NotificationOutbox::subscribe(std::string const& name, std::string const& type, Handler handler) {
+    std::lock_guard<std::mutex> lk(mutex);
+    if (started)
+        throw std::logic_error("Subscribers have to be added before start()");
+    std::unique_ptr<Subscriber> s (new Subscriber());
+    s->name = name;
+    s->type = type;
+    s->handler = std::move(handler);
+    s->cursor = lastId;
+    if (savedCursors.count("cursors") > 0 && savedCursors["cursors"].count(name) > 0)
+        s->cursor = savedCursors["cursors"][name].get<long long>();
+    subscribers.push_back(std::move(s));
+}
+
+void NotificationOutbox::start() {
+    std::lock_guard<std::mutex> lk(mutex);
+    started = true;
+    saveCursors();
+    compact();
+    for (auto& s : subscribers) {
+        Subscriber* sp = s.get();
+        s->thread = std::thread([this, sp]() { runSubscriber(*sp); });
+    }
+}
+
+long long NotificationOutbox::append(std::string const& type, nlohmann::json data) {
+    std::lock_guard<std::mutex> lk(mutex);
+    Notification n;
+    n.id = lastId + 1;
+    n.type = type;
+    n.data = std::move(data);
+    std::string line = formatLine(n);
+    for (size_t off = 0; off < line.size(); ) {
+        ssize_t r = write(journalFd, line.data() + off, line.size() - off);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            int err = errno;
+            // Don't leave a partial line for the next append to be glued to
+            if (ftruncate(journalFd, journalSize) != 0)
+                AsyncLog::error("Notifications", "Failed to truncate the journal: %s", strerror(errno));
+            throw std::runtime_error("Failed to write to the notification journal: " + std::string(strerror(err)));
+        }
+        off += r;
+    }
+    if (fsync(journalFd) != 0) {
+        int err = errno;
+        if (ftruncate(journalFd, journalSize) != 0)
+            AsyncLog::error("Notifications", "Failed to truncate the journal: %s", strerror(errno));
+        throw std::runtime_error("Failed to sync the notification journal: " + std::string(strerror(err)));
+    }
+    journalSize += line.size();
+    lastId = n.id;
+    entries.push_back({std::move(n), line.size()});
+    cv.notify_all();
+    return lastId;
+}
+
+void NotificationOutbox::runSubscriber(Subscriber& s) {
+    std::unique_lock<std::mutex> lk(mutex);
+    int retryDelay = INITIAL_RETRY_DELAY;
+    int attempts = 0;
+    while (!stopped) {
+        auto it = std::find_if(entries.begin(), entries.end(), [&s](Entry const& e) {
+            return e.notification.id > s.cursor;
+        });
+        if (it == entries.end()) {
+            cv.wait(lk);
+            continue;
+        }
+        long long id = it->notification.id;
+        if (it->notification.type == s.type) {
+            Notification n = it->notification;
+            lk.unlock();
+            std::string error;
+            try {
+                s.handler(n);
+            } catch (std::exception& e) {
+                error = e.what();
+                if (error.empty())
+                    error = "unknown error";
+            }
+            lk.lock();
+            if (!error.empty() && ++attempts >= MAX_ATTEMPTS && writeDeadLetter(s, n, error)) {
+                AsyncLog::error("Notifications", "%s failed to handle notification %lli %i times, giving up on it "
+                                "(stored in %s): %s", s.name.c_str(), n.id, attempts, deadLetterPath.c_str(),
+                                error.c_str());
+            } else if (!error.empty()) {
+                AsyncLog::error("Notifications", "%s failed to handle notification %lli, retrying in %ims: %s",
+                                s.name.c_str(), n.id, retryDelay, error.c_str());
+                cv.wait_for(lk, std::chrono::milliseconds(retryDelay), [this]() { return stopped; });
+                retryDelay = std::min(retryDelay * 2, MAX_RETRY_DELAY);
+                continue;
+            }
+            retryDelay = INITIAL_RETRY_DELAY;
+            attempts = 0;
+        }
+        s.cursor = id;
+        saveCursors();
+        compact();
+    }
+}
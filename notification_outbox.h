@@ -0,0 +1,104 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <sys/types.h>
+#include <nlohmann/json.hpp>
+
+struct Notification {
+    long long id;
+    std::string type;
+    nlohmann::json data;
+};
+
+/**
+ * A durable queue of the detection events (new versions) between the checkers and the notifiers. The checkers append
+ * a notification before advancing their own saved state; once append() returns the notification is on disk.
+ *
+ * Every subscriber has a persisted cursor (the id of the last notification it handled) and its own delivery thread.
+ * A handler that throws gets the same notification again after a backoff, so delivery is at least once: a
+ * notification may be redelivered after a failure or a restart, and handlers use the id to avoid duplicates. After
+ * MAX_ATTEMPTS failures in a row the notification is written to the dead letter file for that subscriber and skipped,
+ * so that it can't hold up the ones after it forever.
+ * Notifications every subscriber is past are compacted out of the journal once they add up to COMPACT_THRESHOLD
+ * bytes.
+ */
+class NotificationOutbox {
+
+public:
+    // Throws to have the notification redelivered later
+    using Handler = std::function<void (Notification const& notification)>;
+
+private:
+    static const int INITIAL_RETRY_DELAY = 1000;
+    static const int MAX_RETRY_DELAY = 10 * 60 * 1000;
+    static const int MAX_ATTEMPTS = 12; // about half an hour with the backoff
+    static const off_t COMPACT_THRESHOLD = 1024 * 1024;
+
+    struct Entry {
+        Notification notification;
+        size_t size; // of its journal line
+    };
+
+    struct Subscriber {
+        std::string name;
+        std::string type;
+        Handler handler;
+        long long cursor = 0;
+        std::thread thread;
+    };
+
+    const std::string journalPath;
+    const std::string cursorPath;
+    const std::string deadLetterPath;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool started = false;
+    bool stopped = false;
+    int journalFd = -1;
+    off_t journalSize = 0; // up to the end of the last complete line
+    off_t compactableSize = 0; // of the lines every subscriber is past
+    std::deque<Entry> entries;
+    long long lastId = 0;
+    nlohmann::json savedCursors;
+    std::vector<std::unique_ptr<Subscriber>> subscribers;
+
+    void load();
+
+    // Cuts off a line left incomplete by a crash, so that the next one doesn't get appended to it
+    void openJournal();
+
+    static std::string formatLine(Notification const& n);
+
+    // Returns false if it couldn't be stored, in which case the notification is retried instead
+    bool writeDeadLetter(Subscriber const& subscriber, Notification const& n, std::string const& error);
+
+    // The following are called with the mutex held
+    bool saveCursors();
+
+    // Drops the notifications all the subscribers have handled, and rewrites the journal once enough of it is unneeded
+    void compact();
+
+    void runSubscriber(Subscriber& subscriber);
+
+public:
+    NotificationOutbox(std::string journalPath, std::string cursorPath, std::string deadLetterPath);
+
+    ~NotificationOutbox();
+
+    // Must be called before start(). A subscriber that has never been seen before only gets the notifications
+    // appended from now on.
+    void subscribe(std::string const& name, std::string const& type, Handler handler);
+
+    void start();
+
+    // Returns once the notification is durably stored; throws on I/O errors
+    long long append(std::string const& type, nlohmann::json data);
+
+};
@@ -1,7 +1,7 @@
 #include "play_device.h"
+#include "async_log.h"
 
 #include <fstream>
-#include <iostream>
 #include <zlib.h>
 
 playapi::device_info PlayDevice::loadDeviceInfo(std::string const& devicePath) {
@@ -116,7 +116,7 @@ void PlayDevice::downloadApk(DownloadLink const &link, std::string const &downlo
     bool downloadUrlGzipped = !link.gzippedUrl.empty();
     std::string downloadUrl = downloadUrlGzipped ? link.gzippedUrl : link.url;
 
-    printf("downloading (gzipped: %i): %s\n", downloadUrlGzipped, downloadUrl.c_str());
+    AsyncLog::info("PlayDevice", "Downloading (gzipped: %i): %s", downloadUrlGzipped, downloadUrl.c_str());
 
     playapi::http_request req(downloadUrl);
     if (downloadUrlGzipped)
@@ -148,14 +148,18 @@ void PlayDevice::downloadApk(DownloadLink const &link, std::string const &downlo
         });
     }
 
-    req.set_progress_callback([&req](curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
-        if (dltotal > 0) {
-            printf("\rDownloaded %i%% [%li/%li MiB]", (int) (dlnow * 100 / dltotal), dlnow / 1024 / 1024,
-                   dltotal / 1024 / 1024);
-            std::cout.flush();
-        }
+    int lastReportedPercent = -1;
+    req.set_progress_callback([&lastReportedPercent](curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal,
+                                                     curl_off_t ulnow) {
+        if (dltotal <= 0)
+            return;
+        int percent = (int) (dlnow * 100 / dltotal);
+        if (percent / 10 == lastReportedPercent / 10)
+            return;
+        lastReportedPercent = percent;
+        AsyncLog::debug("PlayDevice", "Downloaded %i%% [%li/%li MiB]", percent, (long) (dlnow / 1024 / 1024),
+                        (long) (dltotal / 1024 / 1024));
     });
-    std::cout << std::endl << "Starting download...";
     req.perform();
 
     do_zlib_inflate(zs, file, Z_NULL, 0, Z_FINISH);
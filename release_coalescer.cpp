@@ -0,0 +1,227 @@
+#include "release_coalescer.h"
+#include "async_log.h"
+#include "file_utils.h"
+
+#include <fstream>
+#include <cstring>
+#include <cerrno>
+
+const int ReleaseCoalescer::TICK_INTERVAL;
+const int ReleaseCoalescer::MAX_ATTEMPTS;
+const int ReleaseCoalescer::INITIAL_RETRY_DELAY;
+const int ReleaseCoalescer::MAX_RETRY_DELAY;
+const int ReleaseCoalescer::RETENTION_HOURS;
+
+ReleaseCoalescer::ReleaseCoalescer(std::string name, std::string path, std::chrono::seconds window,
+                                   TargetsFunction targetsFunction, SendFunction sendFunction,
+                                   EditFunction editFunction) :
+        name(std::move(name)), path(std::move(path)), window(window), targetsFunction(std::move(targetsFunction)),
+        sendFunction(std::move(sendFunction)), editFunction(std::move(editFunction)) {
+    load();
+}
+
+ReleaseCoalescer::~ReleaseCoalescer() {
+    stop();
+}
+
+void ReleaseCoalescer::stop() {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        stopped = true;
+    }
+    cv.notify_all();
+    if (thread.joinable())
+        thread.join();
+}
+
+void ReleaseCoalescer::start() {
+    thread = std::thread(std::bind(&ReleaseCoalescer::run, this));
+}
+
+void ReleaseCoalescer::add(ApkNewVersionEvent const& event) {
+    bool isBeta = event.variant.compare(0, 5, "beta/") == 0;
+    std::string key = (isBeta ? "beta " : "release ") + event.versionString;
+    std::lock_guard<std::mutex> lk(mutex);
+    auto it = groups.find(key);
+    bool isNewGroup = (it == groups.end());
+    if (isNewGroup) {
+        Group group;
+        group.release.versionString = event.versionString;
+        group.release.isBeta = isBeta;
+        group.release.changelog = event.changelog;
+        group.release.firstSeen = std::chrono::system_clock::now();
+        it = groups.insert(std::make_pair(key, std::move(group))).first;
+    }
+    ReleaseGroup& release = it->second.release;
+    auto vit = release.variants.find(event.variant);
+    if (vit != release.variants.end() && vit->second == event.versionCode)
+        return;
+    std::map<std::string, int> previousVariants = release.variants;
+    release.variants[event.variant] = event.versionCode;
+    release.revision++;
+    if (!save()) {
+        // Undone so that the redelivered notification adds it again
+        if (isNewGroup) {
+            groups.erase(it);
+        } else {
+            release.variants = std::move(previousVariants);
+            release.revision--;
+        }
+        throw std::runtime_error("Failed to save the coalescer state");
+    }
+    AsyncLog::info(name.c_str(), "Added %s to %s (revision %i)", event.variant.c_str(), key.c_str(),
+                   release.revision);
+    cv.notify_all();
+}
+
+void ReleaseCoalescer::run() {
+    struct Action {
+        std::string groupKey;
+        std::string target;
+        std::string messageId;
+        ReleaseGroup release;
+    };
+
+    std::unique_lock<std::mutex> lk(mutex);
+    while (!stopped) {
+        auto now = std::chrono::steady_clock::now();
+        auto sysNow = std::chrono::system_clock::now();
+        auto nextWake = now + std::chrono::milliseconds(TICK_INTERVAL);
+        std::vector<Action> actions;
+        for (auto it = groups.begin(); it != groups.end(); ) {
+            Group& group = it->second;
+            auto sendAt = group.release.firstSeen + window;
+            if (sendAt > sysNow) {
+                nextWake = std::min(nextWake, now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                        sendAt - sysNow));
+                ++it;
+                continue;
+            }
+            bool anyInFlight = false;
+            for (auto const& t : group.targets)
+                anyInFlight = anyInFlight || t.second.inFlight;
+            for (std::string const& target : targetsFunction(group.release)) {
+                TargetState& ts = group.targets[target];
+                if (ts.abandoned || ts.inFlight || ts.nextAttempt > now || ts.sentRevision >= group.release.revision)
+                    continue;
+                // Sent, but we don't know which message to edit
+                if (ts.sentRevision >= 0 && ts.messageId.empty())
+                    continue;
+                ts.inFlight = true;
+                anyInFlight = true;
+                actions.push_back({it->first, target, ts.messageId, group.release});
+            }
+            if (!anyInFlight && sysNow - group.release.firstSeen > std::chrono::hours(RETENTION_HOURS)) {
+                it = groups.erase(it);
+                save();
+                continue;
+            }
+            ++it;
+        }
+
+        lk.unlock();
+        for (Action& a : actions) {
+            std::string groupKey = a.groupKey, target = a.target;
+            int revision = a.release.revision;
+            DoneCallback done = [this, groupKey, target, revision](bool success, std::string const& messageId) {
+                onDone(groupKey, target, revision, success, messageId);
+            };
+            if (a.messageId.empty())
+                sendFunction(a.target, a.release, done);
+            else
+                editFunction(a.target, a.messageId, a.release, done);
+        }
+        lk.lock();
+        if (!stopped)
+            cv.wait_until(lk, nextWake);
+    }
+}
+
+void ReleaseCoalescer::onDone(std::string const& groupKey, std::string const& target, int revision, bool success,
+                              std::string const& messageId) {
+    std::lock_guard<std::mutex> lk(mutex);
+    auto it = groups.find(groupKey);
+    if (it == groups.end())
+        return;
+    TargetState& ts = it->second.targets[target];
+    ts.inFlight = false;
+    if (!success) {
+        if (++ts.failures >= MAX_ATTEMPTS) {
+            AsyncLog::error(name.c_str(), "Giving up on notifying %s about %s", target.c_str(), groupKey.c_str());
+            ts.abandoned = true;
+            save();
+            return;
+        }
+        int delay = std::min(INITIAL_RETRY_DELAY << (ts.failures - 1), MAX_RETRY_DELAY);
+        AsyncLog::warn(name.c_str(), "Notifying %s about %s failed, retrying in %is", target.c_str(),
+                       groupKey.c_str(), delay);
+        ts.nextAttempt = std::chrono::steady_clock::now() + std::chrono::seconds(delay);
+        cv.notify_all();
+        return;
+    }
+    ts.messageId = messageId;
+    ts.sentRevision = std::max(ts.sentRevision, revision);
+    ts.failures = 0;
+    save();
+    // A variant might have been added in the meantime
+    cv.notify_all();
+}
+
+void ReleaseCoalescer::load() {
+    std::ifstream ifs(path);
+    if (!ifs)
+        return;
+    try {
+        nlohmann::json data = nlohmann::json::parse(ifs);
+        for (auto const& g : data["groups"]) {
+            Group group;
+            group.release.versionString = g["version_string"].get<std::string>();
+            group.release.isBeta = g["beta"].get<bool>();
+            group.release.changelog = g["changelog"].get<std::string>();
+            group.release.variants = g["variants"].get<std::map<std::string, int>>();
+            group.release.revision = g["revision"].get<int>();
+            group.release.firstSeen = std::chrono::system_clock::time_point(
+                    std::chrono::milliseconds(g["first_seen"].get<long long>()));
+            for (auto t = g["targets"].begin(); t != g["targets"].end(); ++t) {
+                TargetState& ts = group.targets[t.key()];
+                ts.messageId = t.value()["message_id"].get<std::string>();
+                ts.sentRevision = t.value()["sent_revision"].get<int>();
+                ts.abandoned = t.value().value("abandoned", false);
+            }
+            groups[g["key"].get<std::string>()] = std::move(group);
+        }
+    } catch (std::exception& e) {
+        AsyncLog::error(name.c_str(), "Failed to load the coalescer state: %s", e.what());
+    }
+}
+
+bool ReleaseCoalescer::save() {
+    nlohmann::json data;
+    data["groups"] = nlohmann::json::array();
+    for (auto const& p : groups) {
+        Group const& group = p.second;
+        nlohmann::json g;
+        g["key"] = p.first;
+        g["version_string"] = group.release.versionString;
+        g["beta"] = group.release.isBeta;
+        g["changelog"] = group.release.changelog;
+        g["variants"] = group.release.variants;
+        g["revision"] = group.release.revision;
+        g["first_seen"] = std::chrono::duration_cast<std::chrono::milliseconds>(
+                group.release.firstSeen.time_since_epoch()).count();
+        g["targets"] = nlohmann::json::object();
+        for (auto const& t : group.targets) {
+            // Targets that haven't got anything yet are simply resent after a restart
+            if (t.second.sentRevision < 0 && !t.second.abandoned)
+                continue;
+            g["targets"][t.first] = {{"message_id", t.second.messageId}, {"sent_revision", t.second.sentRevision},
+                                     {"abandoned", t.second.abandoned}};
+        }
+        data["groups"].push_back(std::move(g));
+    }
+    if (!FileUtils::writeFileDurably(path, data.dump())) {
+        AsyncLog::error(name.c_str(), "Failed to save the coalescer state: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
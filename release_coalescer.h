@@ -0,0 +1,113 @@
+#pragma once
+
+#include "apk_manager.h"
+#include "subscription_registry.h"
+
+#include <string>
+#include <map>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+
+/**
+ * All the variants of one Play release, merged into a single notification.
+ */
+struct ReleaseGroup {
+    std::string versionString;
+    bool isBeta = false;
+    std::string changelog;
+    std::map<std::string, int> variants; // variant -> version code
+    int revision = 0; // bumped whenever a variant is added
+    std::chrono::system_clock::time_point firstSeen;
+
+    // One topic per variant, eg. {"android", "beta", "arm64"} for beta/arm64
+    std::vector<SubscriptionTopic> getTopics() const {
+        std::vector<SubscriptionTopic> ret;
+        for (auto const& v : variants)
+            ret.push_back({"android", isBeta ? "beta" : "release", v.first.substr(v.first.find('/') + 1)});
+        return ret;
+    }
+};
+
+/**
+ * Holds the new version events of a release for a window and then sends one combined message to every target.
+ * Variants showing up after that edit the already sent messages instead of sending new ones.
+ *
+ * The sending is done by the send and edit functions, which may complete asynchronously; they must call the done
+ * callback exactly once, with whether the message went out and its id. A failure gets retried with a backoff; a
+ * success without an id (eg. a response we couldn't parse) isn't resent, but later variants can't edit it. The state is persisted, so a restart neither loses a release nor forgets which messages to edit.
+ */
+class ReleaseCoalescer {
+
+public:
+    using DoneCallback = std::function<void (bool success, std::string const& messageId)>;
+    using SendFunction = std::function<void (std::string const& target, ReleaseGroup const& group, DoneCallback done)>;
+    using EditFunction = std::function<void (std::string const& target, std::string const& messageId,
+                                             ReleaseGroup const& group, DoneCallback done)>;
+    // Returns the targets interested in the group; a target that becomes interested once more variants are added gets
+    // its own message then. Called with the coalescer's lock held.
+    using TargetsFunction = std::function<std::vector<std::string> (ReleaseGroup const& group)>;
+
+private:
+    static const int TICK_INTERVAL = 5000;
+    static const int MAX_ATTEMPTS = 8;
+    static const int INITIAL_RETRY_DELAY = 30;
+    static const int MAX_RETRY_DELAY = 30 * 60;
+    static const int RETENTION_HOURS = 7 * 24; // how long late variants may still edit the message
+
+    struct TargetState {
+        std::string messageId;
+        int sentRevision = -1;
+        bool abandoned = false;
+        bool inFlight = false;
+        int failures = 0;
+        std::chrono::steady_clock::time_point nextAttempt;
+    };
+
+    struct Group {
+        ReleaseGroup release;
+        std::map<std::string, TargetState> targets;
+    };
+
+    const std::string name;
+    const std::string path;
+    const std::chrono::seconds window;
+    TargetsFunction targetsFunction;
+    SendFunction sendFunction;
+    EditFunction editFunction;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopped = false;
+    std::map<std::string, Group> groups; // by the track and the version string
+
+    void load();
+
+    // Called with the mutex held; logs and returns false on failure
+    bool save();
+
+    void run();
+
+    void onDone(std::string const& groupKey, std::string const& target, int revision, bool success,
+                std::string const& messageId);
+
+public:
+    ReleaseCoalescer(std::string name, std::string path, std::chrono::seconds window, TargetsFunction targetsFunction,
+                     SendFunction sendFunction, EditFunction editFunction);
+
+    ~ReleaseCoalescer();
+
+    void start();
+
+    // Stops sending; the done callbacks of what is in flight may still come in afterwards
+    void stop();
+
+    // Adding a variant that is already in the group (eg. a redelivered notification) changes nothing. Returns once the
+    // variant is durably stored; throws (without adding it) otherwise.
+    void add(ApkNewVersionEvent const& event);
+
+};
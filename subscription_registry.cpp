@@ -0,0 +1,92 @@
+#include "subscription_registry.h"
+
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+
+const char* const SubscriptionRegistry::ANY = "*";
+
+std::string SubscriptionRegistry::makeKey(std::string const& platform, std::string const& track,
+                                          std::string const& arch) {
+    std::string ret;
+    ret.reserve(platform.size() + track.size() + arch.size() + 2);
+    ret += platform;
+    ret += '\0';
+    ret += track;
+    ret += '\0';
+    ret += arch;
+    return ret;
+}
+
+Subscription SubscriptionRegistry::parse(std::string const& spec, std::string const& defaultFormat) {
+    Subscription ret;
+    ret.format = defaultFormat;
+    std::stringstream ss (spec);
+    if (!(ss >> ret.target))
+        throw std::runtime_error("Empty subscription");
+    std::string filter;
+    while (ss >> filter) {
+        auto eq = filter.find('=');
+        if (eq == std::string::npos)
+            throw std::runtime_error("Bad subscription filter: " + filter);
+        std::string name = filter.substr(0, eq);
+        if (name == "format") {
+            ret.format = filter.substr(eq + 1);
+            continue;
+        }
+        std::set<std::string>* values;
+        if (name == "platform")
+            values = &ret.platforms;
+        else if (name == "track")
+            values = &ret.tracks;
+        else if (name == "arch")
+            values = &ret.archs;
+        else
+            throw std::runtime_error("Unknown subscription filter: " + name);
+        for (auto i = eq + 1; i <= filter.size(); ) {
+            auto j = filter.find(',', i);
+            if (j == std::string::npos)
+                j = filter.size();
+            if (j > i)
+                values->insert(filter.substr(i, j - i));
+            i = j + 1;
+        }
+    }
+    return ret;
+}
+
+void SubscriptionRegistry::add(Subscription subscription) {
+    size_t id = subscriptions.size();
+    std::set<std::string> any {ANY};
+    auto const& platforms = subscription.platforms.empty() ? any : subscription.platforms;
+    auto const& tracks = subscription.tracks.empty() ? any : subscription.tracks;
+    auto const& archs = subscription.archs.empty() ? any : subscription.archs;
+    for (auto const& p : platforms) {
+        for (auto const& t : tracks) {
+            for (auto const& a : archs)
+                index[makeKey(p, t, a)].push_back(id);
+        }
+    }
+    subscriptions.push_back(std::move(subscription));
+}
+
+std::map<std::string, std::vector<std::string>> SubscriptionRegistry::matchTargets(
+        std::vector<SubscriptionTopic> const& topics) const {
+    std::vector<size_t> ids;
+    for (auto const& topic : topics)
+        match(topic, [&ids](size_t id, Subscription const&) { ids.push_back(id); });
+    // A subscription may match several of the topics
+    if (topics.size() > 1) {
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    }
+    std::map<std::string, std::vector<std::string>> ret;
+    for (size_t id : ids)
+        ret[subscriptions[id].format].push_back(subscriptions[id].target);
+    // A target may have several subscriptions
+    for (auto& p : ret) {
+        std::sort(p.second.begin(), p.second.end());
+        p.second.erase(std::unique(p.second.begin(), p.second.end()), p.second.end());
+    }
+    return ret;
+}
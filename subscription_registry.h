@@ -0,0 +1,70 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_map>
+
+/**
+ * What a notification is about: eg. {"android", "beta", "arm64"} or {"win10", "release", "x64"}.
+ */
+struct SubscriptionTopic {
+    std::string platform;
+    std::string track;
+    std::string arch;
+};
+
+struct Subscription {
+    std::string target; // a channel or chat id
+    std::string format; // how the target wants the notifications, eg. "embed" or "json"
+    // An empty set matches anything
+    std::set<std::string> platforms;
+    std::set<std::string> tracks;
+    std::set<std::string> archs;
+};
+
+/**
+ * The subscriptions of one notifier, compiled into a hash index on (platform, track, arch) where each component is
+ * either a value or a wildcard. A topic is looked up under the 8 combinations of its values and the wildcard, so
+ * matching costs a constant number of lookups plus the number of matches, regardless of how many subscriptions
+ * there are. Each subscription is matched by at most one of those keys, so no deduplication is needed.
+ *
+ * The registry is built once from the configuration and only read afterwards.
+ */
+class SubscriptionRegistry {
+
+private:
+    std::vector<Subscription> subscriptions;
+    std::unordered_map<std::string, std::vector<size_t>> index;
+
+    static std::string makeKey(std::string const& platform, std::string const& track, std::string const& arch);
+
+public:
+    static const char* const ANY;
+
+    // Parses "<target> [platform=a,b] [track=a,b] [arch=a,b] [format=f]", throws on errors
+    static Subscription parse(std::string const& spec, std::string const& defaultFormat);
+
+    void add(Subscription subscription);
+
+    size_t size() const { return subscriptions.size(); }
+
+    // Calls callback(size_t id, Subscription const&) for each subscription interested in the topic
+    template <typename Callback>
+    void match(SubscriptionTopic const& topic, Callback callback) const {
+        for (int i = 0; i < 8; i++) {
+            auto it = index.find(makeKey((i & 1) ? ANY : topic.platform, (i & 2) ? ANY : topic.track,
+                                         (i & 4) ? ANY : topic.arch));
+            if (it == index.end())
+                continue;
+            for (size_t s : it->second)
+                callback(s, subscriptions[s]);
+        }
+    }
+
+    // The targets interested in any of the topics, grouped by the format, so that the notification can be serialized
+    // once per format
+    std::map<std::string, std::vector<std::string>> matchTargets(std::vector<SubscriptionTopic> const& topics) const;
+
+};
@@ -15,11 +15,20 @@ nlohmann::json telegram::Api::sendRequest(playapi::http_method method, std::stri
     return json::parse(resp.get_body());
 }
 
-void telegram::Api::sendMessage(std::string const& chatId, std::string const& text, const std::string& parseMode) {
+std::string telegram::Api::buildMessageBody(std::string const& text, std::string const& parseMode) {
     json data;
-    data["chat_id"] = chatId;
     data["text"] = text;
     if (!parseMode.empty())
         data["parse_mode"] = parseMode;
-    sendRequest(playapi::http_method::POST, "bot" + token + "/sendMessage", data);
+    return data.dump();
+}
+
+nlohmann::json telegram::Api::sendPreparedRequest(std::string const& method, std::string const& chatId,
+                                                  std::string const& body) {
+    // body is a serialized object, splice the chat id in as its first member
+    std::string data = "{\"chat_id\":" + json(chatId).dump();
+    if (body.size() > 2)
+        data += ',';
+    data.append(body, 1, std::string::npos);
+    return sendRequest(playapi::http_method::POST, "bot" + token + "/" + method, data);
 }
\ No newline at end of file
@@ -27,7 +27,19 @@ public:
         return sendRequest(method, path, body.dump());
     }
 
-    void sendMessage(std::string const& chatId, std::string const& text, std::string const& parseMode = std::string());
+    // Serializes everything except for the chat id, so that the same body can be sent to many chats
+    static std::string buildMessageBody(std::string const& text, std::string const& parseMode = std::string());
+
+    // Calls the method with the chat id added to the serialized parameters
+    nlohmann::json sendPreparedRequest(std::string const& method, std::string const& chatId, std::string const& body);
+
+    nlohmann::json sendPreparedMessage(std::string const& chatId, std::string const& body) {
+        return sendPreparedRequest("sendMessage", chatId, body);
+    }
+
+    void sendMessage(std::string const& chatId, std::string const& text, std::string const& parseMode = std::string()) {
+        sendPreparedMessage(chatId, buildMessageBody(text, parseMode));
+    }
 
 };
 
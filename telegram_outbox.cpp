@@ -0,0 +1,274 @@
+#include "telegram_outbox.h"
+#include "async_log.h"
+#include "file_utils.h"
+
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+using namespace telegram;
+
+const size_t Outbox::MAX_QUEUED;
+const int Outbox::WORKER_COUNT;
+const int Outbox::MAX_ATTEMPTS;
+const int Outbox::GLOBAL_MESSAGES_PER_SECOND;
+const int Outbox::GROUP_MESSAGES_PER_MINUTE;
+const int Outbox::INITIAL_RETRY_DELAY;
+const int Outbox::MAX_RETRY_DELAY;
+const int Outbox::SAVE_INTERVAL;
+
+Outbox::Outbox(Api& api, std::string path) : api(api), path(std::move(path)),
+        globalBucket(GLOBAL_MESSAGES_PER_SECOND, GLOBAL_MESSAGES_PER_SECOND) {
+    load();
+}
+
+Outbox::~Outbox() {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        stopped = true;
+    }
+    cv.notify_all();
+    for (auto& t : threads)
+        t.join();
+    std::lock_guard<std::mutex> lk(mutex);
+    if (dirty)
+        save();
+}
+
+void Outbox::start() {
+    for (int i = 0; i < WORKER_COUNT; i++)
+        threads.emplace_back(std::bind(&Outbox::runWorker, this));
+}
+
+TokenBucket Outbox::createChatBucket(std::string const& chatId) {
+    // Group and channel ids are negative (or an @username); those get 20 messages per minute, private chats about one
+    // per second
+    if (!chatId.empty() && (chatId[0] == '-' || chatId[0] == '@'))
+        return TokenBucket(3, GROUP_MESSAGES_PER_MINUTE / 60.0);
+    return TokenBucket(1, 1);
+}
+
+Outbox::Chat& Outbox::getChat(std::string const& chatId) {
+    auto it = chats.find(chatId);
+    if (it == chats.end())
+        it = chats.insert(std::make_pair(chatId, Chat(createChatBucket(chatId)))).first;
+    return it->second;
+}
+
+void Outbox::push(std::unique_ptr<Message> message) {
+    Chat& chat = getChat(message->chatId);
+    chat.queue.push_back(std::move(message));
+    queuedCount++;
+}
+
+bool Outbox::send(std::string const& chatId, std::string const& method, std::string const& body,
+                  ResultCallback callback) {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        if (queuedCount >= MAX_QUEUED) {
+            AsyncLog::error("Telegram", "The outbox is full, dropped a %s call", method.c_str());
+            return false;
+        }
+        std::unique_ptr<Message> message (new Message());
+        message->id = nextId++;
+        message->chatId = chatId;
+        message->method = method;
+        message->body = std::make_shared<const std::string>(body);
+        // Saved by the workers within SAVE_INTERVAL
+        if (!callback)
+            dirty = true;
+        message->callback = std::move(callback);
+        push(std::move(message));
+    }
+    cv.notify_all();
+    return true;
+}
+
+Outbox::Chat* Outbox::findReadyChat(Clock::time_point now, Clock::time_point& nextTime) {
+    if (queuedCount == 0)
+        return nullptr;
+    Clock::time_point globalAvailable = globalBucket.nextAvailable(now);
+    if (globalAvailable > now) {
+        nextTime = globalAvailable;
+        return nullptr;
+    }
+    for (auto& p : chats) {
+        Chat& chat = p.second;
+        if (chat.busy || chat.queue.empty())
+            continue;
+        Clock::time_point notBefore = chat.queue.front()->notBefore;
+        if (notBefore > now) {
+            nextTime = std::min(nextTime, notBefore);
+            continue;
+        }
+        if (!chat.bucket.tryTake(now)) {
+            nextTime = std::min(nextTime, chat.bucket.nextAvailable(now));
+            continue;
+        }
+        globalBucket.tryTake(now);
+        chat.busy = true;
+        return &chat;
+    }
+    return nullptr;
+}
+
+Outbox::SendResult Outbox::send(Message const& message, nlohmann::json& res, std::string& detail, int& retryAfter) {
+    try {
+        res = api.sendPreparedRequest(message.method, message.chatId, *message.body);
+    } catch (std::exception& e) {
+        detail = e.what();
+        return SendResult::Retry;
+    }
+    if (res.value("ok", false))
+        return SendResult::Success;
+    detail = res.value("description", std::string());
+    int errorCode = res.value("error_code", 0);
+    if (errorCode == 429) {
+        retryAfter = 1;
+        if (res.count("parameters") > 0 && res["parameters"].is_object())
+            retryAfter = res["parameters"].value("retry_after", 1);
+        return SendResult::Retry;
+    }
+    if (errorCode >= 500 || errorCode == 0)
+        return SendResult::Retry;
+    return SendResult::Failure;
+}
+
+void Outbox::runWorker() {
+    std::unique_lock<std::mutex> lk(mutex);
+    while (!stopped) {
+        if (dirty && !saving && Clock::now() - lastSave >= std::chrono::milliseconds(SAVE_INTERVAL)) {
+            std::string data = buildSnapshot();
+            dirty = false;
+            saving = true;
+            lastSave = Clock::now();
+            lk.unlock();
+            bool saved = writeSnapshot(data);
+            lk.lock();
+            saving = false;
+            if (!saved)
+                dirty = true;
+            cv.notify_all();
+            continue;
+        }
+
+        Clock::time_point nextTime = Clock::time_point::max();
+        if (dirty && !saving)
+            nextTime = lastSave + std::chrono::milliseconds(SAVE_INTERVAL);
+        Chat* chat = findReadyChat(Clock::now(), nextTime);
+        if (chat == nullptr) {
+            if (nextTime == Clock::time_point::max())
+                cv.wait(lk);
+            else
+                cv.wait_until(lk, nextTime);
+            continue;
+        }
+        // The message stays at the front of the queue while it's being sent, so that it's persisted until it's done
+        Message* message = chat->queue.front().get();
+        lk.unlock();
+
+        nlohmann::json response;
+        std::string detail;
+        int retryAfter = -1;
+        SendResult result = send(*message, response, detail, retryAfter);
+
+        lk.lock();
+        chat->busy = false;
+        if (!message->callback)
+            dirty = true;
+        auto now = Clock::now();
+        if (result == SendResult::Retry && ++message->attempt < MAX_ATTEMPTS) {
+            int delay;
+            if (retryAfter >= 0) {
+                delay = retryAfter * 1000;
+                chat->bucket.drain(now);
+                AsyncLog::warn("Telegram", "Rate limited on chat %s, retrying in %is", message->chatId.c_str(),
+                               retryAfter);
+            } else {
+                delay = std::min(INITIAL_RETRY_DELAY << std::min(message->attempt - 1, 16), MAX_RETRY_DELAY);
+                AsyncLog::warn("Telegram", "Sending to %s failed (attempt %i), retrying in %ims: %s",
+                               message->chatId.c_str(), message->attempt, delay, detail.c_str());
+            }
+            message->notBefore = now + std::chrono::milliseconds(delay);
+            cv.notify_all();
+            continue;
+        }
+        std::unique_ptr<Message> done = std::move(chat->queue.front());
+        chat->queue.pop_front();
+        queuedCount--;
+        cv.notify_all();
+        lk.unlock();
+        if (result != SendResult::Success)
+            AsyncLog::error("Telegram", "Failed to send a message to %s: %s", done->chatId.c_str(), detail.c_str());
+        if (done->callback) {
+            try {
+                done->callback(result == SendResult::Success, response);
+            } catch (std::exception& e) {
+                AsyncLog::error("Telegram", "Result callback failed: %s", e.what());
+            }
+        }
+        lk.lock();
+    }
+}
+
+void Outbox::load() {
+    if (path.empty())
+        return;
+    std::ifstream ifs(path);
+    if (!ifs)
+        return;
+    try {
+        nlohmann::json data = nlohmann::json::parse(ifs);
+        nextId = data.value("next_id", 1ULL);
+        for (auto const& m : data["messages"]) {
+            std::unique_ptr<Message> message (new Message());
+            message->id = m["id"].get<unsigned long long>();
+            message->chatId = m["chat_id"].get<std::string>();
+            message->method = m.value("method", std::string("sendMessage"));
+            message->body = std::make_shared<const std::string>(m["body"].get<std::string>());
+            message->attempt = m.value("attempt", 0);
+            push(std::move(message));
+        }
+    } catch (std::exception& e) {
+        AsyncLog::error("Telegram", "Failed to load the outbox: %s", e.what());
+    }
+    if (queuedCount > 0)
+        AsyncLog::info("Telegram", "Loaded %zu queued messages from the outbox", queuedCount);
+}
+
+std::string Outbox::buildSnapshot() {
+    nlohmann::json messages = nlohmann::json::array();
+    for (auto const& p : chats) {
+        for (auto const& m : p.second.queue) {
+            if (m->callback)
+                continue;
+            messages.push_back({
+                {"id", m->id},
+                {"chat_id", m->chatId},
+                {"method", m->method},
+                {"body", *m->body},
+                {"attempt", m->attempt}
+            });
+        }
+    }
+    nlohmann::json data;
+    data["next_id"] = nextId;
+    data["messages"] = std::move(messages);
+    return data.dump();
+}
+
+bool Outbox::writeSnapshot(std::string const& data) {
+    if (path.empty())
+        return true;
+    if (!FileUtils::writeFileDurably(path, data)) {
+        AsyncLog::error("Telegram", "Failed to save the outbox: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void Outbox::save() {
+    dirty = !writeSnapshot(buildSnapshot());
+    lastSave = Clock::now();
+}
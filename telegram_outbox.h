@@ -0,0 +1,122 @@
+#pragma once
+
+#include "telegram.h"
+#include "token_bucket.h"
+
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+
+namespace telegram {
+
+/**
+ * Sends messages asynchronously on its own worker threads while staying within the Telegram limits: a global token
+ * bucket plus one per chat (private chats and groups have different limits). Messages to the same chat are sent one
+ * at a time and in order. Requests answered with a 429 wait for the given retry_after, other transient errors are
+ * retried with an exponential backoff.
+ *
+ * The outbox is bounded and persisted to disk, so the queued messages survive a restart. Delivery is at least once:
+ * a message sent right before a crash may be sent again. Messages with a result callback are the exception: the
+ * callback can't survive a restart, so whoever passed it keeps its own retry state and they are kept in memory only.
+ */
+class Outbox {
+
+public:
+    using Clock = std::chrono::steady_clock;
+    // Called once the message is done, with the response (null after a transport error)
+    using ResultCallback = std::function<void (bool success, nlohmann::json const& response)>;
+
+    static const size_t MAX_QUEUED = 2000;
+
+private:
+    static const int WORKER_COUNT = 4;
+    static const int MAX_ATTEMPTS = 8;
+    static const int GLOBAL_MESSAGES_PER_SECOND = 30;
+    static const int GROUP_MESSAGES_PER_MINUTE = 20;
+    static const int INITIAL_RETRY_DELAY = 1000;
+    static const int MAX_RETRY_DELAY = 5 * 60 * 1000;
+    static const int SAVE_INTERVAL = 1000;
+
+    struct Message {
+        unsigned long long id;
+        std::string chatId;
+        std::string method = "sendMessage";
+        std::shared_ptr<const std::string> body; // the parameters without the chat id, eg. from Api::buildMessageBody
+        int attempt = 0;
+        Clock::time_point notBefore;
+        // Not persisted, and neither is a message that has one
+        ResultCallback callback;
+    };
+
+    struct Chat {
+        std::deque<std::unique_ptr<Message>> queue;
+        TokenBucket bucket;
+        bool busy = false;
+
+        explicit Chat(TokenBucket bucket) : bucket(bucket) {}
+    };
+
+    enum class SendResult { Success, Retry, Failure };
+
+    Api& api;
+    const std::string path;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopped = false;
+    std::vector<std::thread> threads;
+    std::map<std::string, Chat> chats;
+    TokenBucket globalBucket;
+    size_t queuedCount = 0;
+    unsigned long long nextId = 1;
+    bool dirty = false;
+    bool saving = false; // a worker is writing a snapshot, without the mutex held
+    Clock::time_point lastSave;
+
+    static TokenBucket createChatBucket(std::string const& chatId);
+
+    Chat& getChat(std::string const& chatId);
+
+    void push(std::unique_ptr<Message> message);
+
+    // Returns a chat whose next message can be sent now, or sets nextTime to when one might become available
+    Chat* findReadyChat(Clock::time_point now, Clock::time_point& nextTime);
+
+    SendResult send(Message const& message, nlohmann::json& response, std::string& detail, int& retryAfter);
+
+    void runWorker();
+
+    void load();
+
+    // Called with the mutex held
+    std::string buildSnapshot();
+
+    // Returns false (after logging) if the snapshot couldn't be stored
+    bool writeSnapshot(std::string const& data);
+
+    // Called with the mutex held; the workers write the snapshot every SAVE_INTERVAL without it instead
+    void save();
+
+public:
+    // Loads the messages left over in the outbox file; path may be empty to keep the outbox only in memory
+    Outbox(Api& api, std::string path);
+
+    // Persists what hasn't been sent yet and stops the workers
+    ~Outbox();
+
+    void start();
+
+    // Queues a single call of any method that takes a chat id (eg. editMessageText), never blocks. Returns false if
+    // the outbox is full.
+    bool send(std::string const& chatId, std::string const& method, std::string const& body,
+              ResultCallback callback = ResultCallback());
+
+};
+
+}
@@ -4,29 +4,79 @@
 #include <sstream>
 #include <regex>
 
-TelegramState::TelegramState(ApkManager& apkManager) {
+TelegramState::TelegramState(ApkManager& apkManager) : outbox(api, "priv/telegram_outbox.json") {
     std::ifstream ifs("priv/telegram.conf");
     config.load(ifs);
 
     api.setToken(config.get("token"));
-    broadcastTo = config.get_array("broadcast", {});
+    // "<chat> [platform=android] [track=release,beta] [arch=arm,arm64,x86,x86_64]"
+    for (auto const& s : config.get_array("subscriptions", {})) {
+        Subscription subscription = SubscriptionRegistry::parse(s, "text");
+        if (subscription.format != "text")
+            throw std::runtime_error("Unknown subscription format: " + subscription.format);
+        subscriptions.add(std::move(subscription));
+    }
+    for (auto const& c : config.get_array("broadcast", {}))
+        subscriptions.add({c, "text", {"android"}, {}, {}});
+    outbox.start();
 
     using namespace std::placeholders;
-    apkManager.addNewVersionCallback(std::bind(&TelegramState::onNewVersion, this, _1, _2, _3, _4));
+    releaseCoalescer.reset(new ReleaseCoalescer("TelegramReleases", "priv/telegram_releases.json",
+            std::chrono::seconds(config.get_int("coalesce_window", 300)), [this](ReleaseGroup const& group) {
+                return subscriptions.matchTargets(group.getTopics())["text"];
+            },
+            std::bind(&TelegramState::sendRelease, this, _1, _2, _3),
+            std::bind(&TelegramState::editRelease, this, _1, _2, _3, _4)));
+    releaseCoalescer->start();
+
+    apkManager.addNewVersionSubscriber("telegram.apk", std::bind(&TelegramState::onNewVersion, this, _1, _2));
+}
+
+TelegramState::~TelegramState() {
+    releaseCoalescer->stop();
+}
+
+void TelegramState::onNewVersion(long long notificationId, ApkNewVersionEvent const& event) {
+    releaseCoalescer->add(event);
 }
 
-void TelegramState::onNewVersion(int version, std::string const& versionString, std::string const& changelog,
-                                 std::string const& variant) {
+std::string TelegramState::formatRelease(ReleaseGroup const& group) {
     static std::regex regexNewlines ("<br>");
-    std::string processedChangelog = std::regex_replace(changelog, regexNewlines, "\n");
     std::stringstream ss;
-    ss << "*New version available: " << versionString
-       << "* (version code: " << version << ", variant: " << variant << ")\n"
-       << processedChangelog;
-    broadcastMessage(ss.str(), "Markdown");
+    ss << "*New " << (group.isBeta ? "beta" : "version") << " available: " << group.versionString << "*\n";
+    for (auto const& v : group.variants)
+        ss << v.first << " (version code: " << v.second << ")\n";
+    ss << std::regex_replace(group.changelog, regexNewlines, "\n");
+    return ss.str();
+}
+
+void TelegramState::sendRelease(std::string const& chatId, ReleaseGroup const& group,
+                                ReleaseCoalescer::DoneCallback done) {
+    bool queued = outbox.send(chatId, "sendMessage", telegram::Api::buildMessageBody(formatRelease(group), "Markdown"),
+            [done](bool success, nlohmann::json const& response) {
+        if (success && response.count("result") > 0 && response["result"].count("message_id") > 0)
+            done(true, std::to_string(response["result"]["message_id"].get<long long>()));
+        else
+            done(success, std::string());
+    });
+    if (!queued)
+        done(false, std::string());
+}
+
+void TelegramState::editRelease(std::string const& chatId, std::string const& messageId, ReleaseGroup const& group,
+                                ReleaseCoalescer::DoneCallback done) {
+    nlohmann::json body;
+    body["message_id"] = std::stoll(messageId);
+    body["text"] = formatRelease(group);
+    body["parse_mode"] = "Markdown";
+    bool queued = outbox.send(chatId, "editMessageText", body.dump(),
+            [done, messageId](bool success, nlohmann::json const& response) {
+        // Editing to the same text is an error, but as far as we are concerned the message is up to date
+        bool notModified = !success && response.is_object() &&
+                response.value("description", std::string()).find("message is not modified") != std::string::npos;
+        done(success || notModified, messageId);
+    });
+    if (!queued)
+        done(false, std::string());
 }
 
-void TelegramState::broadcastMessage(std::string const& text, const std::string& parseMode) {
-    for (std::string const& target : broadcastTo)
-        api.sendMessage(target, text, parseMode);
-}
\ No newline at end of file
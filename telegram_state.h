@@ -2,20 +2,33 @@
 
 #include "apk_manager.h"
 #include "telegram.h"
+#include "telegram_outbox.h"
+#include "release_coalescer.h"
 
 class TelegramState {
 
 private:
     telegram::Api api;
     playapi::config config;
-    std::vector<std::string> broadcastTo;
+    // The only format is "text"
+    SubscriptionRegistry subscriptions;
+    // Declared before the outbox, whose result callbacks use it
+    std::unique_ptr<ReleaseCoalescer> releaseCoalescer;
+    telegram::Outbox outbox;
+
+    static std::string formatRelease(ReleaseGroup const& group);
+
+    void sendRelease(std::string const& chatId, ReleaseGroup const& group, ReleaseCoalescer::DoneCallback done);
+
+    void editRelease(std::string const& chatId, std::string const& messageId, ReleaseGroup const& group,
+                     ReleaseCoalescer::DoneCallback done);
 
 public:
     TelegramState(ApkManager& apkManager);
 
-    void onNewVersion(int version, std::string const& versionString,
-                      std::string const& changelog, std::string const& variant);
+    ~TelegramState();
 
-    void broadcastMessage(std::string const& text, std::string const& parseMode = std::string());
+    // Runs on the notification outbox, hands the variant to the release coalescer
+    void onNewVersion(long long notificationId, ApkNewVersionEvent const& event);
 
 };
\ No newline at end of file
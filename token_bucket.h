@@ -0,0 +1,56 @@
+#pragma once
+
+#include <chrono>
+#include <algorithm>
+
+/**
+ * Allows bursts of up to `capacity` events, refilled at `ratePerSecond`. Not thread-safe, guard it with the lock of
+ * whatever owns it.
+ */
+class TokenBucket {
+
+public:
+    using Clock = std::chrono::steady_clock;
+
+private:
+    double capacity;
+    double ratePerSecond;
+    double tokens;
+    Clock::time_point lastRefill;
+
+    void refill(Clock::time_point now) {
+        if (now <= lastRefill)
+            return;
+        double elapsed = std::chrono::duration<double>(now - lastRefill).count();
+        tokens = std::min(capacity, tokens + elapsed * ratePerSecond);
+        lastRefill = now;
+    }
+
+public:
+    TokenBucket(double capacity, double ratePerSecond) : capacity(capacity), ratePerSecond(ratePerSecond),
+            tokens(capacity), lastRefill(Clock::now()) {}
+
+    bool tryTake(Clock::time_point now) {
+        refill(now);
+        if (tokens < 1.0)
+            return false;
+        tokens -= 1.0;
+        return true;
+    }
+
+    // When the next token will be available
+    Clock::time_point nextAvailable(Clock::time_point now) {
+        refill(now);
+        if (tokens >= 1.0)
+            return now;
+        return now + std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>((1.0 - tokens) / ratePerSecond));
+    }
+
+    // Takes away all the tokens, eg. when the remote side told us to slow down
+    void drain(Clock::time_point now) {
+        refill(now);
+        tokens = 0.0;
+    }
+
+};
@@ -0,0 +1,83 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "../discord_gateway_codec.h"
+
+using namespace discord::gateway;
+using Clock = std::chrono::steady_clock;
+
+static double elapsedMs(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Discord sends the snowflakes as (big) integers over ETF, while they are strings in the JSON encoding
+static void snowflakesToIntegers(nlohmann::json& value) {
+    if (value.is_string()) {
+        std::string const& str = value.get_ref<std::string const&>();
+        if (str.size() >= 15 && str.size() <= 20 && str.find_first_not_of("0123456789") == std::string::npos)
+            value = (std::uint64_t) std::strtoull(str.c_str(), nullptr, 10);
+        return;
+    }
+    if (value.is_object() || value.is_array()) {
+        for (auto& v : value)
+            snowflakesToIntegers(v);
+    }
+}
+
+static void runDecode(const char* name, Codec& codec, std::vector<std::string> const& events, int iterations) {
+    size_t totalSize = 0;
+    for (auto const& e : events)
+        totalSize += e.size();
+    long long checksum = 0;
+    auto start = Clock::now();
+    for (int it = 0; it < iterations; it++) {
+        for (auto const& e : events) {
+            Payload payload;
+            codec.decode(e.data(), e.size(), payload);
+            checksum += payload.sequenceNumber;
+        }
+    }
+    double time = elapsedMs(start);
+    printf("%s: %zu events (%zu B) x %i: %.3f ms, %.1f MB/s, %.0f events/s (checksum %lli)\n", name, events.size(),
+           totalSize, iterations, time, totalSize * iterations / 1000.0 / time,
+           events.size() * iterations * 1000.0 / time, checksum);
+}
+
+/**
+ * Compares the decode throughput of the JSON and ETF gateway encodings. The input is a recorded event stream with one
+ * (decompressed) JSON payload per line; the ETF stream is produced by re-encoding the same payloads, with the
+ * snowflakes turned back into integers like the gateway sends them.
+ */
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printf("Usage: %s <recorded payloads (one JSON per line)> [iterations]\n", argv[0]);
+        return 1;
+    }
+    int iterations = argc > 2 ? atoi(argv[2]) : 20;
+
+    std::vector<std::string> jsonEvents, etfEvents;
+    std::ifstream ifs(argv[1]);
+    std::string line;
+    while (std::getline(ifs, line)) {
+        if (line.empty())
+            continue;
+        nlohmann::json payload = nlohmann::json::parse(line);
+        snowflakesToIntegers(payload);
+        etfEvents.push_back(EtfCodec::encodeJson(payload));
+        jsonEvents.push_back(std::move(line));
+    }
+    if (jsonEvents.empty()) {
+        printf("No events loaded\n");
+        return 1;
+    }
+
+    JsonCodec jsonCodec;
+    EtfCodec etfCodec;
+    runDecode("json", jsonCodec, jsonEvents, iterations);
+    runDecode("etf", etfCodec, etfEvents, iterations);
+    return 0;
+}
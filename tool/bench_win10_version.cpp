@@ -0,0 +1,65 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "../win10_version_text_db.h"
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsedMs(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+static std::string makeMoniker(int i, bool preview, const char* arch) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "Microsoft.%s_1.%i.%i.0_%s__8wekyb3d8bbwe", preview ? "MinecraftWindowsBeta" : "MinecraftUWP",
+             i / 100, (i % 100) * 100 + i % 7, arch);
+    return buf;
+}
+
+int main(int argc, char** argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 2000;
+    int iterations = argc > 2 ? atoi(argv[2]) : 100;
+
+    std::vector<std::string> monikers;
+    for (int i = 0; i < count; i++) {
+        monikers.push_back(makeMoniker(i, (i % 3) == 2, "x64"));
+        monikers.push_back(makeMoniker(i, (i % 3) == 2, "x86"));
+        monikers.push_back(makeMoniker(i, (i % 3) == 2, "arm"));
+    }
+
+    auto start = Clock::now();
+    long long checksum = 0;
+    for (int it = 0; it < iterations; it++) {
+        for (auto const& m : monikers)
+            checksum += Win10VersionTextDb::convertVersion(m).revision;
+    }
+    double convertTime = elapsedMs(start);
+    printf("convertVersion: %zu monikers x %i: %.3f ms (%.1f ns/call, checksum %lli)\n", monikers.size(), iterations,
+           convertTime, convertTime * 1000000.0 / (monikers.size() * iterations), checksum);
+
+    Win10VersionTextDb db;
+    start = Clock::now();
+    for (size_t i = 0; i < monikers.size(); i++)
+        db.add((i / 3) % 3 == 2 ? Win10VersionType::Preview : Win10VersionType::Release,
+               {"00000000-0000-0000-0000-" + std::to_string(100000000000LL + i), monikers[i], std::to_string(i)});
+    printf("build db (%zu entries): %.3f ms\n", monikers.size(), elapsedMs(start));
+
+    start = Clock::now();
+    size_t jsonSize = db.getJson().size();
+    size_t textSize = db.getText().size();
+    printf("initial serialisation (json %zu B, text %zu B): %.3f ms\n", jsonSize, textSize, elapsedMs(start));
+
+    start = Clock::now();
+    for (int i = 0; i < iterations; i++) {
+        db.add(Win10VersionType::Beta, {"ffffffff-0000-0000-0000-" + std::to_string(100000000000LL + i),
+                                        makeMoniker(count + i, false, "x64"), std::to_string(count + i)});
+        jsonSize = db.getJson().size();
+        textSize = db.getText().size();
+    }
+    double appendTime = elapsedMs(start);
+    printf("incremental add + serialisation x %i: %.3f ms (%.3f us/add)\n", iterations, appendTime,
+           appendTime * 1000.0 / iterations);
+    return 0;
+}
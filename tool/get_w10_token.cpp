@@ -1,11 +1,27 @@
 #include "../win10_store_manager.h"
+#include "../file_utils.h"
 #include <iostream>
+#include <cstdlib>
 
 int main() {
-    Win10StoreManager win10Manager;
-    win10Manager.init();
-    auto token = win10Manager.getMsaToken();
+    // The manager can't run without an outbox, but this one is never started. It gets its own files, as opening the
+    // daemon's journal would truncate whatever the daemon is in the middle of appending
+    char outboxDir[] = "/tmp/get-w10-token.XXXXXX";
+    if (mkdtemp(outboxDir) == nullptr) {
+        std::cerr << "Failed to create a directory for the outbox" << std::endl;
+        return 1;
+    }
+    std::string token;
+    {
+        NotificationOutbox notifications (std::string(outboxDir) + "/notifications.journal",
+                                          std::string(outboxDir) + "/notification_cursors.json",
+                                          std::string(outboxDir) + "/notifications.dead.jsonl");
+        Win10StoreManager win10Manager (notifications);
+        win10Manager.init();
+        token = win10Manager.getMsaToken();
+    }
+    FileUtils::deleteDir(outboxDir);
     std::cout << std::endl;
     std::cout << "Token: " << token;
     return 0;
-}
\ No newline at end of file
+}
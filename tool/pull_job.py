@@ -1,5 +1,6 @@
 import os
 import sys
+import json
 import fcntl
 from pathlib import Path
 import inotify.adapters
@@ -8,16 +9,37 @@ lock_file = "priv/jobs/lock"
 pending_job_root = "priv/jobs/pending"
 active_job_root = "priv/jobs/active"
 
+# The job types this worker can run, all of them if none are given
+job_types = set(sys.argv[1:])
+
+def read_job_info(data_dir):
+    try:
+        with open(os.path.join(data_dir, "job.json")) as f:
+            desc = json.load(f)
+        return desc.get("type", ""), desc.get("priority", 1)
+    except (OSError, ValueError):
+        return "", 1
+
 def try_pick_job():
     f = open(lock_file, "a+")
     fcntl.lockf(f, fcntl.LOCK_EX)
 
+    # The same order as JobManager: the highest priority first, then the longest pending
+    candidates = []
     for p in os.listdir(pending_job_root):
-        data_dir = os.readlink(os.path.join(pending_job_root, p))
-        data_dir = Path(data_dir).resolve()
-
+        link = os.path.join(pending_job_root, p)
+        data_dir = Path(os.readlink(link)).resolve()
+        job_type, priority = read_job_info(data_dir)
+        if len(job_types) > 0 and job_type not in job_types:
+            continue
+        candidates.append((-priority, os.lstat(link).st_mtime_ns, p, data_dir))
+    candidates.sort()
+
+    for _, _, p, data_dir in candidates:
         os.symlink(data_dir, os.path.join(active_job_root, p))
         os.remove(os.path.join(pending_job_root, p))
+        # The lease deadline is counted from the modification time
+        os.utime(data_dir)
 
         return data_dir
 
@@ -0,0 +1,54 @@
+#include "version_query_service.h"
+
+VersionQueryService::VersionQueryService(HttpServer& server, ApkManager& apkManager,
+                                         Win10VersionDBManager& win10VdbManager) :
+        server(server), apkManager(apkManager) {
+    server.addPreparedResponse("/android/versions");
+    server.addPreparedResponse("/win10/versions");
+    server.addPreparedResponse("/win10/versions.json.min");
+
+    updateAndroidVersions();
+    apkManager.addNewVersionCallback([this](int, std::string const&, std::string const&, std::string const&) {
+        updateAndroidVersions();
+    });
+    win10VdbManager.addChangeCallback(std::bind(&VersionQueryService::updateWin10Versions, this,
+                                                std::placeholders::_1));
+}
+
+nlohmann::json VersionQueryService::buildVersionInfoJson(ApkVersionInfo const& info) {
+    nlohmann::json ret;
+    ret["versionCode"] = info.versionCode;
+    ret["versionString"] = info.versionString;
+    ret["lastDownloadedVersionCode"] = info.lastDownloadedVersionCode;
+    return ret;
+}
+
+void VersionQueryService::updateAndroidVersions() {
+    std::lock_guard<std::mutex> lk(androidMutex);
+    ApkVersionSnapshot v = apkManager.getVersionSnapshot();
+    nlohmann::json j;
+    j["release"]["arm"] = buildVersionInfoJson(v.releaseARM);
+    j["release"]["arm64"] = buildVersionInfoJson(v.releaseARM64);
+    j["release"]["x86"] = buildVersionInfoJson(v.releaseX86);
+    j["release"]["x86_64"] = buildVersionInfoJson(v.releaseX8664);
+    j["beta"]["arm"] = buildVersionInfoJson(v.betaARM);
+    j["beta"]["arm64"] = buildVersionInfoJson(v.betaARM64);
+    j["beta"]["x86"] = buildVersionInfoJson(v.betaX86);
+    j["beta"]["x86_64"] = buildVersionInfoJson(v.betaX8664);
+    server.setPreparedResponse("/android/versions", HttpPreparedResponse::create("application/json", j.dump()));
+}
+
+void VersionQueryService::updateWin10Versions(Win10VersionTextDb& db) {
+    nlohmann::json j;
+    auto addList = [&j, &db](const char* name, Win10VersionType type) {
+        nlohmann::json& list = j[name] = nlohmann::json::array();
+        for (auto const& v : db.getListFor(type))
+            list.push_back({{"uuid", v.uuid}, {"fileName", v.fileName}, {"serverId", v.serverId}});
+    };
+    addList("release", Win10VersionType::Release);
+    addList("beta", Win10VersionType::Beta);
+    addList("preview", Win10VersionType::Preview);
+    server.setPreparedResponse("/win10/versions", HttpPreparedResponse::create("application/json", j.dump()));
+    server.setPreparedResponse("/win10/versions.json.min",
+                               HttpPreparedResponse::create("application/json", db.getJson()));
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "http_server.h"
+#include "apk_manager.h"
+#include "win10_versiondb_manager.h"
+#include <nlohmann/json.hpp>
+
+/**
+ * Serves the current version data over the local HTTP server. All responses are rebuilt (and compressed) when the
+ * data changes, so that serving a request never needs to touch the managers.
+ */
+class VersionQueryService {
+
+private:
+    HttpServer& server;
+    ApkManager& apkManager;
+    std::mutex androidMutex;
+
+    static nlohmann::json buildVersionInfoJson(ApkVersionInfo const& info);
+
+    void updateAndroidVersions();
+
+    void updateWin10Versions(Win10VersionTextDb& db);
+
+public:
+    VersionQueryService(HttpServer& server, ApkManager& apkManager, Win10VersionDBManager& win10VdbManager);
+
+};
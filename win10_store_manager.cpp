@@ -1,4 +1,5 @@
 #include "win10_store_manager.h"
+#include "async_log.h"
 
 #include <fstream>
 #include <playapi/util/config.h>
@@ -11,6 +12,7 @@
 
 const char* const Win10StoreManager::MINECRAFT_APP_ID = "d25480ca-36aa-46e6-b76b-39608d49558c";
 const char* const Win10StoreManager::MINECRAFT_PREVIEW_APP_ID = "188f32fc-5eaa-45a8-9f78-7dde4322d131";
+const char* const Win10StoreManager::NEW_VERSION_NOTIFICATION = "win10_new_version";
 
 void Win10StoreManager::init() {
     std::lock_guard<std::mutex> dataLock (dataMutex);
@@ -98,7 +100,7 @@ void Win10StoreManager::checkVersion(Win10StoreNetwork& net, Win10StoreNetwork::
     try {
         res = net.syncVersion(cookie, {versionType == Win10VersionType::Preview ? MINECRAFT_PREVIEW_APP_ID : MINECRAFT_APP_ID});
     } catch (Win10StoreNetwork::SOAPError& e) {
-        printf("SOAP ERROR: %s\n", e.code.c_str());
+        AsyncLog::error("Win10Store", "SOAP error: %s", e.code.c_str());
         if (e.code == "ConfigChanged") {
             cookie = net.fetchCookie(net.fetchConfigLastChanged());
             saveConfig();
@@ -107,25 +109,27 @@ void Win10StoreManager::checkVersion(Win10StoreNetwork& net, Win10StoreNetwork::
         }
         return;
     } catch (std::exception& e) {
-        printf("Win10 version check failed: %s\n", e.what());
+        AsyncLog::error("Win10Store", "Version check failed: %s", e.what());
         return;
     }
     bool hasAnyNewVersions = false;
     bool hasAnyNewPackageMoniker = false;
     std::vector<Win10StoreNetwork::UpdateInfo> newUpdates;
+    std::vector<std::string> newMonikers;
     for (auto const& e : res.newUpdates) {
         if ((versionType != Win10VersionType::Preview && strncmp(e.packageMoniker.c_str(), "Microsoft.MinecraftUWP_", sizeof("Microsoft.MinecraftUWP_") - 1) == 0) ||
             (versionType == Win10VersionType::Preview && strncmp(e.packageMoniker.c_str(), "Microsoft.MinecraftWindowsBeta_", sizeof("Microsoft.MinecraftWindowsBeta_") - 1) == 0)) {
             std::string mergedString = e.serverId + " " + e.updateId + " " + e.packageMoniker;
             if (knownVersions.count(mergedString) > 0)
                 continue;
-            printf("New UWP version: %s\n", mergedString.c_str());
+            AsyncLog::info("Win10Store", "New UWP version: %s", mergedString.c_str());
             hasAnyNewVersions = true;
             knownVersions.insert(mergedString);
             newUpdates.push_back(e);
             if (knownPackageMonikers.count(e.packageMoniker) == 0) {
                 hasAnyNewPackageMoniker = true;
                 knownPackageMonikers.insert(e.packageMoniker);
+                newMonikers.push_back(e.packageMoniker);
             }
         }
     }
@@ -133,18 +137,25 @@ void Win10StoreManager::checkVersion(Win10StoreNetwork& net, Win10StoreNetwork::
             Win10StoreNetwork::UpdateInfo const& b) {
         return a.packageMoniker < b.packageMoniker;
     });
+    if (hasAnyNewVersions) {
+        // The notification has to be stored before the known versions are, so that it can't get lost
+        try {
+            notifications.append(NEW_VERSION_NOTIFICATION,
+                                 Win10NewVersionEvent {newUpdates, versionType, hasAnyNewPackageMoniker}.toJson());
+        } catch (std::exception& e) {
+            AsyncLog::error("Win10Store", "Failed to store the new version notification: %s", e.what());
+            // Forget about the versions, so that the next check finds them again
+            for (auto const& u : newUpdates)
+                knownVersions.erase(u.serverId + " " + u.updateId + " " + u.packageMoniker);
+            for (auto const& m : newMonikers)
+                knownPackageMonikers.erase(m);
+            return;
+        }
+    }
     if (!res.newCookie.encryptedData.empty())
         cookie = res.newCookie;
     lastSuccessfulCheck = std::chrono::system_clock::now();
-    dataLock.unlock();
-    if (hasAnyNewVersions) {
-        std::lock_guard<std::mutex> lk(newVersionMutex);
-        for (NewVersionCallback const &cb : newVersionCallback)
-            cb(newUpdates, versionType, hasAnyNewPackageMoniker);
-    }
-    dataLock.lock();
     saveConfig();
-    dataLock.unlock();
 }
 
 void Win10StoreManager::startChecking() {
@@ -161,11 +172,12 @@ void Win10StoreManager::runVersionCheckThread() {
             try {
                 wuWithAccount.setAuthTokenBase64(getMsaToken());
             } catch (std::exception& e) {
-                printf("Win10 token refresh failed: %s\n", e.what());
+                AsyncLog::error("Win10Store", "Token refresh failed: %s", e.what());
                 continue;
             }
         }
         checkVersion(wuWithAccount, cookieWithAccount, knownVersionsWithAccount, Win10VersionType::Beta);
+        checkCompletedBus.publish(Win10CheckCompletedEvent());
 
         auto until = std::chrono::system_clock::now() + std::chrono::minutes(10);
         stopCv.wait_until(lk, until);
@@ -11,20 +11,58 @@
 #include <msa/login_manager.h>
 #include <msa/account_manager.h>
 #include "win10_store_network.h"
+#include "event_bus.h"
+#include "notification_outbox.h"
 
 enum class Win10VersionType {
     Release, Beta, Preview
 };
 
+struct Win10NewVersionEvent {
+    std::vector<Win10StoreNetwork::UpdateInfo> updates;
+    Win10VersionType versionType;
+    bool hasAnyNewPackageMoniker;
+
+    nlohmann::json toJson() const {
+        nlohmann::json ret;
+        ret["updates"] = nlohmann::json::array();
+        for (auto const& u : updates)
+            ret["updates"].push_back({{"server_id", u.serverId}, {"update_id", u.updateId},
+                                      {"package_moniker", u.packageMoniker}});
+        ret["version_type"] = (int) versionType;
+        ret["has_any_new_package_moniker"] = hasAnyNewPackageMoniker;
+        return ret;
+    }
+
+    static Win10NewVersionEvent fromJson(nlohmann::json const& j) {
+        Win10NewVersionEvent ret;
+        for (auto const& u : j["updates"]) {
+            Win10StoreNetwork::UpdateInfo info;
+            info.serverId = u["server_id"].get<std::string>();
+            info.updateId = u["update_id"].get<std::string>();
+            info.packageMoniker = u["package_moniker"].get<std::string>();
+            ret.updates.push_back(std::move(info));
+        }
+        ret.versionType = (Win10VersionType) j["version_type"].get<int>();
+        ret.hasAnyNewPackageMoniker = j["has_any_new_package_moniker"].get<bool>();
+        return ret;
+    }
+};
+
+struct Win10CheckCompletedEvent {
+};
+
 class Win10StoreManager {
 
 public:
-    using NewVersionCallback = std::function<void (std::vector<Win10StoreNetwork::UpdateInfo> const& update,
-            Win10VersionType versionType, bool hasAnyNewPackageMoniker)>;
+    // Delivered at least once from the notification outbox, throws to have the notification redelivered
+    using NewVersionSubscriber = std::function<void (long long notificationId, Win10NewVersionEvent const& event)>;
+    using CheckCompletedCallback = std::function<void ()>;
 
 private:
     static const char* const MINECRAFT_APP_ID;
     static const char* const MINECRAFT_PREVIEW_APP_ID;
+    static const char* const NEW_VERSION_NOTIFICATION;
 
     std::thread thread;
     std::mutex threadMutex, dataMutex;
@@ -33,8 +71,9 @@ private:
     std::set<std::string> knownVersions;
     std::set<std::string> knownVersionsWithAccount;
     std::set<std::string> knownPackageMonikers;
-    std::mutex newVersionMutex;
-    std::vector<NewVersionCallback> newVersionCallback;
+    NotificationOutbox& notifications;
+    // The subscribers run on the thread of the bus, so that a slow one never delays the next check
+    EventBus<Win10CheckCompletedEvent> checkCompletedBus;
     msa::SimpleStorageManager msaStorage;
     msa::LoginManager msaLoginManager;
     msa::AccountManager msaAccountManager;
@@ -55,7 +94,9 @@ private:
             std::set<std::string>& knownVersions, Win10VersionType versionType);
 
 public:
-    Win10StoreManager() : msaStorage("priv/msa/"), msaLoginManager(&msaStorage), msaAccountManager(msaStorage) {}
+    explicit Win10StoreManager(NotificationOutbox& notifications) : notifications(notifications),
+            checkCompletedBus("Win10StoreManager.checkCompleted"), msaStorage("priv/msa/"),
+            msaLoginManager(&msaStorage), msaAccountManager(msaStorage) {}
 
     ~Win10StoreManager() {
         threadMutex.lock();
@@ -66,9 +107,19 @@ public:
             thread.join();
     }
 
-    void addNewVersionCallback(NewVersionCallback callback) {
-        std::lock_guard<std::mutex> lk(newVersionMutex);
-        newVersionCallback.emplace_back(callback);
+    // Every new version is delivered, even if it was detected before a crash or an outage. Must be called before
+    // the outbox is started
+    void addNewVersionSubscriber(std::string const& name, NewVersionSubscriber subscriber) {
+        notifications.subscribe(name, NEW_VERSION_NOTIFICATION, [subscriber](Notification const& n) {
+            subscriber(n.id, Win10NewVersionEvent::fromJson(n.data));
+        });
+    }
+
+    // Called after each round of checks of all the version types
+    void addCheckCompletedCallback(CheckCompletedCallback callback) {
+        checkCompletedBus.subscribe([callback](Win10CheckCompletedEvent const&) {
+            callback();
+        });
     }
 
     void init();
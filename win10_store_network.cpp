@@ -1,4 +1,5 @@
 #include "win10_store_network.h"
+#include "async_log.h"
 
 #include <cstdlib>
 #include <rapidxml.hpp>
@@ -261,7 +262,7 @@ size_t Win10StoreNetwork::httpOnWrite(char *ptr, size_t size, size_t nmemb, void
 }
 
 void Win10StoreNetwork::doHttpRequest(const char *url, const char *data, std::string &ret) {
-    printf("Request with body: %s\n", data);
+    AsyncLog::debug("Win10StoreNetwork", "Request with body: %s", data);
 
     CURL* curl = curl_easy_init();
     curl_easy_setopt(curl, CURLOPT_URL, url);
@@ -281,12 +282,33 @@ void Win10StoreNetwork::doHttpRequest(const char *url, const char *data, std::st
     curl_easy_cleanup(curl);
     curl_slist_free_all(headers);
 
-    printf("Response: %s\n", ret.c_str());
+    AsyncLog::debug("Win10StoreNetwork", "Response: %s", ret.c_str());
 
     if (res != CURLE_OK)
         throw std::runtime_error("doHttpRequest: res not ok");
 }
 
+long long Win10StoreNetwork::getFileSize(std::string const& url) {
+    CURL* curl = curl_easy_init();
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 30L);
+
+    CURLcode res = curl_easy_perform(curl);
+    long status = 0;
+    curl_off_t size = -1;
+    if (res == CURLE_OK) {
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+        curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &size);
+    }
+    curl_easy_cleanup(curl);
+
+    if (res != CURLE_OK || status != 200)
+        return -1;
+    return (long long) size;
+}
+
 void Win10StoreNetwork::maybeThrowSOAPFault(rapidxml::xml_document<> &doc) {
     std::string code;
     try {
@@ -393,7 +415,7 @@ Win10StoreNetwork::DownloadLinkResult Win10StoreNetwork::getDownloadLink(
 }
 
 void Win10StoreNetwork::UpdateInfo::addXmlInfo(char *val) {
-    printf("%s\n", val);
+    AsyncLog::trace("Win10StoreNetwork", "Update info: %s", val);
     xml_document<> doc;
     doc.parse<0>(val);
     auto& identity = firstNodeOrThrow(doc, "UpdateIdentity");
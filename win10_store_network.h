@@ -87,4 +87,7 @@ public:
 
     DownloadLinkResult getDownloadLink(std::string const& updateId, int revisionNumber);
 
+    // Asks the CDN with a HEAD request; returns -1 if the size isn't known
+    static long long getFileSize(std::string const& url);
+
 };
\ No newline at end of file
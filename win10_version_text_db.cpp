@@ -0,0 +1,210 @@
+#include "win10_version_text_db.h"
+
+#include <fstream>
+#include <cstring>
+#include <stdexcept>
+#include <nlohmann/json.hpp>
+
+std::string Win10VersionTextDb::Version::toString() const {
+    return std::to_string(major) + "." + std::to_string(minor) + "." + std::to_string(patch) + "." +
+            std::to_string(revision);
+}
+
+std::vector<Win10VersionTextDb::VersionInfo> const& Win10VersionTextDb::getListFor(Win10VersionType type) const {
+    if (type == Win10VersionType::Release)
+        return releaseList;
+    if (type == Win10VersionType::Beta)
+        return betaList;
+    if (type == Win10VersionType::Preview)
+        return previewList;
+    throw std::runtime_error("bad version type in getListFor");
+}
+
+std::string& Win10VersionTextDb::getTextFor(Win10VersionType type) {
+    if (type == Win10VersionType::Release)
+        return releaseText;
+    if (type == Win10VersionType::Beta)
+        return betaText;
+    if (type == Win10VersionType::Preview)
+        return previewText;
+    throw std::runtime_error("bad version type in getTextFor");
+}
+
+void Win10VersionTextDb::clear() {
+    releaseList.clear();
+    betaList.clear();
+    previewList.clear();
+    releaseText.clear();
+    betaText.clear();
+    previewText.clear();
+    jsonIndex.clear();
+    textCacheValid = false;
+    jsonCacheValid = false;
+}
+
+void Win10VersionTextDb::add(Win10VersionType type, VersionInfo info) {
+    std::string& text = getTextFor(type);
+    text += info.uuid;
+    text += ' ';
+    text += info.fileName;
+    if (!info.serverId.empty()) {
+        text += ' ';
+        text += info.serverId;
+    }
+    text += '\n';
+    textCacheValid = false;
+
+    addToJsonIndex(info, type);
+    if (type == Win10VersionType::Release)
+        releaseList.push_back(std::move(info));
+    else if (type == Win10VersionType::Beta)
+        betaList.push_back(std::move(info));
+    else
+        previewList.push_back(std::move(info));
+}
+
+void Win10VersionTextDb::addToJsonIndex(VersionInfo const& info, Win10VersionType type) {
+    if (info.fileName.find(".0_x64") == std::string::npos)
+        return;
+    auto version = convertVersion(info.fileName);
+    // Releases take precedence over betas, and betas over previews; otherwise the first entry wins
+    auto it = jsonIndex.find(version);
+    if (it != jsonIndex.end() && it->second.versionType <= (int) type)
+        return;
+    JsonElement el;
+    el.versionType = (int) type;
+    el.serialized = nlohmann::json::array({version.toString(), info.uuid, el.versionType}).dump();
+
+    bool isAppend = (it == jsonIndex.end() && (jsonIndex.empty() || jsonIndex.rbegin()->first < version));
+    if (isAppend && jsonCacheValid) {
+        // Fast path: new versions almost always sort last, so just extend the cached array
+        jsonCache.pop_back();
+        if (!jsonIndex.empty())
+            jsonCache += ',';
+        jsonCache += el.serialized;
+        jsonCache += ']';
+    } else {
+        jsonCacheValid = false;
+    }
+    jsonIndex[version] = std::move(el);
+}
+
+void Win10VersionTextDb::read(std::string const &filePath) {
+    std::ifstream ifs(filePath);
+    read(ifs);
+}
+
+void Win10VersionTextDb::read(std::istream &ifs) {
+    clear();
+    std::string line;
+    Win10VersionType versionType = Win10VersionType::Release;
+    while (std::getline(ifs, line)) {
+        if (line == "Releases")
+            versionType = Win10VersionType::Release;
+        if (line == "Beta")
+            versionType = Win10VersionType::Beta;
+        if (line == "Preview")
+            versionType = Win10VersionType::Preview;
+        auto iof = line.find(' ');
+        if (iof == std::string::npos)
+            continue;
+        auto iof2 = line.find(' ', iof + 1);
+        VersionInfo vi = {line.substr(0, iof), line.substr(iof + 1, iof2 != std::string::npos ? iof2 - iof - 1 : iof2)};
+        if (iof2 != std::string::npos)
+            vi.serverId = line.substr(iof2 + 1);
+        add(versionType, std::move(vi));
+    }
+}
+
+std::string const& Win10VersionTextDb::getText() {
+    if (!textCacheValid) {
+        textCache.clear();
+        textCache.reserve(releaseText.size() + betaText.size() + previewText.size() + 32);
+        textCache += "Releases\n";
+        textCache += releaseText;
+        textCache += "\nBeta\n";
+        textCache += betaText;
+        textCache += "\nPreview\n";
+        textCache += previewText;
+        textCache += "\n";
+        textCacheValid = true;
+    }
+    return textCache;
+}
+
+std::string const& Win10VersionTextDb::getJson() {
+    if (!jsonCacheValid) {
+        jsonCache = "[";
+        for (auto const& el : jsonIndex) {
+            if (jsonCache.size() > 1)
+                jsonCache += ',';
+            jsonCache += el.second.serialized;
+        }
+        jsonCache += "]";
+        jsonCacheValid = true;
+    }
+    return jsonCache;
+}
+
+void Win10VersionTextDb::write(std::string const &filePath) {
+    std::string const& text = getText();
+    std::ofstream ofs(filePath);
+    ofs.write(text.data(), text.size());
+}
+
+void Win10VersionTextDb::writeJson(std::string const &filePath) {
+    std::string const& json = getJson();
+    std::ofstream ofs(filePath);
+    ofs.write(json.data(), json.size());
+}
+
+static bool parseVersionComponent(const char*& it, int& ret) {
+    if (*it < '0' || *it > '9')
+        return false;
+    ret = 0;
+    for (int digits = 0; *it >= '0' && *it <= '9'; digits++) {
+        if (digits >= 9)
+            return false;
+        ret = ret * 10 + (*it++ - '0');
+    }
+    return true;
+}
+
+Win10VersionTextDb::Version Win10VersionTextDb::convertVersion(std::string const &ver) {
+    // Equivalent to: Microsoft\.(?:MinecraftUWP|MinecraftWindowsBeta)_([0-9]+)\.([0-9]+)\.([0-9]+)\..*__8wekyb3d8bbwe.*
+    static const char PREFIX_RELEASE[] = "Microsoft.MinecraftUWP_";
+    static const char PREFIX_PREVIEW[] = "Microsoft.MinecraftWindowsBeta_";
+    static const char PUBLISHER_ID[] = "__8wekyb3d8bbwe";
+    const char* it = ver.c_str();
+    if (strncmp(it, PREFIX_RELEASE, sizeof(PREFIX_RELEASE) - 1) == 0)
+        it += sizeof(PREFIX_RELEASE) - 1;
+    else if (strncmp(it, PREFIX_PREVIEW, sizeof(PREFIX_PREVIEW) - 1) == 0)
+        it += sizeof(PREFIX_PREVIEW) - 1;
+    else
+        throw std::runtime_error("convertVersion: bad package name");
+    int major, minor, patch;
+    if (!parseVersionComponent(it, major) || *(it++) != '.' ||
+        !parseVersionComponent(it, minor) || *(it++) != '.' ||
+        !parseVersionComponent(it, patch) || *(it++) != '.')
+        throw std::runtime_error("convertVersion: bad version");
+    if (strstr(it, PUBLISHER_ID) == nullptr)
+        throw std::runtime_error("convertVersion: bad publisher id");
+    if (major == 0 && minor < 1000)
+        return {major, minor / 10, minor % 10, patch};
+    if (major == 0)
+        return {major, minor / 100, minor % 100, patch};
+    return {major, minor, patch / 100, patch % 100};
+}
+
+std::string Win10VersionTextDb::getArchitecture(std::string const& packageMoniker) {
+    // <name>_<version>_<architecture>_<resource id>_<publisher id>
+    auto start = packageMoniker.find('_');
+    if (start != std::string::npos)
+        start = packageMoniker.find('_', start + 1);
+    if (start == std::string::npos)
+        return std::string();
+    auto end = packageMoniker.find('_', start + 1);
+    if (end == std::string::npos)
+        return std::string();
+    return packageMoniker.substr(start + 1, end - start - 1);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <istream>
+#include "win10_store_manager.h"
+
+class Win10VersionTextDb {
+
+public:
+    struct Version {
+        int major, minor, patch, revision;
+
+        friend bool operator<(Version const& a, Version const& b) {
+            return std::tie(a.major, a.minor, a.patch, a.revision) < std::tie(b.major, b.minor, b.patch, b.revision);
+        }
+
+        std::string toString() const;
+    };
+    struct VersionInfo {
+        std::string uuid;
+        std::string fileName;
+        std::string serverId;
+    };
+
+private:
+    struct JsonElement {
+        int versionType;
+        std::string serialized; // ["<version>","<uuid>",<type>]
+    };
+
+    std::vector<VersionInfo> releaseList, betaList, previewList;
+    // Each section holds the already serialized lines, so that adding an entry is a plain append
+    std::string releaseText, betaText, previewText;
+    // Only the x64 packages end up in the JSON, sorted by the version and deduplicated
+    std::map<Version, JsonElement> jsonIndex;
+    std::string textCache, jsonCache;
+    bool textCacheValid = false, jsonCacheValid = false;
+
+    std::string& getTextFor(Win10VersionType type);
+
+    void addToJsonIndex(VersionInfo const& info, Win10VersionType type);
+
+public:
+    std::vector<VersionInfo> const& getListFor(Win10VersionType type) const;
+
+    static Version convertVersion(std::string const& ver);
+
+    // The architecture part of a package moniker (eg. "x64"), or an empty string if there is none
+    static std::string getArchitecture(std::string const& packageMoniker);
+
+    void clear();
+
+    void add(Win10VersionType type, VersionInfo info);
+
+    void read(std::string const& filePath);
+
+    void read(std::istream& stream);
+
+    void write(std::string const& filePath);
+
+    void writeJson(std::string const& filePath);
+
+    std::string const& getText();
+
+    std::string const& getJson();
+
+};
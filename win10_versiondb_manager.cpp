@@ -1,9 +1,19 @@
 #include "win10_versiondb_manager.h"
+#include "async_log.h"
 #include <playapi/util/config.h>
 #include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <set>
 #include <sys/stat.h>
-#include <nlohmann/json.hpp>
-#include <regex>
+
+// Shallow clones and fetches are only supported since libgit2 1.7
+#if LIBGIT2_VER_MAJOR > 1 || (LIBGIT2_VER_MAJOR == 1 && LIBGIT2_VER_MINOR >= 7)
+#define WIN10_VERSIONDB_SHALLOW_FETCH
+#endif
+
+const int Win10VersionDBManager::INITIAL_PUBLISH_RETRY_DELAY;
+const int Win10VersionDBManager::MAX_PUBLISH_RETRY_DELAY;
 
 Win10VersionDBManager::Win10VersionDBManager() {
     playapi::config conf;
@@ -17,76 +27,239 @@ Win10VersionDBManager::Win10VersionDBManager() {
     userName = conf.get("user.name");
     userEmail = conf.get("user.email");
 
+    coalesceWindow = std::chrono::seconds(conf.get_int("publish.coalesce_window", 60));
+
     struct stat st;
     if (stat(dir.c_str(), &st) != 0 || ((st.st_mode) & S_IFMT) != S_IFDIR) {
         // clone
         git_clone_options opts = GIT_CLONE_OPTIONS_INIT;
-        opts.fetch_opts.callbacks.credentials = createCredentials;
-        opts.fetch_opts.callbacks.payload = this;
-        printf("Cloning win10 versiondb into %s\n", conf.get("url").c_str());
+        setFetchOptions(opts.fetch_opts);
+        AsyncLog::info("Win10VersionDB", "Cloning win10 versiondb into %s", conf.get("url").c_str());
         if (git_clone(repo, conf.get("url").c_str(), dir.c_str(), &opts) != 0)
             throw GitError("git_clone");
-        printf("Cloning done\n");
+        AsyncLog::info("Win10VersionDB", "Cloning done");
     } else {
         if (git_repository_init(repo, dir.c_str(), 0) != 0)
             throw GitError("git_repository_init");
     }
 
-    Win10VersionTextDb textDb;
-    textDb.read(dir + "versions.txt");
+    // The DB is read from the object database rather than the worktree, which is only a copy for local readers
+    git_oid head;
+    if (git_reference_name_to_id(&head, repo, "HEAD"))
+        throw GitError("git_reference_name_to_id");
+    loadDb(head, textDb);
+    if (git_reference_name_to_id(&baseCommit, repo, "refs/remotes/origin/master"))
+        baseCommit = head;
+    // Changes committed before a restart might not have been pushed yet
+    if (!git_oid_equal(&head, &baseCommit))
+        hasUnpublishedChanges = true;
+}
+
+Win10VersionDBManager::~Win10VersionDBManager() {
+    publishMutex.lock();
+    publishStopped = true;
+    publishCv.notify_all();
+    publishMutex.unlock();
+    if (publishThread.joinable())
+        publishThread.join();
+}
+
+void Win10VersionDBManager::startPublishing() {
+    publishThread = std::thread(std::bind(&Win10VersionDBManager::runPublishThread, this));
+}
+
+void Win10VersionDBManager::setFetchOptions(git_fetch_options& opts) {
+    opts.callbacks.credentials = createCredentials;
+    opts.callbacks.payload = this;
+#ifdef WIN10_VERSIONDB_SHALLOW_FETCH
+    opts.depth = 1;
+#endif
+}
+
+void Win10VersionDBManager::loadDb(git_oid const& commitId, Win10VersionTextDb& db) {
+    GitCommit commit;
+    GitTree tree;
+    GitBlob blob;
+    if (git_commit_lookup(commit, repo, &commitId) || git_commit_tree(tree, commit))
+        throw GitError("git_commit_lookup/git_commit_tree");
+    auto entry = git_tree_entry_byname(tree, "versions.txt");
+    if (entry == nullptr) {
+        db.clear();
+        return;
+    }
+    if (git_blob_lookup(blob, repo, git_tree_entry_id(entry)))
+        throw GitError("git_blob_lookup");
+    std::istringstream stream (std::string((const char*) git_blob_rawcontent(blob), (size_t) git_blob_rawsize(blob)));
+    db.read(stream);
+}
+
+void Win10VersionDBManager::writeDb() {
     textDb.write(dir + "versions.txt");
     textDb.writeJson(dir + "versions.json.min");
 }
 
-void Win10VersionDBManager::commitDb(std::string const& commitName) {
+git_oid Win10VersionDBManager::fetchDb() {
+    GitRemote fetchRemote;
+    if (git_remote_lookup(fetchRemote, repo, "origin"))
+        throw GitError("git_remote_lookup");
+    git_fetch_options opts = GIT_FETCH_OPTIONS_INIT;
+    setFetchOptions(opts);
+    if (git_remote_fetch(fetchRemote, nullptr, &opts, nullptr))
+        throw GitError("git_remote_fetch");
+    git_oid ret;
+    if (git_reference_name_to_id(&ret, repo, "refs/remotes/origin/master"))
+        throw GitError("git_reference_name_to_id");
+    return ret;
+}
+
+void Win10VersionDBManager::rebaseDb(git_oid const& originHead) {
+    // Start from what is on origin and re-add whatever we have that it doesn't
+    Win10VersionTextDb originDb;
+    loadDb(originHead, originDb);
+    for (Win10VersionType type : {Win10VersionType::Release, Win10VersionType::Beta, Win10VersionType::Preview}) {
+        std::set<std::string> known;
+        for (auto const& v : originDb.getListFor(type))
+            known.insert(v.uuid + " " + v.fileName);
+        for (auto const& v : textDb.getListFor(type)) {
+            if (known.count(v.uuid + " " + v.fileName) == 0)
+                originDb.add(type, v);
+        }
+    }
+    textDb = std::move(originDb);
+    baseCommit = originHead;
+    notifyChanged();
+}
+
+bool Win10VersionDBManager::commitDb(std::string const& commitName, git_oid const& parentId) {
     GitTreeBuilder bld;
     GitTree parentTree, builtTree;
     git_oid obj; // reused for multiple purposes
 
     GitCommit parent;
-    if (git_reference_name_to_id(&obj, repo, "HEAD") || git_commit_lookup(parent, repo, &obj))
-        throw GitError("git_reference_name_to_id/git_commit_lookup");
+    if (git_commit_lookup(parent, repo, &parentId))
+        throw GitError("git_commit_lookup");
     if (git_commit_tree(parentTree, parent))
         throw GitError("git_commit_tree");
 
     if (git_treebuilder_new(bld, repo, parentTree))
         throw GitError("git_treebuilder_new");
-    for (std::string const& file : {"versions.txt", "versions.json.min"}) {
-        if (git_blob_create_fromworkdir(&obj, repo, file.c_str()))
-            throw GitError("git_blob_create_fromdisk");
-        if (git_treebuilder_insert(nullptr, bld, file.c_str(), &obj, GIT_FILEMODE_BLOB))
+    std::pair<const char*, std::string const*> files[] = {
+            {"versions.txt", &textDb.getText()},
+            {"versions.json.min", &textDb.getJson()}
+    };
+    for (auto const& file : files) {
+        if (git_blob_create_frombuffer(&obj, repo, file.second->data(), file.second->size()))
+            throw GitError("git_blob_create_frombuffer");
+        if (git_treebuilder_insert(nullptr, bld, file.first, &obj, GIT_FILEMODE_BLOB))
             throw GitError("git_treebuilder_insert");
     }
     if (git_treebuilder_write(&obj, bld))
         throw GitError("git_treebuilder_write");
     bld.reset();
+    if (git_oid_equal(&obj, git_tree_id(parentTree)))
+        return false;
     if (git_tree_lookup(builtTree, repo, &obj))
         throw GitError("git_tree_lookup");
 
     GitSignature sig;
     if (git_signature_now(sig, userName.c_str(), userEmail.c_str()))
         throw GitError("git_signature_new");
-    if (git_commit_create_v(&obj, repo, "HEAD", sig, sig, nullptr, commitName.c_str(), builtTree, 1, parent.ptr))
+    // Not updating HEAD directly: the parent is origin's tip, which unpushed local commits would not descend from
+    if (git_commit_create_v(&obj, repo, nullptr, sig, sig, nullptr, commitName.c_str(), builtTree, 1, parent.ptr))
         throw GitError("git_commit_create_v");
+    GitReference ref;
+    if (git_reference_create(ref, repo, "refs/heads/master", &obj, 1, commitName.c_str()))
+        throw GitError("git_reference_create");
+    return true;
+}
+
+void Win10VersionDBManager::commitLocal(std::string const& commitName) {
+    git_oid head;
+    if (git_reference_name_to_id(&head, repo, "refs/heads/master"))
+        throw GitError("git_reference_name_to_id");
+    if (commitDb(commitName, head))
+        writeDb();
 }
 
 void Win10VersionDBManager::pushDb() {
-    GitRemote  remote;
+    GitRemote remote;
     if (git_remote_lookup(remote, repo, "origin"))
         throw GitError("git_remote_lookup");
-    git_remote_callbacks cbs = GIT_REMOTE_CALLBACKS_INIT;
-    cbs.credentials = createCredentials;
-    cbs.payload = this;
-    if (git_remote_connect(remote, GIT_DIRECTION_PUSH, &cbs, nullptr, nullptr))
-        throw GitError("git_remote_connect");
     git_push_options pushOpt = GIT_PUSH_OPTIONS_INIT;
-    pushOpt.callbacks = cbs;
+    pushOpt.callbacks.credentials = createCredentials;
+    pushOpt.callbacks.payload = this;
     const char* refs_text[] = { "refs/heads/master:refs/heads/master" };
     git_strarray refs = {(char**) refs_text, 1};
     if (git_remote_push(remote, &refs, &pushOpt))
         throw GitError("git_remote_push");
 }
 
+void Win10VersionDBManager::publishDb(std::string const& commitName) {
+    git_oid originHead = fetchDb();
+    {
+        std::lock_guard<std::mutex> lk(fileLock);
+        if (!git_oid_equal(&originHead, &baseCommit))
+            rebaseDb(originHead);
+        AsyncLog::info("Win10VersionDB", "Committing win10 versiondb: %s", commitName.c_str());
+        if (!commitDb(commitName, originHead)) {
+            // Origin has all of it already; drop the local commits, so that a restart doesn't publish them again
+            GitReference ref;
+            if (git_reference_create(ref, repo, "refs/heads/master", &originHead, 1, commitName.c_str()))
+                throw GitError("git_reference_create");
+            return;
+        }
+        writeDb();
+    }
+    pushDb();
+    std::lock_guard<std::mutex> lk(fileLock);
+    if (git_reference_name_to_id(&baseCommit, repo, "refs/heads/master"))
+        throw GitError("git_reference_name_to_id");
+}
+
+void Win10VersionDBManager::runPublishThread() {
+    std::unique_lock<std::mutex> lk(publishMutex);
+    while (!publishStopped) {
+        auto now = std::chrono::steady_clock::now();
+        if (!pendingChanges.empty() && now < pendingSince + coalesceWindow) {
+            // Wait for the rest of the burst
+            publishCv.wait_until(lk, pendingSince + coalesceWindow);
+            continue;
+        }
+        if ((hasUnpublishedChanges || !pendingChanges.empty()) && now >= nextPublishAttempt) {
+            unpublishedChanges.insert(unpublishedChanges.end(), pendingChanges.begin(), pendingChanges.end());
+            pendingChanges.clear();
+            hasUnpublishedChanges = true;
+            std::string commitName;
+            for (auto const& c : unpublishedChanges)
+                commitName += (commitName.empty() ? "" : ", ") + c;
+            if (commitName.empty())
+                commitName = "Update version database";
+            lk.unlock();
+            bool success = true;
+            try {
+                publishDb(commitName);
+            } catch (std::exception& e) {
+                AsyncLog::error("Win10VersionDB", "Failed to publish win10 versiondb (retrying in %is): %s", nextPublishRetryDelay, e.what());
+                success = false;
+            }
+            lk.lock();
+            if (success) {
+                hasUnpublishedChanges = false;
+                unpublishedChanges.clear();
+                nextPublishRetryDelay = INITIAL_PUBLISH_RETRY_DELAY;
+            } else {
+                nextPublishAttempt = std::chrono::steady_clock::now() + std::chrono::seconds(nextPublishRetryDelay);
+                nextPublishRetryDelay = std::min(nextPublishRetryDelay * 2, MAX_PUBLISH_RETRY_DELAY);
+            }
+            continue;
+        }
+        if (hasUnpublishedChanges || !pendingChanges.empty())
+            publishCv.wait_until(lk, nextPublishAttempt);
+        else
+            publishCv.wait(lk);
+    }
+}
+
 int Win10VersionDBManager::createCredentials(git_cred **cred, const char *url, const char *username_from_url,
                                              unsigned int allowed_types, void *payload) {
     if (!(allowed_types & GIT_CREDTYPE_SSH_KEY)) {
@@ -96,130 +269,69 @@ int Win10VersionDBManager::createCredentials(git_cred **cred, const char *url, c
     int ret = git_cred_ssh_key_new(cred, username_from_url, th->sshPubkeyPath.c_str(), th->sshPrivkeyPath.c_str(),
             th->sshPassphrase.c_str());
     if (ret != 0)
-        printf("git_cred_ssh_key_new failed: %s\n", giterr_last()->message);
+        AsyncLog::error("Win10VersionDB", "git_cred_ssh_key_new failed: %s", giterr_last()->message);
     return ret;
 }
 
 void Win10VersionDBManager::addWin10StoreMgr(Win10StoreManager &mgr) {
     using namespace std::placeholders;
-    mgr.addNewVersionCallback(std::bind(&Win10VersionDBManager::onNewWin10Version, this, _1, _2));
+    mgr.addNewVersionSubscriber("versiondb.win10", std::bind(&Win10VersionDBManager::onNewWin10Version, this, _1, _2));
 }
 
-void Win10VersionDBManager::onNewWin10Version(std::vector<Win10StoreNetwork::UpdateInfo> const &u, Win10VersionType versionType) {
-    if (u.empty())
-        return;
-    Win10VersionTextDb textDb;
-    textDb.read(dir + "versions.txt");
-    auto& textList = textDb.getListFor(versionType);
-    for (auto const& v : u)
-        textList.push_back({v.updateId, v.packageMoniker, v.serverId});
-    textDb.write(dir + "versions.txt");
-    textDb.writeJson(dir + "versions.json.min");
-    std::stringstream commitName;
-    commitName << "Minecraft ";
-    auto ver = Win10VersionTextDb::convertVersion(u[0].packageMoniker);
-    commitName << ver.major << "." << ver.minor << "." << ver.patch << "." << ver.revision;
-    if (versionType == Win10VersionType::Beta)
-        commitName << " (Beta)";
-    if (versionType == Win10VersionType::Preview)
-        commitName << " (Preview)";
-    commitDb(commitName.str());
-    pushDb();
+void Win10VersionDBManager::addChangeCallback(ChangeCallback callback) {
+    std::lock_guard<std::mutex> lk(fileLock);
+    callback(textDb);
+    changeCallbacks.push_back(std::move(callback));
 }
 
-std::vector<Win10VersionTextDb::VersionInfo>& Win10VersionTextDb::getListFor(Win10VersionType type) {
-    if (type == Win10VersionType::Release)
-        return releaseList;
-    if (type == Win10VersionType::Beta)
-        return betaList;
-    if (type == Win10VersionType::Preview)
-        return previewList;
-    throw std::runtime_error("bad version type in getListFor");
-}
-
-void Win10VersionTextDb::read(std::string const &filePath) {
-    std::ifstream ifs(filePath);
-    std::string line;
-    Win10VersionType versionType = Win10VersionType::Release;
-    while (std::getline(ifs, line)) {
-        if (line == "Releases")
-            versionType = Win10VersionType::Release;
-        if (line == "Beta")
-            versionType = Win10VersionType::Beta;
-        if (line == "Preview")
-            versionType = Win10VersionType::Preview;
-        auto iof = line.find(' ');
-        if (iof == std::string::npos)
-            continue;
-        auto iof2 = line.find(' ', iof + 1);
-        VersionInfo vi = {line.substr(0, iof), line.substr(iof + 1, iof2 != std::string::npos ? iof2 - iof - 1 : iof2)};
-        if (iof2 != std::string::npos)
-            vi.serverId = line.substr(iof2 + 1);
-        getListFor(versionType).push_back(std::move(vi));
+void Win10VersionDBManager::notifyChanged() {
+    for (auto const& cb : changeCallbacks) {
+        try {
+            cb(textDb);
+        } catch (std::exception& e) {
+            AsyncLog::error("Win10VersionDB", "Error processing versiondb change callback: %s", e.what());
+        }
     }
 }
 
-void Win10VersionTextDb::write(std::string const &filePath) {
-    std::ofstream ofs(filePath);
-    ofs << "Releases\n";
-    for (auto const& v : releaseList)
-        ofs << v.uuid << " " << v.fileName << (v.serverId.empty() ? "" : " ") << v.serverId << "\n";
-    ofs << "\n";
-    ofs << "Beta\n";
-    for (auto const& v : betaList)
-        ofs << v.uuid << " " << v.fileName << (v.serverId.empty() ? "" : " ") << v.serverId << "\n";
-    ofs << "\n";
-    ofs << "Preview\n";
-    for (auto const& v : previewList)
-        ofs << v.uuid << " " << v.fileName << (v.serverId.empty() ? "" : " ") << v.serverId << "\n";
-    ofs << "\n";
-}
-
-void Win10VersionTextDb::writeJson(std::string const &filePath) {
-    nlohmann::json j = nlohmann::json::array();
-    struct Element {
-        Version version;
-        std::string uuid;
-        int versionType;
-    };
-    std::vector<Element> elements;
-    std::set<Version> addedVersions;
-    auto addVersions = [&elements, &addedVersions](std::vector<VersionInfo> const& list, int versionType) {
-        for (auto const& v : list) {
-            auto cvVersion = convertVersion(v.fileName);
-            if (v.fileName.find(".0_x64") != std::string::npos && addedVersions.count(cvVersion) == 0) {
-                elements.push_back({cvVersion, v.uuid, versionType});
-                addedVersions.insert(cvVersion);
-            }
+void Win10VersionDBManager::onNewWin10Version(long long notificationId, Win10NewVersionEvent const& event) {
+    auto const& u = event.updates;
+    Win10VersionType versionType = event.versionType;
+    if (u.empty())
+        return;
+    std::string commitName = "Minecraft " + Win10VersionTextDb::convertVersion(u[0].packageMoniker).toString();
+    if (versionType == Win10VersionType::Beta)
+        commitName += " (Beta)";
+    if (versionType == Win10VersionType::Preview)
+        commitName += " (Preview)";
+    {
+        std::lock_guard<std::mutex> lk(fileLock);
+        auto const& known = textDb.getListFor(versionType);
+        bool anyAdded = false;
+        for (auto const& v : u) {
+            bool isKnown = std::any_of(known.begin(), known.end(), [&v](Win10VersionTextDb::VersionInfo const& i) {
+                return i.uuid == v.updateId;
+            });
+            if (isKnown)
+                continue;
+            textDb.add(versionType, {v.updateId, v.packageMoniker, v.serverId});
+            anyAdded = true;
         }
-    };
-    addVersions(releaseList, 0);
-    addVersions(betaList, 1);
-    addVersions(previewList, 2);
-    std::sort(elements.begin(), elements.end(), [](Element const& a, Element const& b) {
-        return a.version < b.version;
-    });
-    for (auto const& el : elements) {
-        std::stringstream ver;
-        ver << el.version.major << "." << el.version.minor << "." << el.version.patch << "." << el.version.revision;
-        j.push_back({ver.str(), el.uuid, el.versionType});
+        if (anyAdded) {
+            notifyChanged();
+            hasUncommittedChanges = true;
+        }
+        // A redelivery after a failed commit has nothing to add, but it still mustn't be acked before the commit
+        if (!hasUncommittedChanges)
+            return;
+        // Throws, so that the outbox delivers the notification again
+        commitLocal(commitName);
+        hasUncommittedChanges = false;
     }
-
-    std::ofstream ofs(filePath);
-    ofs << j;
-}
-
-Win10VersionTextDb::Version Win10VersionTextDb::convertVersion(std::string const &ver) {
-    static std::regex regex (R"(Microsoft\.(?:MinecraftUWP|MinecraftWindowsBeta)_([0-9]+)\.([0-9]+)\.([0-9]+)\..*__8wekyb3d8bbwe.*)");
-    std::smatch match;
-    if (!std::regex_match(ver, match, regex))
-        throw std::runtime_error("regex_match failed");
-    int major = std::stoi(match[1]);
-    int minor = std::stoi(match[2]);
-    int patch = std::stoi(match[3]);
-    if (major == 0 && minor < 1000)
-        return {major, minor / 10, minor % 10, patch};
-    if (major == 0)
-        return {major, minor / 100, minor % 100, patch};
-    return {major, minor, patch / 100, patch % 100};
+    // The fetch, rebase and push happen on the publish thread, so that the outbox never waits on the network
+    std::lock_guard<std::mutex> lk(publishMutex);
+    if (pendingChanges.empty())
+        pendingSince = std::chrono::steady_clock::now();
+    pendingChanges.push_back(std::move(commitName));
+    publishCv.notify_all();
 }
\ No newline at end of file
@@ -4,7 +4,12 @@
 #include <string>
 #include <stdexcept>
 #include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include "win10_store_manager.h"
+#include "win10_version_text_db.h"
 
 template <typename T, void FreeFunc(T*)>
 struct GitPtr {
@@ -30,37 +35,20 @@ using GitCommit = GitPtr<git_commit, git_commit_free>;
 using GitTree = GitPtr<git_tree, git_tree_free>;
 using GitTreeBuilder = GitPtr<git_treebuilder, git_treebuilder_free>;
 using GitRemote = GitPtr<git_remote, git_remote_free>;
+using GitBlob = GitPtr<git_blob, git_blob_free>;
+using GitReference = GitPtr<git_reference, git_reference_free>;
 
 
-struct Win10VersionTextDb {
-    struct Version {
-        int major, minor, patch, revision;
-
-        friend bool operator<(Version const& a, Version const& b) {
-            return std::tie(a.major, a.minor, a.patch, a.revision) < std::tie(b.major, b.minor, b.patch, b.revision);
-        }
-    };
-    struct VersionInfo {
-        std::string uuid;
-        std::string fileName;
-        std::string serverId;
-    };
-    std::vector<VersionInfo> releaseList, betaList, previewList;
-
-    std::vector<VersionInfo> &getListFor(Win10VersionType type);
-
-    static Version convertVersion(std::string const& ver);
-
-    void read(std::string const& filePath);
-
-    void write(std::string const& filePath);
-
-    void writeJson(std::string const& filePath);
-};
-
 class Win10VersionDBManager {
 
+public:
+    // Invoked with the file lock held whenever the in-memory DB changes
+    using ChangeCallback = std::function<void (Win10VersionTextDb& db)>;
+
 private:
+    static const int INITIAL_PUBLISH_RETRY_DELAY = 5; // seconds
+    static const int MAX_PUBLISH_RETRY_DELAY = 10 * 60;
+
     const std::string dir = "priv/win10_verdb/";
     GitRepository repo;
     std::string sshPrivkeyPath;
@@ -69,19 +57,63 @@ private:
     std::string userName;
     std::string userEmail;
     std::mutex fileLock;
+    Win10VersionTextDb textDb;
+    git_oid baseCommit; // the origin commit textDb was built on
+    bool hasUncommittedChanges = false; // textDb has versions that commitLocal() failed to record
+    std::vector<ChangeCallback> changeCallbacks;
+
+    std::thread publishThread;
+    std::mutex publishMutex;
+    std::condition_variable publishCv;
+    bool publishStopped = false;
+    std::chrono::seconds coalesceWindow;
+    std::vector<std::string> pendingChanges, unpublishedChanges;
+    std::chrono::steady_clock::time_point pendingSince;
+    bool hasUnpublishedChanges = false;
+    std::chrono::steady_clock::time_point nextPublishAttempt;
+    int nextPublishRetryDelay = INITIAL_PUBLISH_RETRY_DELAY;
 
     static int createCredentials(git_cred **cred, const char *url, const char *username_from_url,
             unsigned int allowed_types, void *payload);
 
-    void commitDb(std::string const& commitName);
+    void setFetchOptions(git_fetch_options& opts);
+
+    void loadDb(git_oid const& commitId, Win10VersionTextDb& db);
+
+    void writeDb();
+
+    git_oid fetchDb();
+
+    void rebaseDb(git_oid const& originHead);
+
+    bool commitDb(std::string const& commitName, git_oid const& parentId);
+
+    // Called with the file lock held; records the DB on top of the local master right away, so that the versions
+    // added while waiting for the coalesce window survive a restart; publishDb() replaces these commits with one
+    // on top of origin
+    void commitLocal(std::string const& commitName);
 
     void pushDb();
 
+    void publishDb(std::string const& commitName);
+
+    void runPublishThread();
+
+    void notifyChanged();
+
 public:
     Win10VersionDBManager();
 
+    ~Win10VersionDBManager();
+
+    void startPublishing();
+
     void addWin10StoreMgr(Win10StoreManager& mgr);
 
-    void onNewWin10Version(std::vector<Win10StoreNetwork::UpdateInfo> const& u, Win10VersionType versionType);
+    void addChangeCallback(ChangeCallback callback);
+
+    // Runs on the notification outbox and returns once the versions are committed locally, throwing otherwise;
+    // versions that are already in the DB (a redelivery) are skipped
+    void onNewWin10Version(long long notificationId, Win10NewVersionEvent const& event);
 
 };
\ No newline at end of file
@@ -0,0 +1,54 @@
+#include "worker_pool.h"
+#include "async_log.h"
+
+WorkerPool::WorkerPool(int threadCount, size_t maxQueued) : maxQueued(maxQueued) {
+    for (int i = 0; i < threadCount; i++)
+        threads.emplace_back(std::bind(&WorkerPool::runWorker, this));
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        stopped = true;
+    }
+    queueCv.notify_all();
+    for (auto& t : threads)
+        t.join();
+}
+
+void WorkerPool::post(std::function<void ()> task) {
+    std::unique_lock<std::mutex> lk(mutex);
+    spaceCv.wait(lk, [this]() { return queue.size() < maxQueued; });
+    queue.push_back(std::move(task));
+    lk.unlock();
+    queueCv.notify_one();
+}
+
+bool WorkerPool::tryPost(std::function<void ()> task) {
+    std::unique_lock<std::mutex> lk(mutex);
+    if (queue.size() >= maxQueued)
+        return false;
+    queue.push_back(std::move(task));
+    lk.unlock();
+    queueCv.notify_one();
+    return true;
+}
+
+void WorkerPool::runWorker() {
+    std::unique_lock<std::mutex> lk(mutex);
+    while (true) {
+        queueCv.wait(lk, [this]() { return stopped || !queue.empty(); });
+        if (queue.empty())
+            break;
+        std::function<void ()> task = std::move(queue.front());
+        queue.pop_front();
+        lk.unlock();
+        spaceCv.notify_one();
+        try {
+            task();
+        } catch (std::exception& e) {
+            AsyncLog::error("WorkerPool", "Task failed: %s", e.what());
+        }
+        lk.lock();
+    }
+}
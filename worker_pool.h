@@ -0,0 +1,36 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+/**
+ * A fixed set of threads running posted tasks in order. The queue is bounded: posting blocks while it is full.
+ */
+class WorkerPool {
+
+private:
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable queueCv, spaceCv;
+    std::deque<std::function<void ()>> queue;
+    size_t maxQueued;
+    bool stopped = false;
+
+    void runWorker();
+
+public:
+    WorkerPool(int threadCount, size_t maxQueued);
+
+    // Runs the tasks that are already queued and stops the threads
+    ~WorkerPool();
+
+    void post(std::function<void ()> task);
+
+    // Same as post(), but returns false instead of waiting if the queue is full
+    bool tryPost(std::function<void ()> task);
+
+};